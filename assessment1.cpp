@@ -1,8 +1,24 @@
+#include <algorithm>
+#include <chrono>
+#include <deque>
 #include <iostream>
+#include <thread>
 #include <vector>
 
 #include "include/Utils.h"
 #include "include/CImg.h"
+#include "equalizer.h"
+#include "benchmarks.h"
+#include "batch.h"
+#include "cpu_backend.h"
+#include "thread_pool.h"
+#include "pgm_stream.h"
+#include "coprocess.h"
+#include "router.h"
+#include "server.h"
+#include "scheduler.h"
+#include "metrics.h"
+#include "latency_histogram.h"
 
 using namespace cimg_library;
 
@@ -12,20 +28,192 @@ void print_help() {
     std::cerr << "  -d : select device" << std::endl;
     std::cerr << "  -l : list all platforms and devices" << std::endl;
     std::cerr << "  -f : input image file (default: test.pgm)" << std::endl;
+    std::cerr << "  -u : use compact uchar lookup table staged in local memory" << std::endl;
+    std::cerr << "  -s : specialise kernels with compile-time bin count and image size" << std::endl;
+    std::cerr << "  -ppi : pixels processed per work item (default: 1)" << std::endl;
+    std::cerr << "  -scan : cumulative histogram method, auto, seq or block (default: auto)" << std::endl;
+    std::cerr << "  -hist : histogram kernel, auto, global, local or replicated (default: auto)" << std::endl;
+    std::cerr << "  -plan : histogram planner thresholds file (default: histogram_plan.txt)" << std::endl;
+    std::cerr << "  -progressive : show an equalised preview downsampled by this factor before the full image" << std::endl;
+    std::cerr << "  -fused : compute the histogram while reading a binary PGM, the device only applies the LUT" << std::endl;
+    std::cerr << "  -coproc : share the histogram and apply passes between host threads and the device" << std::endl;
+    std::cerr << "  -chunk : pixels per co-processing chunk (default: 4194304)" << std::endl;
+    std::cerr << "  -route : run each image on the host or the device, whichever the cost model predicts is faster" << std::endl;
+    std::cerr << "  -profile : routing cost profile, calibrated and saved when missing (default: route_profile.txt)" << std::endl;
+    std::cerr << "  -inplace : write the equalised image over the input on the device and host, halving image memory" << std::endl;
+    std::cerr << "  -wide : 64-bit indices and counters, automatic for images of 2^31 pixels or more" << std::endl;
+#ifndef _WIN32
+    std::cerr << "  -serve : keep the device warm and equalise images sent to this Unix socket" << std::endl;
+    std::cerr << "  -connect : send the input image to a server on this Unix socket" << std::endl;
+    std::cerr << "  -metrics : in server and batch mode, serve Prometheus metrics over HTTP on this Unix socket path or local port" << std::endl;
+    std::cerr << "  -latency-report : in server and batch mode, print latency percentiles every this many seconds, 0 only at exit (default: 10)" << std::endl;
+    std::cerr << "  -batch-max : with -serve, equalise up to this many concurrent requests in one batch (default: 1)" << std::endl;
+    std::cerr << "  -batch-wait : with -serve, longest a request waits for a batch to fill, in ms (default: 2)" << std::endl;
+    std::cerr << "  -max-pixels : with -serve, largest image accepted in pixels (default: what one device allocation holds)" << std::endl;
+#endif
+#ifdef __linux__
+    std::cerr << "  -shm-serve : equalise images producers write into this shared memory ring, e.g. /heq" << std::endl;
+    std::cerr << "  -shm-connect : send the input image through this shared memory ring" << std::endl;
+    std::cerr << "  -slots : shared memory ring slots (default: 4)" << std::endl;
+    std::cerr << "  -slot-size : bytes per shared memory ring slot (default: 67108864)" << std::endl;
+#endif
+    std::cerr << "  -mem-budget : device memory budget in MiB, runs wait for memory and larger images are tiled (default and most: 80% of device memory)" << std::endl;
+    std::cerr << "  -async : keep this many copies of the image in flight through the asynchronous API" << std::endl;
+    std::cerr << "  -coro : equalise this many copies of the image as coroutines awaiting the device events" << std::endl;
+    std::cerr << "  -schedule : equalise this many bulk copies of the image, chunked on a low priority queue, while quarter size interactive copies arrive" << std::endl;
+    std::cerr << "  -deadline : interactive deadline and arrival period with -schedule, in ms (default: 20)" << std::endl;
+    std::cerr << "  -bulk-deadline : bulk deadline with -schedule, in ms (default: 10000)" << std::endl;
+    std::cerr << "  -batch : equalise every image listed in a file with batched launches" << std::endl;
+    std::cerr << "  -bench : run a benchmark instead of equalising an image (scan, hist, approx, cpu, route)" << std::endl;
+    std::cerr << "  --approx : build the histogram from every k-th pixel" << std::endl;
+    std::cerr << "  -cpu : equalise on the host instead of an OpenCL device" << std::endl;
+    std::cerr << "  -threads : host worker threads (default: one per hardware thread)" << std::endl;
+    std::cerr << "  -pin : pin each host worker thread to a core" << std::endl;
     std::cerr << "  -h : print this message" << std::endl;
 }
 
+// true when the platform and device ids refer to an OpenCL device
+bool DeviceAvailable(int platform_id, int device_id) {
+    try {
+        std::vector<cl::Platform> platforms;
+        cl::Platform::get(&platforms);
+        if (platform_id < 0 || platform_id >= (int)platforms.size())
+            return false;
+
+        std::vector<cl::Device> devices;
+        platforms[platform_id].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+        return device_id >= 0 && device_id < (int)devices.size();
+    }
+    catch (const cl::Error&) {
+        return false;
+    }
+}
+
+// Load the routing profile, or measure this device and pool and save it for the next run
+void LoadOrCalibrate(Router& router, Equalizer& equalizer, ThreadPool& pool, const std::string& profile_file) {
+    if (router.Load(profile_file)) {
+        std::cout << "Loaded routing profile from " << profile_file << std::endl;
+        return;
+    }
+
+    router.Calibrate(equalizer, pool);
+    if (router.Save(profile_file))
+        std::cout << "Saved routing profile to " << profile_file << std::endl;
+}
+
+// Equalise on the CPU backend, from the histogram streamed out of the file when there is one [s]
+double EqualizeOnHost(const CImg<unsigned char>& image, const std::vector<int>& streamed_histogram,
+    unsigned char* output, ThreadPool& pool) {
+    auto start = std::chrono::steady_clock::now();
+    if (!streamed_histogram.empty())
+        EqualizeFromHistogramCPU(image.data(), image.size(), streamed_histogram, output, &pool, image.width());
+    else
+        EqualizeCPU(image.data(), image.size(), output, &pool, image.width());
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Display images until closed
+void DisplayUntilClosed(CImgDisplay& disp_input, CImgDisplay& disp_output) {
+    unsigned int timeout_counter = 0;
+    const unsigned int max_timeout = 300000; // 5 minutes at 1ms wait intervals
+
+    while (!disp_input.is_closed() && !disp_output.is_closed()
+        && !disp_input.is_keyESC() && !disp_output.is_keyESC()
+        && timeout_counter < max_timeout) {
+        disp_input.wait(1);
+        disp_output.wait(1);
+        timeout_counter++;
+    }
+}
+
 int main(int argc, char** argv) {
     // Part 1 - handle command line options such as device selection, verbosity, etc.
     int platform_id = 0;
     int device_id = 0;
     std::string image_filename = "test.pgm";
+    EqualizeOptions options;
+    std::string benchmark;
+    std::string batch_list;
+    std::string plan_file = "histogram_plan.txt";
+    int preview_factor = 0;
+    bool use_cpu = false;
+    int threads = 0;
+    bool pin_threads = false;
+    bool fused_read = false;
+    bool coprocess = false;
+    size_t chunk_size = 4 * 1024 * 1024;
+    bool route = false;
+    int async_count = 0;
+    int coro_count = 0;
+    int schedule_count = 0;
+    double mem_budget_mb = 0;
+    double latency_interval = 10;
+    double interactive_deadline_ms = 20;
+    double bulk_deadline_ms = 10000;
+    std::string profile_file = "route_profile.txt";
+    std::string serve_socket;
+    std::string connect_socket;
+#ifndef _WIN32
+    ServerBatching server_batching;
+    uint64_t server_max_pixels = 0;
+    std::string metrics_endpoint;
+#endif
+    std::string ring_name;
+    std::string ring_connect;
+    uint32_t ring_slots = 4;
+    uint64_t slot_bytes = 64 * 1024 * 1024;
 
     for (int i = 1; i < argc; i++) {
         if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
         else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
         else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
         else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { image_filename = argv[++i]; }
+        else if (strcmp(argv[i], "-u") == 0) { options.byte_lut = true; }
+        else if (strcmp(argv[i], "-s") == 0) { options.specialise = true; }
+        else if ((strcmp(argv[i], "-ppi") == 0) && (i < (argc - 1))) { options.pixels_per_item = std::max(atoi(argv[++i]), 1); }
+        else if ((strcmp(argv[i], "-scan") == 0) && (i < (argc - 1))) {
+            i++;
+            if (strcmp(argv[i], "seq") == 0) options.scan = SCAN_SEQUENTIAL;
+            else if (strcmp(argv[i], "block") == 0) options.scan = SCAN_BLOCK;
+            else options.scan = SCAN_AUTO;
+        }
+        else if ((strcmp(argv[i], "-hist") == 0) && (i < (argc - 1))) { options.histogram = ParseHistogramVariant(argv[++i]); }
+        else if ((strcmp(argv[i], "-plan") == 0) && (i < (argc - 1))) { plan_file = argv[++i]; }
+        else if ((strcmp(argv[i], "-progressive") == 0) && (i < (argc - 1))) { preview_factor = std::max(atoi(argv[++i]), 1); }
+        else if ((strcmp(argv[i], "-batch") == 0) && (i < (argc - 1))) { batch_list = argv[++i]; }
+        else if ((strcmp(argv[i], "--approx") == 0) && (i < (argc - 1))) { options.approx_stride = std::max(atoi(argv[++i]), 1); }
+        else if ((strcmp(argv[i], "-bench") == 0) && (i < (argc - 1))) { benchmark = argv[++i]; }
+        else if (strcmp(argv[i], "-cpu") == 0) { use_cpu = true; }
+        else if ((strcmp(argv[i], "-threads") == 0) && (i < (argc - 1))) { threads = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "-pin") == 0) { pin_threads = true; }
+        else if (strcmp(argv[i], "-fused") == 0) { fused_read = true; }
+        else if (strcmp(argv[i], "-coproc") == 0) { coprocess = true; }
+        else if ((strcmp(argv[i], "-chunk") == 0) && (i < (argc - 1))) { chunk_size = (size_t)std::max(atoll(argv[++i]), 1LL); }
+        else if (strcmp(argv[i], "-inplace") == 0) { options.in_place = true; }
+        else if (strcmp(argv[i], "-wide") == 0) { options.wide = true; }
+        else if ((strcmp(argv[i], "-async") == 0) && (i < (argc - 1))) { async_count = std::max(atoi(argv[++i]), 0); }
+        else if ((strcmp(argv[i], "-latency-report") == 0) && (i < (argc - 1))) { latency_interval = std::max(atof(argv[++i]), 0.0); }
+        else if ((strcmp(argv[i], "-mem-budget") == 0) && (i < (argc - 1))) { mem_budget_mb = std::max(atof(argv[++i]), 0.0); }
+        else if ((strcmp(argv[i], "-schedule") == 0) && (i < (argc - 1))) { schedule_count = std::max(atoi(argv[++i]), 0); }
+        else if ((strcmp(argv[i], "-deadline") == 0) && (i < (argc - 1))) { interactive_deadline_ms = std::max(atof(argv[++i]), 1.0); }
+        else if ((strcmp(argv[i], "-bulk-deadline") == 0) && (i < (argc - 1))) { bulk_deadline_ms = std::max(atof(argv[++i]), 1.0); }
+        else if ((strcmp(argv[i], "-coro") == 0) && (i < (argc - 1))) { coro_count = std::max(atoi(argv[++i]), 0); }
+        else if (strcmp(argv[i], "-route") == 0) { route = true; }
+        else if ((strcmp(argv[i], "-profile") == 0) && (i < (argc - 1))) { profile_file = argv[++i]; }
+#ifndef _WIN32
+        else if ((strcmp(argv[i], "-serve") == 0) && (i < (argc - 1))) { serve_socket = argv[++i]; }
+        else if ((strcmp(argv[i], "-connect") == 0) && (i < (argc - 1))) { connect_socket = argv[++i]; }
+        else if ((strcmp(argv[i], "-metrics") == 0) && (i < (argc - 1))) { metrics_endpoint = argv[++i]; }
+        else if ((strcmp(argv[i], "-batch-max") == 0) && (i < (argc - 1))) { server_batching.max_images = (size_t)std::max(atoi(argv[++i]), 1); }
+        else if ((strcmp(argv[i], "-batch-wait") == 0) && (i < (argc - 1))) { server_batching.max_wait_ms = std::max(atof(argv[++i]), 0.0); }
+        else if ((strcmp(argv[i], "-max-pixels") == 0) && (i < (argc - 1))) { server_max_pixels = (uint64_t)std::max(atoll(argv[++i]), 1LL); }
+#endif
+#ifdef __linux__
+        else if ((strcmp(argv[i], "-shm-serve") == 0) && (i < (argc - 1))) { ring_name = argv[++i]; }
+        else if ((strcmp(argv[i], "-shm-connect") == 0) && (i < (argc - 1))) { ring_connect = argv[++i]; }
+        else if ((strcmp(argv[i], "-slots") == 0) && (i < (argc - 1))) { ring_slots = (uint32_t)std::max(atoi(argv[++i]), 1); }
+        else if ((strcmp(argv[i], "-slot-size") == 0) && (i < (argc - 1))) { slot_bytes = (uint64_t)std::max(atoll(argv[++i]), 1LL); }
+#endif
         else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
     }
 
@@ -35,8 +223,187 @@ int main(int argc, char** argv) {
 
     // Detect any potential exceptions
     try {
-        // Load input image
-        CImg<unsigned char> image_input(image_filename.c_str());
+        if (benchmark == "cpu") {
+            BenchmarkCPU();
+            return 0;
+        }
+
+#ifndef _WIN32
+        // thin clients, the server owns the device
+        if (!connect_socket.empty() || !ring_connect.empty()) {
+            CImg<unsigned char> image_input(image_filename.c_str());
+            std::vector<unsigned char> output;
+            std::string error;
+            uint32_t planes = image_input.depth() * image_input.spectrum();
+
+            auto start = std::chrono::steady_clock::now();
+            bool ok = false;
+#ifdef __linux__
+            if (!ring_connect.empty())
+                ok = EqualizeShared(ring_connect, image_input.data(), image_input.width(), image_input.height(), planes, output, error);
+            else
+#endif
+                ok = EqualizeRemote(connect_socket, image_input.data(), image_input.width(), image_input.height(), planes, output, error);
+
+            if (!ok) {
+                std::cerr << "Error: " << error << std::endl;
+                return 1;
+            }
+            double round_trip = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "Equalized " << image_input.size() << " pixels remotely in " << round_trip << " ms" << std::endl;
+
+            CImgDisplay disp_input(image_input, ("Original: " + image_filename).c_str());
+            CImg<unsigned char> output_image(output.data(), image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+            CImgDisplay disp_output(output_image, "Histogram Equalized Output");
+
+            DisplayUntilClosed(disp_input, disp_output);
+            return 0;
+        }
+#endif
+
+        // fall back to the host when there is no device to run on
+        if (!use_cpu && !DeviceAvailable(platform_id, device_id)) {
+            std::cerr << "No OpenCL device " << device_id << " on platform " << platform_id << ", using the CPU backend" << std::endl;
+            use_cpu = true;
+        }
+
+        // host workers for image decoding, saving and the CPU backend
+        ThreadPool pool(threads, pin_threads);
+
+        if (use_cpu && !batch_list.empty() && benchmark.empty()) {
+            std::cout << "Running on the CPU backend with " << pool.Threads() << " thread(s)" << std::endl;
+            return RunBatchList(nullptr, pool, batch_list, options, BatchOptions()) == 0 ? 0 : 1;
+        }
+
+        if (use_cpu && (!serve_socket.empty() || !ring_name.empty())) {
+            std::cerr << "Server mode needs an OpenCL device" << std::endl;
+            return 1;
+        }
+
+        // Benchmarks, batch and server mode only need the device
+        if (!benchmark.empty() || !batch_list.empty() || !serve_socket.empty() || !ring_name.empty()) {
+            cl::Context context = GetContext(platform_id, device_id);
+            std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+
+            cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
+            ProgramCache programs(context, "kernels/assessment_kernels.cl");
+            MemoryBudget budget(context.getInfo<CL_CONTEXT_DEVICES>()[0], (size_t)(mem_budget_mb * 1024 * 1024));
+            std::cout << "Device memory budget: " << budget.Capacity() / (1024 * 1024) << " MiB" << std::endl;
+            Equalizer equalizer(context, queue, programs);
+            equalizer.Planner().Load(plan_file);
+            equalizer.SetMemoryBudget(&budget);
+
+            MetricsRegistry metrics;
+            LatencyTracker latency(latency_interval);
+#ifndef _WIN32
+            MetricsServer metrics_server(metrics);
+            if (!metrics_endpoint.empty()) {
+                std::string error;
+                if (!metrics_server.Start(metrics_endpoint, error)) {
+                    std::cerr << "Metrics: " << error << std::endl;
+                    return 1;
+                }
+                std::cout << "Metrics on " << metrics_endpoint << "/metrics" << std::endl;
+
+                metrics.Describe("heq_device_memory_bytes", METRIC_GAUGE, "Device memory charged to the budget");
+                metrics.SetFunction("heq_device_memory_bytes", {}, [&budget]() { return (double)budget.Used(); });
+                metrics.Describe("heq_memory_queue_depth", METRIC_GAUGE, "Runs waiting for device memory");
+                metrics.SetFunction("heq_memory_queue_depth", {}, [&budget]() { return (double)budget.QueueDepth(); });
+            }
+
+            if (!serve_socket.empty()) {
+                EqualizeServer server(equalizer, options);
+                server.SetBatching(server_batching);
+                if (server_max_pixels > 0)
+                    server.SetMaxPixels(server_max_pixels);
+                if (!metrics_endpoint.empty())
+                    server.SetMetrics(&metrics);
+                server.SetLatency(&latency);
+                int code = server.Serve(serve_socket);
+                std::cout << latency.Report();
+                std::cout << budget.Report();
+                return code;
+            }
+#endif
+#ifdef __linux__
+            if (!ring_name.empty()) {
+                EqualizeServer server(equalizer, options);
+                if (!metrics_endpoint.empty())
+                    server.SetMetrics(&metrics);
+                server.SetLatency(&latency);
+                int code = server.ServeRing(ring_name, ring_slots, slot_bytes);
+                std::cout << latency.Report();
+                std::cout << budget.Report();
+                return code;
+            }
+#endif
+
+            if (benchmark.empty()) {
+                Router router;
+                BatchOptions batch_options;
+                if (route) {
+                    LoadOrCalibrate(router, equalizer, pool, profile_file);
+                    batch_options.router = &router;
+                }
+#ifndef _WIN32
+                if (!metrics_endpoint.empty())
+                    batch_options.metrics = &metrics;
+#endif
+                batch_options.latency = &latency;
+                return RunBatchList(&equalizer, pool, batch_list, options, batch_options) == 0 ? 0 : 1;
+            }
+            else if (benchmark == "route") {
+                Router router;
+                router.Calibrate(equalizer, pool);
+                if (router.Save(profile_file))
+                    std::cout << "Saved routing profile to " << profile_file << std::endl;
+            }
+            else if (benchmark == "scan") {
+                BenchmarkScan(equalizer);
+            }
+            else if (benchmark == "hist") {
+                BenchmarkHistogram(equalizer, plan_file);
+            }
+            else if (benchmark == "approx") {
+                // the batch list doubles as the test set
+                BenchmarkApprox(equalizer, batch_list.empty() ? std::vector<std::string>{ image_filename } : ReadImageList(batch_list));
+            }
+            else {
+                std::cerr << "Unknown benchmark: " << benchmark << std::endl;
+                return 1;
+            }
+
+            return 0;
+        }
+
+        // Load input image, streaming the histogram out of the file when asked to
+        CImg<unsigned char> image_input;
+        std::vector<int> streamed_histogram;
+
+        if (fused_read) {
+            PGMReader reader;
+            std::string error;
+            auto read_start = std::chrono::steady_clock::now();
+
+            if (reader.Open(image_filename, error)) {
+                image_input.assign(reader.Width(), reader.Height(), 1, 1);
+                streamed_histogram.assign(256, 0);
+
+                if (!reader.ReadWithHistogram(image_input.data(), streamed_histogram.data(), error)) {
+                    std::cerr << "Error: " << image_filename << ": " << error << std::endl;
+                    return 1;
+                }
+
+                double read_time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - read_start).count();
+                std::cout << "Read image and histogram in a single pass in " << read_time << " ms" << std::endl;
+            }
+            else {
+                std::cerr << "Cannot stream " << image_filename << " (" << error << "), computing the histogram separately" << std::endl;
+            }
+        }
+
+        if (streamed_histogram.empty())
+            image_input.assign(image_filename.c_str());
 
         // Image validation
         if (image_input.is_empty()) {
@@ -49,13 +416,26 @@ int main(int argc, char** argv) {
             << " with " << image_input.spectrum() << " channel(s)" << std::endl;
 
         CImgDisplay disp_input(image_input, ("Original: " + image_filename).c_str());
-        int binSize = 256;  // Initialize bin size to 256 for 8-bit image
 
         // Host operations
-        // use optimal work group size, let OpenCL choose
         size_t image_size = image_input.size();
-        cl::NDRange global_size(image_size);
-        cl::NDRange local_size = cl::NullRange;
+
+        if (use_cpu) {
+            std::cout << "Running on the CPU backend (histogram " << (CpuSupportsAVX2() ? "AVX2" : "scalar")
+                << ", LUT apply " << HostApplyLookupTier() << ") with " << pool.Threads() << " thread(s)" << std::endl;
+
+            std::vector<unsigned char> buffer_image_output_vector(image_size);
+            double cpu_time = EqualizeOnHost(image_input, streamed_histogram, buffer_image_output_vector.data(), pool);
+            std::cout << "Total processing time: " << cpu_time * 1000 << " ms" << std::endl;
+            std::cout << pool.StatsReport();
+
+            CImg<unsigned char> output_image(buffer_image_output_vector.data(),
+                image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+            CImgDisplay disp_output(output_image, "Histogram Equalized Output");
+
+            DisplayUntilClosed(disp_input, disp_output);
+            return 0;
+        }
 
         // Select the platform and device
         cl::Context context = GetContext(platform_id, device_id);
@@ -63,136 +443,214 @@ int main(int argc, char** argv) {
         // Display the selected device
         std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
 
-        // Get device info to determine the optimal work group size
-        cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
-        size_t max_wg_size = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
-        if (image_size > max_wg_size) {
-            local_size = cl::NDRange(std::min(max_wg_size, (size_t)(256)));
-            std::cout << "Setting local size to: " << std::min(max_wg_size, (size_t)(256)) << std::endl;
-        }
-
         // Create a queue to which we will push commands for the device
         cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
 
-        // 3.2 Load & build the device code
-        cl::Program::Sources sources;
-
-        // Ensure the kernel source file path is correct
-        AddSources(sources, "kernels/assessment_kernels.cl");
-        cl::Program program(context, sources);
-
-        // Build and debug the kernel code, throw errors if any
-        try {
-            program.build();
-        }
-        catch (const cl::Error& err) {
-            std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-            std::cout << "Build Options: " << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-            std::cout << "Build Log: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-            throw err;
+        // 3.2 Load the device code, programs are built on demand for each specialisation
+        ProgramCache programs(context, "kernels/assessment_kernels.cl");
+        // declared first, the arenas refund it. -mem-budget can only lower the device's default share
+        MemoryBudget budget(context.getInfo<CL_CONTEXT_DEVICES>()[0], (size_t)(mem_budget_mb * 1024 * 1024));
+        std::cout << "Device memory budget: " << budget.Capacity() / (1024 * 1024) << " MiB" << std::endl;
+        Equalizer equalizer(context, queue, programs);
+        equalizer.SetMemoryBudget(&budget);
+        if (equalizer.Planner().Load(plan_file))
+            std::cout << "Loaded histogram plan from " << plan_file << std::endl;
+        std::cout << "Setting local size to: " << equalizer.LocalSize() << std::endl;
+
+        // small images can finish on the host before the device transfers would
+        Router router;
+        if (route && !coprocess && preview_factor == 0) {
+            LoadOrCalibrate(router, equalizer, pool, profile_file);
+
+            if (router.Choose(image_size) == ROUTE_HOST) {
+                std::vector<unsigned char> buffer_image_output_vector(image_size);
+                double host_time = EqualizeOnHost(image_input, streamed_histogram, buffer_image_output_vector.data(), pool);
+                router.Record(ROUTE_HOST, image_size, host_time);
+
+                CImg<unsigned char> output_image(buffer_image_output_vector.data(),
+                    image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+                CImgDisplay disp_output(output_image, "Histogram Equalized Output");
+
+                DisplayUntilClosed(disp_input, disp_output);
+                return 0;
+            }
         }
 
-        // Part 4 - allocate memory to histogram and cumulative histogram
-        typedef int vec_type;
-
-        // create histogram vector
-        std::vector<vec_type> histogram(binSize, 0);
-        size_t histogram_size = histogram.size() * sizeof(vec_type);
-
-        // create cumulative histogram vector
-        std::vector<vec_type> cum_histogram(binSize, 0);
-        size_t cum_histogram_size = cum_histogram.size() * sizeof(vec_type);
-
-        // create lookup table vector
-        std::vector<vec_type> lookup(binSize, 0);
-        size_t lookup_size = lookup.size() * sizeof(vec_type);
-
-        std::cout << "Buffer sizes: Image=" << image_size << ", Histogram=" << histogram_size
-            << ", CumHistogram=" << cum_histogram_size << ", Lookup=" << lookup_size << std::endl;
-
-        // 4.1 Create buffers
-        cl::Buffer buffer_image_input(context, CL_MEM_READ_ONLY, image_size);
-        cl::Buffer buffer_histo_output(context, CL_MEM_READ_WRITE, histogram_size);
-        cl::Buffer buffer_cum_histo_output(context, CL_MEM_READ_WRITE, cum_histogram_size);
-        cl::Buffer buffer_lookup_output(context, CL_MEM_READ_WRITE, lookup_size);
-        cl::Buffer buffer_image_output(context, CL_MEM_READ_WRITE, image_size);
-
-        // 4.2 Copy image to device memory
-        queue.enqueueWriteBuffer(buffer_image_input, CL_TRUE, 0, image_size, image_input.data());
+        std::cout << "Buffer sizes: Image=" << image_size << ", Histogram=" << options.bin_size * sizeof(int)
+            << ", CumHistogram=" << options.bin_size * sizeof(int)
+            << ", Lookup=" << options.bin_size * (options.byte_lut ? sizeof(cl_uchar) : sizeof(int)) << std::endl;
 
-		// add barrier to ensure write is complete
-        queue.finish();
-
-        // 4.3 Setup and execute the kernels for each step
+        // 4 Setup and execute the kernels for each step
         try {
-            // ------- HISTOGRAM KERNEL -------
-            cl::Kernel histogramKernel = cl::Kernel(program, "histogram");
-			queue.enqueueFillBuffer(buffer_histo_output, 0, 0, histogram_size); // initialize clear histogram buffer
+            EqualizeResult result;
+
+            // in place, the result lands back in the loaded image, the original is already on screen
+            bool in_place = options.in_place && !coprocess && preview_factor == 0;
+            std::vector<unsigned char> buffer_image_output_vector(in_place ? 0 : image_size);
+            unsigned char* output_data = in_place ? image_input.data() : buffer_image_output_vector.data();
+
+            if (async_count > 0) {
+                // every copy is enqueued before the first one is waited for
+                auto async_start = std::chrono::steady_clock::now();
+                std::vector<std::future<AsyncResult>> futures;
+                for (int i = 0; i < async_count; i++)
+                    futures.push_back(equalizer.EqualizeAsync({ image_input.data(), image_size }, options));
+                double enqueue_time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - async_start).count();
+
+                std::vector<AsyncResult> results;
+                for (std::future<AsyncResult>& future : futures)
+                    results.push_back(future.get());
+                double async_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - async_start).count();
+
+                std::cout << async_count << " asynchronous run(s) enqueued in " << enqueue_time << " ms, all complete after "
+                    << async_time * 1000 << " ms (" << async_count / async_time << " images/s)" << std::endl;
+                std::cout << budget.Report();
+
+                CImg<unsigned char> output_image(results.front().output.data(),
+                    image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+                CImgDisplay disp_output(output_image, "Histogram Equalized Output");
+
+                DisplayUntilClosed(disp_input, disp_output);
+                return 0;
+            }
 
-            //set args
-            histogramKernel.setArg(0, buffer_image_input);
-            histogramKernel.setArg(1, buffer_histo_output);
-            histogramKernel.setArg(2, static_cast<int>(image_size));
+            if (schedule_count > 0) {
+                DeadlineScheduler scheduler(equalizer.Context(), equalizer.Device(), programs, options, chunk_size);
+                scheduler.SetMemoryBudget(&budget);
+
+                std::vector<std::vector<unsigned char>> bulk_outputs(schedule_count, std::vector<unsigned char>(image_size));
+                for (int i = 0; i < schedule_count; i++)
+                    scheduler.Submit(JOB_BULK, { image_input.data(), image_size }, bulk_outputs[i].data(), bulk_deadline_ms);
+
+                // interactive requests arrive once per deadline period until the bulk work is done
+                CImg<unsigned char> interactive_image = image_input.get_resize(-25, -25, -100, -100);
+                std::deque<std::vector<unsigned char>> interactive_outputs;
+                std::thread producer([&]() {
+                    while (scheduler.Outstanding(JOB_BULK) > 0) {
+                        interactive_outputs.emplace_back(interactive_image.size());
+                        scheduler.Submit(JOB_INTERACTIVE, { interactive_image.data(), interactive_image.size() },
+                            interactive_outputs.back().data(), interactive_deadline_ms);
+                        std::this_thread::sleep_for(std::chrono::microseconds((long long)(interactive_deadline_ms * 1000)));
+                    }
+                    scheduler.Close();
+                });
+
+                scheduler.Run();
+                producer.join();
+                std::cout << scheduler.Report();
+
+                CImg<unsigned char> output_image(bulk_outputs.front().data(),
+                    image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+                CImgDisplay disp_output(output_image, "Histogram Equalized Output");
+
+                DisplayUntilClosed(disp_input, disp_output);
+                return 0;
+            }
 
-            cl::Event histogram_event;
-            queue.enqueueNDRangeKernel(histogramKernel, cl::NullRange, global_size, local_size, NULL, &histogram_event);
-			histogram_event.wait(); // wait for kernel to finish
-            queue.enqueueReadBuffer(buffer_histo_output, CL_TRUE, 0, histogram_size, histogram.data());
+            if (coro_count > 0) {
+                // every task runs up to its first co_await before the executor resumes any of them
+                auto coro_start = std::chrono::steady_clock::now();
+                CoroutineExecutor executor;
+                std::vector<Task<AsyncResult>> tasks;
+                for (int i = 0; i < coro_count; i++) {
+                    tasks.push_back(equalizer.EqualizeTask({ image_input.data(), image_size }, options, executor));
+                    tasks.back().Start();
+                }
+
+                executor.RunUntil([&tasks]() {
+                    return std::all_of(tasks.begin(), tasks.end(), [](const Task<AsyncResult>& task) { return task.Done(); });
+                });
+                double coro_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - coro_start).count();
+
+                std::cout << coro_count << " coroutine run(s) complete after " << coro_time * 1000 << " ms, "
+                    << executor.Resumed() << " resumption(s) (" << coro_count / coro_time << " images/s)" << std::endl;
+
+                AsyncResult first = tasks.front().Result();
+                CImg<unsigned char> output_image(first.output.data(),
+                    image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+                CImgDisplay disp_output(output_image, "Histogram Equalized Output");
+
+                DisplayUntilClosed(disp_input, disp_output);
+                return 0;
+            }
 
-            std::cout << "Histogram kernel completed successfully" << std::endl;
+            if (coprocess) {
+                CoprocessResult split;
+                EqualizeCoprocess(equalizer, pool, image_input.data(), image_size, buffer_image_output_vector.data(), chunk_size, split);
 
-            // ------- CUMULATIVE HISTOGRAM KERNEL -------
-            queue.enqueueFillBuffer(buffer_cum_histo_output, 0, 0, cum_histogram_size);
-            cl::Kernel cum_histogramKernel = cl::Kernel(program, "cumulative_histo");
+                std::cout << "Co-processed with " << pool.Threads() << " host thread(s) and the device, " << chunk_size << " pixel chunks" << std::endl;
+                std::cout << "Histogram pass: " << split.histogram_seconds * 1000 << " ms, device share " << split.HistogramSplit() * 100
+                    << "% (" << split.device_histogram_pixels << " device / " << split.host_histogram_pixels << " host pixels)" << std::endl;
+                std::cout << "Apply pass: " << split.apply_seconds * 1000 << " ms, device share " << split.ApplySplit() * 100
+                    << "% (" << split.device_apply_pixels << " device / " << split.host_apply_pixels << " host pixels)" << std::endl;
+                std::cout << pool.StatsReport();
 
-            cum_histogramKernel.setArg(0, buffer_histo_output);
-            cum_histogramKernel.setArg(1, buffer_cum_histo_output);
-            cum_histogramKernel.setArg(2, binSize);
+                CImg<unsigned char> output_image(buffer_image_output_vector.data(),
+                    image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+                CImgDisplay disp_output(output_image, "Histogram Equalized Output");
 
-            cl::Event cum_histogram_event;
-            queue.enqueueNDRangeKernel(cum_histogramKernel, cl::NullRange, cl::NDRange(1), cl::NullRange, NULL, &cum_histogram_event);
-            cum_histogram_event.wait();
-            queue.enqueueReadBuffer(buffer_cum_histo_output, CL_TRUE, 0, cum_histogram_size, cum_histogram.data());
+                DisplayUntilClosed(disp_input, disp_output);
+                return 0;
+            }
 
-            std::cout << "Cumulative histogram kernel completed successfully" << std::endl;
+            CImgDisplay disp_preview;
+            auto start = std::chrono::steady_clock::now();
 
-            // ------- LOOKUP TABLE KERNEL -------
-            queue.enqueueFillBuffer(buffer_lookup_output, 0, 0, lookup_size);
-            cl::Kernel lookupKernel = cl::Kernel(program, "lookuptable");
+            if (preview_factor > 0) {
+                // show the preview as soon as it lands, the full image follows
+                auto on_preview = [&](const unsigned char* preview, int width, int height) {
+                    double first_pixel = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                    std::cout << "Preview " << width << "x" << height << " ready after " << first_pixel << " ms" << std::endl;
 
-            lookupKernel.setArg(0, buffer_cum_histo_output);
-            lookupKernel.setArg(1, buffer_lookup_output);
-            lookupKernel.setArg(2, binSize);
+                    CImg<unsigned char> preview_image(preview, width, height, image_input.depth(), image_input.spectrum());
+                    disp_preview.assign(preview_image, "Equalized Preview");
+                };
 
-            cl::Event lookup_event;
-            queue.enqueueNDRangeKernel(lookupKernel, cl::NullRange, cl::NDRange(binSize), cl::NullRange, NULL, &lookup_event);
-            lookup_event.wait();
-            queue.enqueueReadBuffer(buffer_lookup_output, CL_TRUE, 0, lookup_size, lookup.data());
+                equalizer.RunProgressive(image_input.data(), image_input.width(), image_input.height(),
+                    image_input.depth() * image_input.spectrum(), buffer_image_output_vector.data(),
+                    preview_factor, on_preview, options, result);
+            }
+            else {
+                equalizer.Run(image_input.data(), image_size, output_data, options, result,
+                    streamed_histogram.empty() ? nullptr : streamed_histogram.data());
+            }
 
+            double full_time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "Full resolution result ready after " << full_time << " ms" << std::endl;
+            std::cout << "Device arena: " << equalizer.Arena().Capacity() << " bytes in " << equalizer.Arena().Allocations()
+                << " allocation(s), regions aligned to " << equalizer.Arena().Alignment() << " bytes" << std::endl;
+            std::cout << budget.Report();
+            if (route && !coprocess && preview_factor == 0)
+                router.Record(ROUTE_DEVICE, image_size, full_time / 1000);
+
+            if (!result.wide_histogram.empty()) {
+                std::cout << "64-bit histogram kernel completed successfully, group totals merged "
+                    << (equalizer.Int64Atomics() ? "with 64-bit atomics" : "on the host") << std::endl;
+            }
+            else if (!streamed_histogram.empty() && preview_factor == 0) {
+                std::cout << "Histogram taken from the file read, no histogram kernel" << std::endl;
+            }
+            else if (options.approx_stride > 1) {
+                std::cout << "Approximate histogram kernel completed successfully: 1 in " << options.approx_stride << " pixels ("
+                    << result.histogram_samples << " samples), estimated max LUT deviation +/-" << result.lut_deviation_bound
+                    << " levels (95% confidence)" << std::endl;
+            }
+            else {
+                std::cout << "Histogram kernel (" << HistogramVariantName(result.histogram_variant) << ") completed successfully" << std::endl;
+            }
+            std::cout << "Cumulative histogram kernel completed successfully" << std::endl;
             std::cout << "Lookup table kernel completed successfully" << std::endl;
-
-            // ------- IMAGE OUTPUT KERNEL -------
-            cl::Kernel createimgKernel = cl::Kernel(program, "createimg");
-
-            createimgKernel.setArg(0, buffer_image_input);
-            createimgKernel.setArg(1, buffer_lookup_output);
-            createimgKernel.setArg(2, buffer_image_output);
-            createimgKernel.setArg(3, static_cast<int>(image_size));
-
-            cl::Event createimg_event;
-            queue.enqueueNDRangeKernel(createimgKernel, cl::NullRange, global_size, cl::NullRange, NULL, &createimg_event);
-            createimg_event.wait();
-
-            std::vector<unsigned char> buffer_image_output_vector(image_size);
-            queue.enqueueReadBuffer(buffer_image_output, CL_TRUE, 0, image_size, buffer_image_output_vector.data());
-
             std::cout << "Create image kernel completed successfully" << std::endl;
+            std::cout << "Kernel build options: \"" << equalizer.ProgramFor(options, image_size).getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(equalizer.Device())
+                << "\" (" << programs.Misses() << " program(s) built)" << std::endl;
 
-            // Make sure all operations are finished
-            queue.finish();
+            cl::Event& histogram_event = result.histogram_event;
+            cl::Event& cum_histogram_event = result.cum_histogram_event;
+            cl::Event& lookup_event = result.lookup_event;
+            cl::Event& createimg_event = result.createimg_event;
 
             // Display final normalized image
-            CImg<unsigned char> output_image(buffer_image_output_vector.data(),
+            CImg<unsigned char> output_image(output_data,
                 image_input.width(),
                 image_input.height(),
                 image_input.depth(),
@@ -201,15 +659,17 @@ int main(int argc, char** argv) {
             CImgDisplay disp_output(output_image, "Histogram Equalized Output");
 
 
-            // Calculate processing time
-			std::cout << "Processing time for histogram kernel: "
-				<< (histogram_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - histogram_event.getProfilingInfo<CL_PROFILING_COMMAND_START>())
-				<< " ns" << std::endl;
+            // Calculate processing time, there is no histogram kernel when the histogram was streamed
+            cl_ulong histogram_time = 0;
+            if (histogram_event()) {
+                histogram_time = histogram_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - histogram_event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
 
-			std::cout << "Histogram memory transfer: " << GetFullProfilingInfo(histogram_event, PROF_US) << std::endl;
+                std::cout << "Processing time for histogram kernel: " << histogram_time << " ns" << std::endl;
+                std::cout << "Histogram memory transfer: " << GetFullProfilingInfo(histogram_event, PROF_US) << std::endl;
+            }
 
 			std::cout << "Processing time for cumulative histogram kernel: "
-				<< (cum_histogram_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cum_histogram_event.getProfilingInfo<CL_PROFILING_COMMAND_START>())
+				<< EventSpan(result.scan_events.front(), cum_histogram_event)
 				<< " ns" << std::endl;
 
             std::cout << "Cumulative histogram memory transfer: " << GetFullProfilingInfo(cum_histogram_event, PROF_US) << std::endl;
@@ -229,23 +689,13 @@ int main(int argc, char** argv) {
 
 
 			double total_time =
-				(histogram_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - histogram_event.getProfilingInfo<CL_PROFILING_COMMAND_START>())
-				+ (cum_histogram_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cum_histogram_event.getProfilingInfo<CL_PROFILING_COMMAND_START>())
+				histogram_time
+				+ EventSpan(result.scan_events.front(), cum_histogram_event)
 				+ (lookup_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - lookup_event.getProfilingInfo<CL_PROFILING_COMMAND_START>())
 				+ (createimg_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - createimg_event.getProfilingInfo<CL_PROFILING_COMMAND_START>());
 			std::cout << "Total processing time: " << total_time << " ns" << std::endl;
 
-            // Display images until closed
-            unsigned int timeout_counter = 0;
-            const unsigned int max_timeout = 300000; // 5 minutes at 1ms wait intervals
-
-            while (!disp_input.is_closed() && !disp_output.is_closed()
-                && !disp_input.is_keyESC() && !disp_output.is_keyESC()
-                && timeout_counter < max_timeout) {
-                disp_input.wait(1);
-                disp_output.wait(1);
-                timeout_counter++;
-            }
+            DisplayUntilClosed(disp_input, disp_output);
 
         }
         catch (const cl::Error& err) {
@@ -0,0 +1,237 @@
+#include "batch.h"
+
+#include <chrono>
+
+#include "include/CImg.h"
+#include "cpu_backend.h"
+#include "latency_histogram.h"
+#include "metrics.h"
+#include "router.h"
+#include "thread_pool.h"
+
+using namespace cimg_library;
+
+std::vector<std::string> ReadImageList(const std::string& list_file) {
+    std::ifstream list(list_file);
+    if (!list)
+        throw std::runtime_error("Could not open batch list " + list_file);
+
+    std::vector<std::string> files;
+    std::string line;
+    while (std::getline(list, line)) {
+        // tolerate Windows line endings
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (!line.empty())
+            files.push_back(line);
+    }
+
+    return files;
+}
+
+std::string EqualizedFileName(const std::string& file_name) {
+    size_t dot = file_name.find_last_of('.');
+    size_t slash = file_name.find_last_of("/\\");
+
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return file_name + "_equalized";
+
+    return file_name.substr(0, dot) + "_equalized" + file_name.substr(dot);
+}
+
+namespace {
+
+// When an image's decode started and finished, for its latency
+struct ImageTimes {
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point decoded;
+};
+
+// run one batch of loaded images and save the results, on the device when there is one.
+// with a router each image goes where it is predicted to finish first, the prediction
+// of each side is then checked against the wall time of its whole share of the batch
+void ProcessBatch(Equalizer* equalizer, const BatchOptions& batch_options, ThreadPool& pool, std::vector<CImg<unsigned char>>& images,
+    std::vector<std::string>& names, std::vector<ImageTimes>& times, const EqualizeOptions& options) {
+    auto batch_start = std::chrono::steady_clock::now();
+    std::vector<bool> on_device(images.size(), false);
+    double device_seconds = -1;     // of the whole device batch
+    size_t device_pixels = 0;
+    Router* router = batch_options.router;
+    MetricsRegistry* metrics = batch_options.metrics;
+    std::vector<CImg<unsigned char>> outputs;
+    std::vector<size_t> host_images;
+    std::vector<ImageView> device_views;
+    std::vector<unsigned char*> device_outputs;
+    size_t host_pixels = 0;
+
+    outputs.reserve(images.size());
+    for (size_t i = 0; i < images.size(); i++) {
+        CImg<unsigned char>& image = images[i];
+        outputs.emplace_back(image.width(), image.height(), image.depth(), image.spectrum());
+
+        if (!equalizer || (router && router->Choose(image.size()) == ROUTE_HOST)) {
+            host_images.push_back(i);
+            host_pixels += image.size();
+        }
+        else {
+            device_views.push_back({ image.data(), image.size() });
+            device_outputs.push_back(outputs.back().data());
+            on_device[i] = true;
+        }
+    }
+
+    if (!device_views.empty()) {
+        BatchResult result;
+        auto start = std::chrono::steady_clock::now();
+        try {
+            equalizer->RunBatch(device_views, device_outputs, options, result);
+        }
+        catch (const cl::Error& err) {
+            if (metrics)
+                RecordError(*metrics, "batch", getErrorString(err.err()));
+            throw;
+        }
+        catch (const std::exception&) {
+            if (metrics)
+                RecordError(*metrics, "batch", "host");
+            throw;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (metrics)
+            RecordBatch(*metrics, "batch", result);
+        if (result.upload_event() && result.download_event())
+            device_seconds = EventSpan(result.upload_event, result.download_event) * 1e-9;
+        device_pixels = result.pixels;
+
+        std::cout << "Batch of " << result.images << " image(s), " << result.pixels << " pixels: "
+            << "histogram " << GetFullProfilingInfo(result.histogram_event, PROF_US)
+            << "; scan " << GetFullProfilingInfo(result.cum_histogram_event, PROF_US)
+            << "; lookup " << GetFullProfilingInfo(result.lookup_event, PROF_US)
+            << "; createimg " << GetFullProfilingInfo(result.createimg_event, PROF_US) << std::endl;
+
+        if (router)
+            router->Record(ROUTE_DEVICE, result.pixels, seconds);
+    }
+
+    if (!host_images.empty()) {
+        // one task per image, large images split further into row tiles inside EqualizeCPU
+        auto start = std::chrono::steady_clock::now();
+        pool.ParallelFor(0, host_images.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                CImg<unsigned char>& image = images[host_images[i]];
+                EqualizeCPU(image.data(), image.size(), outputs[host_images[i]].data(), &pool, image.width());
+            }
+        });
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << "Batch of " << host_images.size() << " image(s) equalized on the CPU backend" << std::endl;
+        if (metrics)
+            metrics->Increment("heq_images_total", { { "path", "batch_host" } }, (double)host_images.size());
+
+        if (router && equalizer)
+            router->Record(ROUTE_HOST, host_pixels, seconds);
+    }
+
+    pool.ParallelFor(0, outputs.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            try {
+                outputs[i].save(EqualizedFileName(names[i]).c_str());
+            }
+            catch (CImgException& err) {
+                std::cerr << "Could not save " << EqualizedFileName(names[i]) << ": " << err.what() << std::endl;
+            }
+        }
+    });
+
+    if (batch_options.latency) {
+        auto saved = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < images.size(); i++) {
+            // the kernels treat every pixel alike, so an image's share of the batch's device time is its share of the pixels
+            double device = (on_device[i] && device_seconds >= 0 && device_pixels > 0)
+                ? device_seconds * images[i].size() / device_pixels : -1;
+            batch_options.latency->Record(std::chrono::duration<double>(saved - times[i].started).count(),
+                std::chrono::duration<double>(batch_start - times[i].decoded).count(), device);
+        }
+        batch_options.latency->Tick();
+    }
+
+    images.clear();
+    names.clear();
+    times.clear();
+}
+
+}
+
+int RunBatchList(Equalizer* equalizer, ThreadPool& pool, const std::string& list_file,
+    const EqualizeOptions& options, const BatchOptions& batch_options) {
+    std::vector<std::string> files = ReadImageList(list_file);
+    std::vector<CImg<unsigned char>> images;
+    std::vector<std::string> names;
+    std::vector<ImageTimes> times;
+    size_t pending_pixels = 0;
+    size_t processed = 0;
+    size_t total_pixels = 0;
+    int failed = 0;
+
+    auto start = std::chrono::steady_clock::now();
+
+    // decode max_images files at a time in parallel, then group them into batches in list order
+    for (size_t first = 0; first < files.size(); first += batch_options.max_images) {
+        size_t count = std::min(batch_options.max_images, files.size() - first);
+        std::vector<CImg<unsigned char>> loaded(count);
+        std::vector<std::string> errors(count);
+        std::vector<ImageTimes> loaded_times(count);
+
+        pool.ParallelFor(0, count, 1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                loaded_times[i].started = std::chrono::steady_clock::now();
+                try {
+                    loaded[i].assign(files[first + i].c_str());
+                    if (loaded[i].is_empty())
+                        errors[i] = "empty image";
+                }
+                catch (CImgException& err) {
+                    errors[i] = err.what();
+                }
+                loaded_times[i].decoded = std::chrono::steady_clock::now();
+            }
+        });
+
+        for (size_t i = 0; i < count; i++) {
+            if (!errors[i].empty()) {
+                std::cerr << "Skipping " << files[first + i] << ": " << errors[i] << std::endl;
+                failed++;
+                continue;
+            }
+
+            if (!images.empty() && (images.size() >= batch_options.max_images || pending_pixels + loaded[i].size() > batch_options.max_pixels)) {
+                ProcessBatch(equalizer, batch_options, pool, images, names, times, options);
+                pending_pixels = 0;
+            }
+
+            pending_pixels += loaded[i].size();
+            total_pixels += loaded[i].size();
+            processed++;
+            images.push_back(std::move(loaded[i]));
+            names.push_back(files[first + i]);
+            times.push_back(loaded_times[i]);
+        }
+    }
+
+    if (!images.empty())
+        ProcessBatch(equalizer, batch_options, pool, images, names, times, options);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Equalized " << processed << " image(s), " << total_pixels << " pixels in " << seconds << " s";
+    if (seconds > 0)
+        std::cout << " (" << processed / seconds << " images/s)";
+    std::cout << std::endl;
+    std::cout << pool.StatsReport();
+    if (batch_options.router && equalizer)
+        std::cout << batch_options.router->Report();
+    if (batch_options.latency)
+        std::cout << batch_options.latency->Report();
+
+    return failed;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+
+#include "equalizer.h"
+
+class ThreadPool;
+class Router;
+class MetricsRegistry;
+class LatencyTracker;
+
+// Limits used to split a list of images into device batches
+struct BatchOptions {
+    size_t max_images = 4096;
+    size_t max_pixels = 64 * 1024 * 1024;
+    Router* router = nullptr;   // when set, images it routes to the host skip the device batch
+    MetricsRegistry* metrics = nullptr;
+    // wall time from the start of decode to save, the wait for the batch after decode, and the
+    // image's pixel share of the batch's device time
+    LatencyTracker* latency = nullptr;
+};
+
+// image paths listed one per line, blank lines skipped
+std::vector<std::string> ReadImageList(const std::string& list_file);
+
+// output file for an input image, "dir/name.pgm" -> "dir/name_equalized.pgm"
+std::string EqualizedFileName(const std::string& file_name);
+
+// equalise every image listed (one path per line) in list_file and save the results next to
+// the inputs. images are decoded and saved on the pool and equalised with batched launches,
+// or on the pool with the CPU backend when equalizer is null. returns the number that failed to load
+int RunBatchList(Equalizer* equalizer, ThreadPool& pool, const std::string& list_file,
+    const EqualizeOptions& options, const BatchOptions& batch_options);
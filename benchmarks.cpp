@@ -0,0 +1,344 @@
+#include "benchmarks.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <numeric>
+#include <random>
+
+#include "include/CImg.h"
+#include "cpu_backend.h"
+
+using namespace cimg_library;
+
+namespace {
+
+const int repeats = 5;
+
+// average device time of a scan mode over several runs [ns], checks the result against the host
+double TimeScan(Equalizer& equalizer, cl::Program& program, const cl::Buffer& histogram, const cl::Buffer& cum_histogram,
+    const std::vector<int>& expected, ScanMode mode, bool& correct) {
+    double total = 0;
+    std::vector<int> result(expected.size());
+
+    for (int r = 0; r < repeats; r++) {
+        std::vector<cl::Event> events;
+        equalizer.Scan(program, histogram, cum_histogram, (int)expected.size(), mode, events);
+        events.back().wait();
+        total += EventSpan(events.front(), events.back());
+    }
+
+    equalizer.Queue().enqueueReadBuffer(cum_histogram, CL_TRUE, 0, expected.size() * sizeof(int), result.data());
+    correct = (result == expected);
+
+    return total / repeats;
+}
+
+}
+
+namespace {
+
+// synthetic test image with a controllable amount of skew
+struct SyntheticImage {
+    std::string name;
+    std::vector<unsigned char> pixels;
+};
+
+std::vector<SyntheticImage> MakeSyntheticImages(size_t size) {
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> uniform(0, 255);
+    std::vector<SyntheticImage> images;
+
+    images.push_back({ "uniform", std::vector<unsigned char>(size) });
+    for (unsigned char& p : images.back().pixels)
+        p = (unsigned char)uniform(rng);
+
+    for (double sigma : { 40.0, 10.0, 3.0 }) {
+        std::normal_distribution<double> normal(128.0, sigma);
+        images.push_back({ "gaussian sigma " + std::to_string((int)sigma), std::vector<unsigned char>(size) });
+        for (unsigned char& p : images.back().pixels)
+            p = (unsigned char)std::min(255.0, std::max(0.0, normal(rng)));
+    }
+
+    for (int dominant : { 50, 80, 95 }) {
+        std::uniform_int_distribution<int> percent(0, 99);
+        images.push_back({ std::to_string(dominant) + "% one value", std::vector<unsigned char>(size) });
+        for (unsigned char& p : images.back().pixels)
+            p = (percent(rng) < dominant) ? 0 : (unsigned char)uniform(rng);
+    }
+
+    images.push_back({ "constant", std::vector<unsigned char>(size, 128) });
+
+    return images;
+}
+
+}
+
+void BenchmarkCPU() {
+    const size_t image_size = 16 * 1024 * 1024;
+    std::vector<SyntheticImage> images = MakeSyntheticImages(image_size);
+    bool avx2 = CpuSupportsAVX2();
+
+    // best of several runs [s]
+    auto time = [&](void (*histogram_function)(const unsigned char*, size_t, int*), const std::vector<unsigned char>& pixels, std::vector<int>& histogram) {
+        double best = 0;
+        for (int r = 0; r < repeats; r++) {
+            std::fill(histogram.begin(), histogram.end(), 0);
+            auto start = std::chrono::steady_clock::now();
+            histogram_function(pixels.data(), pixels.size(), histogram.data());
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (r == 0 || seconds < best)
+                best = seconds;
+        }
+        return best;
+    };
+
+    std::cout << "AVX2 " << (avx2 ? "available" : "not available") << std::endl;
+    std::cout << std::setw(22) << "distribution" << std::setw(16) << "scalar [MB/s]" << std::setw(16) << "AVX2 [MB/s]"
+        << std::setw(10) << "speedup" << std::endl;
+
+    for (const SyntheticImage& image : images) {
+        std::vector<int> scalar_histogram(256), avx2_histogram(256);
+        double scalar = time(HistogramScalar, image.pixels, scalar_histogram);
+
+        std::cout << std::setw(22) << image.name << std::setw(16) << std::setprecision(5) << image_size / scalar / 1e6;
+        if (avx2) {
+            double vector = time(HistogramAVX2, image.pixels, avx2_histogram);
+            std::cout << std::setw(16) << image_size / vector / 1e6 << std::setw(10) << std::setprecision(3) << scalar / vector;
+            if (avx2_histogram != scalar_histogram)
+                std::cout << "  MISMATCH";
+        }
+        std::cout << std::endl;
+    }
+
+    // LUT apply tiers on a random image and LUT, once through the cache and once streaming
+    typedef void (*ApplyFunction)(const unsigned char*, size_t, const unsigned char*, unsigned char*, bool);
+    struct ApplyTier { const char* name; ApplyFunction function; bool supported; };
+    const ApplyTier tiers[] = {
+        { "scalar", ApplyLookupScalar, true },
+        { "AVX2", ApplyLookupAVX2, avx2 },
+        { "AVX-512 VBMI", ApplyLookupAVX512VBMI, CpuSupportsAVX512VBMI() },
+    };
+
+    const std::vector<unsigned char>& pixels = images.front().pixels;
+    std::vector<unsigned char> lookup(256);
+    std::mt19937 rng(3);
+    for (unsigned char& value : lookup)
+        value = (unsigned char)(rng() & 0xFF);
+
+    std::vector<unsigned char> expected(image_size), output(image_size);
+    ApplyLookupScalar(pixels.data(), image_size, lookup.data(), expected.data(), false);
+
+    std::cout << "LUT apply, host default tier " << HostApplyLookupTier() << ", last level cache " << LastLevelCacheSize() / 1024 << " KiB" << std::endl;
+    std::cout << std::setw(22) << "tier" << std::setw(16) << "cached [MB/s]" << std::setw(18) << "streaming [MB/s]" << std::endl;
+
+    for (const ApplyTier& tier : tiers) {
+        if (!tier.supported)
+            continue;
+
+        std::cout << std::setw(22) << tier.name;
+        for (bool stream : { false, true }) {
+            double best = 0;
+            for (int r = 0; r < repeats; r++) {
+                std::fill(output.begin(), output.end(), 0);
+                auto start = std::chrono::steady_clock::now();
+                tier.function(pixels.data(), image_size, lookup.data(), output.data(), stream);
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                if (r == 0 || seconds < best)
+                    best = seconds;
+            }
+
+            std::cout << std::setw(stream ? 18 : 16) << std::setprecision(5) << image_size / best / 1e6;
+            if (output != expected)
+                std::cout << " MISMATCH";
+        }
+        std::cout << std::endl;
+    }
+}
+
+void BenchmarkHistogram(Equalizer& equalizer, const std::string& plan_file) {
+    const size_t image_size = 4 * 1024 * 1024;
+    const int binSize = 256;
+    const HistogramVariant variants[] = { HIST_GLOBAL, HIST_LOCAL, HIST_REPLICATED };
+
+    cl::Program program = equalizer.Programs().Get(KernelConfig());
+    cl::Buffer buffer_image(equalizer.Context(), CL_MEM_READ_ONLY, image_size);
+    cl::Buffer buffer_histogram(equalizer.Context(), CL_MEM_READ_WRITE, binSize * sizeof(int));
+
+    std::vector<SyntheticImage> images = MakeSyntheticImages(image_size);
+    std::vector<HistogramProbe> probes;
+    std::vector<std::vector<double>> times;
+
+    std::cout << std::setw(22) << "distribution" << std::setw(10) << "entropy" << std::setw(10) << "max bin";
+    for (HistogramVariant variant : variants)
+        std::cout << std::setw(14) << HistogramVariantName(variant);
+    std::cout << "   [us]" << std::endl;
+
+    for (const SyntheticImage& image : images) {
+        equalizer.Queue().enqueueWriteBuffer(buffer_image, CL_TRUE, 0, image_size, image.pixels.data());
+
+        // host reference
+        std::vector<int> expected(binSize, 0);
+        HostHistogram(image.pixels.data(), image_size, expected.data());
+
+        probes.push_back(ProbeHistogram(image.pixels.data(), image_size));
+        times.emplace_back();
+
+        std::cout << std::setw(22) << image.name << std::setw(10) << std::setprecision(3) << probes.back().entropy
+            << std::setw(10) << probes.back().max_bin_fraction;
+
+        for (HistogramVariant variant : variants) {
+            double total = 0;
+            std::vector<int> histogram(binSize);
+
+            for (int r = 0; r < repeats; r++) {
+                cl::Event event;
+                equalizer.Queue().enqueueFillBuffer(buffer_histogram, 0, 0, binSize * sizeof(int));
+                equalizer.EnqueueHistogram(program, variant, buffer_image, buffer_histogram, image_size, binSize, 1, &event);
+                event.wait();
+                total += event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+            }
+
+            equalizer.Queue().enqueueReadBuffer(buffer_histogram, CL_TRUE, 0, binSize * sizeof(int), histogram.data());
+            times.back().push_back(total / repeats);
+
+            std::cout << std::setw(14) << std::setprecision(4) << total / repeats / (double)PROF_US;
+            if (histogram != expected)
+                std::cout << "(!)";
+        }
+        std::cout << std::endl;
+    }
+
+    // pick the thresholds that minimise the total time over all distributions,
+    // candidates are the observed feature values plus "never"
+    std::vector<double> replicate_candidates = { 1.01 };
+    std::vector<double> global_candidates = { 8.5 };
+    for (const HistogramProbe& probe : probes) {
+        replicate_candidates.push_back(probe.max_bin_fraction);
+        global_candidates.push_back(probe.entropy);
+    }
+
+    HistogramPlanner planner;
+    double best_total = -1;
+    PlannerThresholds best;
+
+    for (double replicate : replicate_candidates) {
+        for (double global : global_candidates) {
+            planner.Thresholds().replicate_above_max_fraction = replicate;
+            planner.Thresholds().global_above_entropy = global;
+
+            double total = 0;
+            for (size_t i = 0; i < probes.size(); i++)
+                total += times[i][planner.Choose(probes[i]) - HIST_GLOBAL];
+
+            if (best_total < 0 || total < best_total) {
+                best_total = total;
+                best = planner.Thresholds();
+            }
+        }
+    }
+
+    planner.Thresholds() = best;
+    std::cout << "Learned thresholds: replicated at max bin >= " << best.replicate_above_max_fraction
+        << ", global at entropy >= " << best.global_above_entropy << std::endl;
+
+    if (planner.Save(plan_file))
+        std::cout << "Saved histogram plan to " << plan_file << std::endl;
+    else
+        std::cerr << "Could not write " << plan_file << std::endl;
+}
+
+void BenchmarkApprox(Equalizer& equalizer, const std::vector<std::string>& files) {
+    const int strides[] = { 2, 4, 8, 16, 32, 64 };
+    const int binSize = 256;
+
+    cl::Program program = equalizer.Programs().Get(KernelConfig());
+    cl::Buffer buffer_histogram(equalizer.Context(), CL_MEM_READ_WRITE, binSize * sizeof(int));
+
+    for (const std::string& file : files) {
+        CImg<unsigned char> image(file.c_str());
+        size_t image_size = image.size();
+
+        cl::Buffer buffer_image(equalizer.Context(), CL_MEM_READ_ONLY, image_size);
+        equalizer.Queue().enqueueWriteBuffer(buffer_image, CL_TRUE, 0, image_size, image.data());
+
+        // time one histogram pass and return its result
+        auto run = [&](int stride, double& time) {
+            std::vector<int> histogram(binSize);
+            time = 0;
+
+            for (int r = 0; r < repeats; r++) {
+                cl::Event event;
+                equalizer.Queue().enqueueFillBuffer(buffer_histogram, 0, 0, binSize * sizeof(int));
+                if (stride > 1)
+                    equalizer.EnqueueSampledHistogram(program, buffer_image, buffer_histogram, image_size, binSize, stride, &event);
+                else
+                    equalizer.EnqueueHistogram(program, HIST_LOCAL, buffer_image, buffer_histogram, image_size, binSize, 1, &event);
+                event.wait();
+                time += event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+            }
+
+            time /= repeats;
+            equalizer.Queue().enqueueReadBuffer(buffer_histogram, CL_TRUE, 0, binSize * sizeof(int), histogram.data());
+            return histogram;
+        };
+
+        double exact_time;
+        std::vector<unsigned char> exact_lookup = HostLookupTable(run(1, exact_time));
+
+        std::cout << file << ": " << image.width() << "x" << image.height() << ", exact histogram "
+            << exact_time / (double)PROF_US << " us" << std::endl;
+        std::cout << std::setw(8) << "stride" << std::setw(12) << "time [us]" << std::setw(10) << "speedup"
+            << std::setw(16) << "max LUT error" << std::setw(16) << "estimated" << std::endl;
+
+        for (int stride : strides) {
+            double time;
+            std::vector<unsigned char> lookup = HostLookupTable(run(stride, time));
+
+            int deviation = 0;
+            for (int i = 0; i < binSize; i++)
+                deviation = std::max(deviation, std::abs((int)lookup[i] - (int)exact_lookup[i]));
+
+            size_t samples = (image_size + stride - 1) / stride;
+            std::cout << std::setw(8) << stride << std::setw(12) << std::setprecision(4) << time / (double)PROF_US
+                << std::setw(10) << std::setprecision(3) << exact_time / time
+                << std::setw(16) << deviation << std::setw(16) << std::setprecision(3) << ApproxLutDeviation(samples) << std::endl;
+        }
+    }
+}
+
+void BenchmarkScan(Equalizer& equalizer) {
+    const int bin_sizes[] = { 256, 4096, 65536, 1 << 20 };
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> counts(0, 3);
+
+    cl::Program program = equalizer.Programs().Get(KernelConfig());
+
+    std::cout << std::setw(10) << "bins" << std::setw(18) << "sequential [us]" << std::setw(18) << "multi-block [us]"
+        << std::setw(10) << "speedup" << std::endl;
+
+    for (int binSize : bin_sizes) {
+        std::vector<int> histogram(binSize);
+        for (int& count : histogram)
+            count = counts(rng);
+
+        std::vector<int> expected(binSize);
+        std::partial_sum(histogram.begin(), histogram.end(), expected.begin());
+
+        size_t buffer_size = binSize * sizeof(int);
+        cl::Buffer buffer_histogram(equalizer.Context(), CL_MEM_READ_ONLY, buffer_size);
+        cl::Buffer buffer_cum_histogram(equalizer.Context(), CL_MEM_READ_WRITE, buffer_size);
+        equalizer.Queue().enqueueWriteBuffer(buffer_histogram, CL_TRUE, 0, buffer_size, histogram.data());
+
+        bool sequential_ok, block_ok;
+        double sequential = TimeScan(equalizer, program, buffer_histogram, buffer_cum_histogram, expected, SCAN_SEQUENTIAL, sequential_ok);
+        double block = TimeScan(equalizer, program, buffer_histogram, buffer_cum_histogram, expected, SCAN_BLOCK, block_ok);
+
+        std::cout << std::setw(10) << binSize
+            << std::setw(18) << sequential / (double)PROF_US << std::setw(18) << block / (double)PROF_US
+            << std::setw(10) << std::setprecision(3) << sequential / block;
+        if (!sequential_ok || !block_ok)
+            std::cout << "  MISMATCH (sequential " << (sequential_ok ? "ok" : "wrong") << ", multi-block " << (block_ok ? "ok" : "wrong") << ")";
+        std::cout << std::endl;
+    }
+}
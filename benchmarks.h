@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+
+#include "equalizer.h"
+
+// Benchmarks selected on the command line with -bench <name>
+
+// scalar against AVX2 host histogram on synthetic distributions, needs no device
+void BenchmarkCPU();
+
+// times every histogram strategy on synthetic distributions, learns the planner
+// thresholds from the results and saves them to plan_file
+void BenchmarkHistogram(Equalizer& equalizer, const std::string& plan_file);
+
+// sampled histograms for growing strides against the exact one on each image in files,
+// reporting histogram speedup, measured and estimated LUT deviation
+void BenchmarkApprox(Equalizer& equalizer, const std::vector<std::string>& files);
+
+// multi-block scan against the sequential cumulative_histo loop for growing bin counts
+void BenchmarkScan(Equalizer& equalizer);
@@ -0,0 +1,78 @@
+#include "cl_coroutine.h"
+
+void CoroutineExecutor::Post(std::coroutine_handle<> handle) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ready_.push_back(handle);
+    }
+    posted_.notify_one();
+}
+
+void CoroutineExecutor::RunUntil(const std::function<bool()>& done) {
+    while (!done()) {
+        std::coroutine_handle<> handle;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            posted_.wait(lock, [this]() { return !ready_.empty(); });
+            handle = ready_.front();
+            ready_.pop_front();
+        }
+
+        resumed_++;
+        handle.resume();
+    }
+}
+
+bool EventAwaiter::await_ready() const {
+    return event_.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE;
+}
+
+void EventAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    handle_ = handle;
+
+    // the callback can only fire once the command has been submitted, user events have no queue
+    cl::CommandQueue queue = event_.getInfo<CL_EVENT_COMMAND_QUEUE>();
+    if (queue())
+        queue.flush();
+
+    // the resume is posted, so it cannot run before this returns even if the event already completed
+    event_.setCallback(CL_COMPLETE, Complete, this);
+}
+
+void EventAwaiter::await_resume() const {
+    if (status_ < 0)
+        throw cl::Error(status_, "co_await on a failed command");
+}
+
+void CL_CALLBACK EventAwaiter::Complete(cl_event, cl_int status, void* user_data) {
+    EventAwaiter* awaiter = static_cast<EventAwaiter*>(user_data);
+    awaiter->status_ = status;
+    awaiter->executor_.Post(awaiter->handle_);
+}
+
+bool BudgetAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    // admitted at once resumes straight away, otherwise like an event callback the resume is posted
+    CoroutineExecutor& executor = executor_;
+    return !budget_.AcquireOrQueue(bytes_, [&executor, handle]() { executor.Post(handle); });
+}
+
+EventAwaiter EnqueueWrite(const cl::CommandQueue& queue, const cl::Buffer& buffer, size_t size, const void* data,
+    CoroutineExecutor& executor) {
+    cl::Event event;
+    queue.enqueueWriteBuffer(buffer, CL_FALSE, 0, size, data, NULL, &event);
+    return EventAwaiter(event, executor);
+}
+
+EventAwaiter EnqueueRead(const cl::CommandQueue& queue, const cl::Buffer& buffer, size_t size, void* data,
+    CoroutineExecutor& executor) {
+    cl::Event event;
+    queue.enqueueReadBuffer(buffer, CL_FALSE, 0, size, data, NULL, &event);
+    return EventAwaiter(event, executor);
+}
+
+EventAwaiter EnqueueKernel(const cl::CommandQueue& queue, const cl::Kernel& kernel, const cl::NDRange& global,
+    const cl::NDRange& local, CoroutineExecutor& executor) {
+    cl::Event event;
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, NULL, &event);
+    return EventAwaiter(event, executor);
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+#include "include/Utils.h"
+#include "memory_budget.h"
+
+// Resumes coroutines on the thread that calls RunUntil. Event callbacks arrive on runtime threads
+// and only post the coroutine here, so every coroutine step runs on the one host thread
+class CoroutineExecutor {
+public:
+    // thread safe, called from event callbacks
+    void Post(std::coroutine_handle<> handle);
+
+    // resume posted coroutines until done() returns true
+    void RunUntil(const std::function<bool()>& done);
+
+    // coroutines resumed so far
+    size_t Resumed() const { return resumed_; }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable posted_;
+    std::deque<std::coroutine_handle<>> ready_;
+    size_t resumed_ = 0;
+};
+
+// co_await suspends until the event completes and resumes on the executor.
+// a failed command is rethrown from the co_await as a cl::Error
+class EventAwaiter {
+public:
+    EventAwaiter(const cl::Event& event, CoroutineExecutor& executor) : event_(event), executor_(executor) {}
+
+    bool await_ready() const;
+    void await_suspend(std::coroutine_handle<> handle);
+    void await_resume() const;
+
+private:
+    static void CL_CALLBACK Complete(cl_event event, cl_int status, void* user_data);
+
+    cl::Event event_;
+    CoroutineExecutor& executor_;
+    std::coroutine_handle<> handle_;
+    cl_int status_ = CL_COMPLETE;
+};
+
+inline EventAwaiter Await(const cl::Event& event, CoroutineExecutor& executor) {
+    return EventAwaiter(event, executor);
+}
+
+// co_await takes bytes from the budget, suspending while they do not fit instead of blocking
+// the executor thread. the Release that makes room posts the coroutine back to the executor.
+// bytes larger than the whole budget throw from the co_await
+class BudgetAwaiter {
+public:
+    BudgetAwaiter(MemoryBudget& budget, size_t bytes, CoroutineExecutor& executor)
+        : budget_(budget), bytes_(bytes), executor_(executor) {}
+
+    bool await_ready() const { return false; }
+    bool await_suspend(std::coroutine_handle<> handle);
+    void await_resume() const {}
+
+private:
+    MemoryBudget& budget_;
+    size_t bytes_;
+    CoroutineExecutor& executor_;
+};
+
+inline BudgetAwaiter AcquireBudget(MemoryBudget& budget, size_t bytes, CoroutineExecutor& executor) {
+    return BudgetAwaiter(budget, bytes, executor);
+}
+
+// non-blocking enqueues that can be awaited directly, e.g. co_await EnqueueRead(...)
+EventAwaiter EnqueueWrite(const cl::CommandQueue& queue, const cl::Buffer& buffer, size_t size, const void* data,
+    CoroutineExecutor& executor);
+EventAwaiter EnqueueRead(const cl::CommandQueue& queue, const cl::Buffer& buffer, size_t size, void* data,
+    CoroutineExecutor& executor);
+EventAwaiter EnqueueKernel(const cl::CommandQueue& queue, const cl::Kernel& kernel, const cl::NDRange& global,
+    const cl::NDRange& local, CoroutineExecutor& executor);
+
+// Lazily started coroutine returning a T. co_await it from another coroutine, or Start it and
+// drive the executor until Done for a top level task
+template <typename T>
+class Task {
+public:
+    struct promise_type {
+        std::optional<T> value;
+        std::exception_ptr error;
+        std::coroutine_handle<> continuation;
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        // hand control straight to whoever awaited the task
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                std::coroutine_handle<> next = handle.promise().continuation;
+                return next ? next : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void return_value(T result) { value = std::move(result); }
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        if (handle_)
+            handle_.destroy();
+    }
+
+    bool await_ready() const { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) {
+        handle_.promise().continuation = continuation;
+        return handle_;
+    }
+    T await_resume() { return Result(); }
+
+    // run up to the first suspension point
+    void Start() { handle_.resume(); }
+    bool Done() const { return handle_.done(); }
+
+    // the returned value, or the exception the coroutine ended with
+    T Result() {
+        if (handle_.promise().error)
+            std::rethrow_exception(handle_.promise().error);
+        return std::move(*handle_.promise().value);
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    std::coroutine_handle<promise_type> handle_;
+};
@@ -0,0 +1,185 @@
+#include "coprocess.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+#include "cpu_backend.h"
+#include "thread_pool.h"
+
+double CoprocessResult::HistogramSplit() const {
+    size_t total = host_histogram_pixels + device_histogram_pixels;
+    return total ? (double)device_histogram_pixels / total : 0;
+}
+
+double CoprocessResult::ApplySplit() const {
+    size_t total = host_apply_pixels + device_apply_pixels;
+    return total ? (double)device_apply_pixels / total : 0;
+}
+
+namespace {
+
+// device staging buffers, two chunks in flight so transfers overlap the kernels
+struct Slot {
+    cl::Buffer input;
+    cl::Buffer output;
+    cl::Event done;
+};
+
+const int slot_count = 2;
+
+// the pool tasks use this frame's locals, so before a device error unwinds it they are told
+// there is nothing left to claim and waited for. the device error is the one reported
+void StopWorkers(ThreadPool& pool, std::atomic<size_t>& next_chunk, size_t chunks) {
+    next_chunk = chunks;
+    try {
+        pool.Wait();
+    }
+    catch (...) {
+    }
+}
+
+}
+
+void EqualizeCoprocess(Equalizer& equalizer, ThreadPool& pool, const unsigned char* input, size_t size,
+    unsigned char* output, size_t chunk_size, CoprocessResult& result) {
+    const int binSize = 256;
+    cl::CommandQueue queue = equalizer.Queue();
+    cl::Program program = equalizer.Programs().Get(KernelConfig());
+
+    chunk_size = std::max<size_t>(chunk_size, equalizer.LocalSize());
+    size_t chunks = (size + chunk_size - 1) / chunk_size;
+    size_t workers = pool.Threads();
+
+    // declared before the buffers, so it is refunded once they are released
+    BudgetCharge charge(equalizer.Budget(), slot_count * 2 * chunk_size + binSize * (sizeof(int) + sizeof(cl_uchar)));
+    Slot slots[slot_count];
+    for (Slot& slot : slots) {
+        slot.input = cl::Buffer(equalizer.Context(), CL_MEM_READ_ONLY, chunk_size);
+        slot.output = cl::Buffer(equalizer.Context(), CL_MEM_WRITE_ONLY, chunk_size);
+    }
+
+    cl::Buffer buffer_histogram(equalizer.Context(), CL_MEM_READ_WRITE, binSize * sizeof(int));
+    cl::Buffer buffer_lookup(equalizer.Context(), CL_MEM_READ_ONLY, binSize * sizeof(cl_uchar));
+
+    std::atomic<size_t> next_chunk(0);
+    std::atomic<size_t> host_pixels(0);
+    std::mutex merge_mutex;
+
+    auto chunk_begin = [&](size_t chunk) { return chunk * chunk_size; };
+    auto chunk_count = [&](size_t chunk) { return std::min(chunk_size, size - chunk * chunk_size); };
+
+    // ------- HISTOGRAM PASS -------
+    auto histogram_start = std::chrono::steady_clock::now();
+    std::vector<int> histogram(binSize, 0);
+
+    for (size_t w = 0; w < workers; w++) {
+        pool.Submit([&] {
+            int partial[256] = { 0 };
+            size_t pixels = 0;
+
+            for (size_t chunk = next_chunk++; chunk < chunks; chunk = next_chunk++) {
+                HostHistogram(input + chunk_begin(chunk), chunk_count(chunk), partial);
+                pixels += chunk_count(chunk);
+            }
+
+            host_pixels += pixels;
+            std::lock_guard<std::mutex> lock(merge_mutex);
+            for (int b = 0; b < binSize; b++)
+                histogram[b] += partial[b];
+        });
+    }
+
+    // this thread feeds the device, its histogram accumulates across chunks
+    size_t device_pixels = 0;
+    int slot_index = 0;
+    std::vector<int> device_histogram(binSize);
+
+    try {
+        queue.enqueueFillBuffer(buffer_histogram, 0, 0, binSize * sizeof(int));
+
+        for (size_t chunk = next_chunk++; chunk < chunks; chunk = next_chunk++) {
+            Slot& slot = slots[slot_index];
+            if (slot.done())
+                slot.done.wait();
+
+            queue.enqueueWriteBuffer(slot.input, CL_FALSE, 0, chunk_count(chunk), input + chunk_begin(chunk));
+            equalizer.EnqueueHistogram(program, HIST_LOCAL, slot.input, buffer_histogram, chunk_count(chunk), binSize, 1, &slot.done);
+            queue.flush();
+
+            device_pixels += chunk_count(chunk);
+            slot_index = (slot_index + 1) % slot_count;
+        }
+
+        queue.enqueueReadBuffer(buffer_histogram, CL_TRUE, 0, binSize * sizeof(int), device_histogram.data());
+    }
+    catch (...) {
+        StopWorkers(pool, next_chunk, chunks);
+        throw;
+    }
+    pool.Wait();
+
+    for (int b = 0; b < binSize; b++)
+        histogram[b] += device_histogram[b];
+
+    result.host_histogram_pixels = host_pixels;
+    result.device_histogram_pixels = device_pixels;
+    result.histogram_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - histogram_start).count();
+
+    // ------- SCAN AND LUT -------
+    // 256 entries, cheaper on the host than a round trip
+    std::vector<unsigned char> lookup = HostLookupTable(histogram);
+    queue.enqueueWriteBuffer(buffer_lookup, CL_TRUE, 0, binSize * sizeof(cl_uchar), lookup.data());
+
+    // ------- APPLY PASS -------
+    auto apply_start = std::chrono::steady_clock::now();
+    next_chunk = 0;
+    host_pixels = 0;
+
+    for (size_t w = 0; w < workers; w++) {
+        pool.Submit([&] {
+            size_t pixels = 0;
+
+            for (size_t chunk = next_chunk++; chunk < chunks; chunk = next_chunk++) {
+                HostApplyLookup(input + chunk_begin(chunk), chunk_count(chunk), lookup.data(), output + chunk_begin(chunk));
+                pixels += chunk_count(chunk);
+            }
+
+            host_pixels += pixels;
+        });
+    }
+
+    device_pixels = 0;
+    try {
+        for (Slot& slot : slots) {
+            if (slot.done())
+                slot.done.wait();
+            slot.done = cl::Event();
+        }
+
+        for (size_t chunk = next_chunk++; chunk < chunks; chunk = next_chunk++) {
+            Slot& slot = slots[slot_index];
+            if (slot.done())
+                slot.done.wait();
+
+            queue.enqueueWriteBuffer(slot.input, CL_FALSE, 0, chunk_count(chunk), input + chunk_begin(chunk));
+            equalizer.EnqueueApply(program, slot.input, buffer_lookup, slot.output, chunk_count(chunk), binSize, true, 1, NULL);
+            queue.enqueueReadBuffer(slot.output, CL_FALSE, 0, chunk_count(chunk), output + chunk_begin(chunk), NULL, &slot.done);
+            queue.flush();
+
+            device_pixels += chunk_count(chunk);
+            slot_index = (slot_index + 1) % slot_count;
+        }
+
+        queue.finish();
+    }
+    catch (...) {
+        StopWorkers(pool, next_chunk, chunks);
+        throw;
+    }
+    pool.Wait();
+
+    result.host_apply_pixels = host_pixels;
+    result.device_apply_pixels = device_pixels;
+    result.apply_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - apply_start).count();
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "equalizer.h"
+
+class ThreadPool;
+
+// How the pixel range was shared between the host and the device in one co-processed run
+struct CoprocessResult {
+    size_t host_histogram_pixels = 0;
+    size_t device_histogram_pixels = 0;
+    size_t host_apply_pixels = 0;
+    size_t device_apply_pixels = 0;
+    double histogram_seconds = 0;
+    double apply_seconds = 0;
+
+    // share of pixels the device handled in each pass, 0 to 1
+    double HistogramSplit() const;
+    double ApplySplit() const;
+};
+
+// Equalise with the pool threads and the OpenCL queue working side by side. Both passes cut the
+// image into chunks of chunk_size pixels that are claimed one at a time, so the faster side
+// simply takes more of them. The partial histograms are merged on the host before the scan
+void EqualizeCoprocess(Equalizer& equalizer, ThreadPool& pool, const unsigned char* input, size_t size,
+    unsigned char* output, size_t chunk_size, CoprocessResult& result);
@@ -0,0 +1,322 @@
+#include "cpu_backend.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#include "thread_pool.h"
+
+// MSVC compiles intrinsics for any target, GCC and Clang need the function to opt in
+#if defined(__GNUC__) || defined(__clang__)
+#define CPU_TARGET(isa) __attribute__((target(isa)))
+#else
+#define CPU_TARGET(isa)
+#endif
+
+void HistogramScalar(const unsigned char* data, size_t size, int* histogram) {
+    for (size_t i = 0; i < size; i++)
+        histogram[data[i]]++;
+}
+
+// Neighbouring pixels with the same value make hist[p]++ wait on the store of the previous
+// increment. Byte j of every 8-byte word goes to sub-histogram j instead, so consecutive
+// increments always hit different addresses and the dependency chains run in parallel
+CPU_TARGET("avx2")
+void HistogramAVX2(const unsigned char* data, size_t size, int* histogram) {
+    const int ways = 8;
+    alignas(32) uint32_t sub[ways][256];
+    std::memset(sub, 0, sizeof(sub));
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+
+        // four 8-byte words per load, unrolled across the 8 sub-histograms
+        for (int w = 0; w < 4; w++) {
+            uint64_t word;
+            switch (w) {
+            case 0: word = (uint64_t)_mm256_extract_epi64(block, 0); break;
+            case 1: word = (uint64_t)_mm256_extract_epi64(block, 1); break;
+            case 2: word = (uint64_t)_mm256_extract_epi64(block, 2); break;
+            default: word = (uint64_t)_mm256_extract_epi64(block, 3); break;
+            }
+
+            sub[0][word & 0xFF]++;
+            sub[1][(word >> 8) & 0xFF]++;
+            sub[2][(word >> 16) & 0xFF]++;
+            sub[3][(word >> 24) & 0xFF]++;
+            sub[4][(word >> 32) & 0xFF]++;
+            sub[5][(word >> 40) & 0xFF]++;
+            sub[6][(word >> 48) & 0xFF]++;
+            sub[7][word >> 56]++;
+        }
+    }
+
+    for (; i < size; i++)
+        sub[0][data[i]]++;
+
+    // merge the sub-histograms 8 bins at a time
+    for (int b = 0; b < 256; b += 8) {
+        __m256i sum = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(histogram + b));
+        for (int k = 0; k < ways; k++)
+            sum = _mm256_add_epi32(sum, _mm256_load_si256(reinterpret_cast<const __m256i*>(&sub[k][b])));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(histogram + b), sum);
+    }
+}
+
+namespace {
+
+struct CpuFeatures {
+    bool avx2 = false;
+    bool avx512vbmi = false;    // with AVX-512F and BW, which the VBMI path also uses
+
+    CpuFeatures() {
+#if defined(__GNUC__) || defined(__clang__)
+        avx2 = __builtin_cpu_supports("avx2");
+        avx512vbmi = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+            && __builtin_cpu_supports("avx512vbmi");
+#elif defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7)
+            return;
+
+        // OS must save the YMM (and for AVX-512 the opmask and ZMM) registers
+        __cpuid(info, 1);
+        if (!(info[2] & (1 << 27)))
+            return;
+        unsigned long long xcr0 = _xgetbv(0);
+
+        __cpuidex(info, 7, 0);
+        avx2 = (xcr0 & 0x6) == 0x6 && (info[1] & (1 << 5));
+        avx512vbmi = (xcr0 & 0xE6) == 0xE6 && (info[1] & (1 << 16)) && (info[1] & (1 << 30)) && (info[2] & (1 << 1));
+#endif
+    }
+};
+
+const CpuFeatures& Features() {
+    static const CpuFeatures features;
+    return features;
+}
+
+}
+
+bool CpuSupportsAVX2() {
+    return Features().avx2;
+}
+
+bool CpuSupportsAVX512VBMI() {
+    return Features().avx512vbmi;
+}
+
+size_t LastLevelCacheSize() {
+#if defined(__linux__) && defined(_SC_LEVEL3_CACHE_SIZE)
+    long l3 = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (l3 > 0)
+        return (size_t)l3;
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (l2 > 0)
+        return (size_t)l2;
+#endif
+    return 32 * 1024 * 1024;
+}
+
+void ApplyLookupScalar(const unsigned char* input, size_t size, const unsigned char* lookup, unsigned char* output, bool stream) {
+    // plain stores, the compiler turns this into the best scalar loop it can
+    (void)stream;
+    for (size_t i = 0; i < size; i++)
+        output[i] = lookup[input[i]];
+}
+
+CPU_TARGET("avx2")
+void ApplyLookupAVX2(const unsigned char* input, size_t size, const unsigned char* lookup, unsigned char* output, bool stream) {
+    size_t i = 0;
+
+    // aligned destination for streaming stores
+    if (stream) {
+        for (; i < size && (reinterpret_cast<uintptr_t>(output + i) & 31); i++)
+            output[i] = lookup[input[i]];
+    }
+
+    // slice h holds lookup[16h .. 16h + 15], broadcast to both 128-bit lanes for vpshufb
+    __m256i slices[16];
+    for (int h = 0; h < 16; h++)
+        slices[h] = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(lookup + 16 * h)));
+
+    const __m256i sixteen = _mm256_set1_epi8(16);
+    const __m256i bias = _mm256_set1_epi8(0x70);
+
+    for (; i + 32 <= size; i += 32) {
+        __m256i offset = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i));
+        __m256i result = _mm256_setzero_si256();
+
+        // offset = pixel - 16h. saturating + 0x70 leaves bit 7 clear only for 0..15, and vpshufb
+        // returns zero for indices with bit 7 set, so each slice only fills in its own pixels
+        for (int h = 0; h < 16; h++) {
+            __m256i index = _mm256_adds_epu8(offset, bias);
+            result = _mm256_or_si256(result, _mm256_shuffle_epi8(slices[h], index));
+            offset = _mm256_sub_epi8(offset, sixteen);
+        }
+
+        if (stream)
+            _mm256_stream_si256(reinterpret_cast<__m256i*>(output + i), result);
+        else
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i), result);
+    }
+
+    if (stream)
+        _mm_sfence();
+
+    for (; i < size; i++)
+        output[i] = lookup[input[i]];
+}
+
+CPU_TARGET("avx512f,avx512bw,avx512vbmi")
+void ApplyLookupAVX512VBMI(const unsigned char* input, size_t size, const unsigned char* lookup, unsigned char* output, bool stream) {
+    size_t i = 0;
+
+    if (stream) {
+        for (; i < size && (reinterpret_cast<uintptr_t>(output + i) & 63); i++)
+            output[i] = lookup[input[i]];
+    }
+
+    __m512i lut0 = _mm512_loadu_si512(lookup);
+    __m512i lut1 = _mm512_loadu_si512(lookup + 64);
+    __m512i lut2 = _mm512_loadu_si512(lookup + 128);
+    __m512i lut3 = _mm512_loadu_si512(lookup + 192);
+
+    for (; i + 64 <= size; i += 64) {
+        __m512i pixels = _mm512_loadu_si512(input + i);
+
+        // vpermi2b uses the low 7 bits, bit 7 picks between the two halves of the LUT
+        __m512i low = _mm512_permutex2var_epi8(lut0, pixels, lut1);
+        __m512i high = _mm512_permutex2var_epi8(lut2, pixels, lut3);
+        __m512i result = _mm512_mask_blend_epi8(_mm512_movepi8_mask(pixels), low, high);
+
+        if (stream)
+            _mm512_stream_si512(reinterpret_cast<__m512i*>(output + i), result);
+        else
+            _mm512_storeu_si512(output + i, result);
+    }
+
+    if (stream)
+        _mm_sfence();
+
+    for (; i < size; i++)
+        output[i] = lookup[input[i]];
+}
+
+const char* HostApplyLookupTier() {
+    if (CpuSupportsAVX512VBMI())
+        return "AVX-512 VBMI";
+    if (CpuSupportsAVX2())
+        return "AVX2";
+    return "scalar";
+}
+
+void HostApplyLookup(const unsigned char* input, size_t size, const unsigned char* lookup, unsigned char* output) {
+    static const size_t llc = LastLevelCacheSize();
+    HostApplyLookup(input, size, lookup, output, size > llc);
+}
+
+void HostApplyLookup(const unsigned char* input, size_t size, const unsigned char* lookup, unsigned char* output, bool stream) {
+    if (CpuSupportsAVX512VBMI())
+        ApplyLookupAVX512VBMI(input, size, lookup, output, stream);
+    else if (CpuSupportsAVX2())
+        ApplyLookupAVX2(input, size, lookup, output, stream);
+    else
+        ApplyLookupScalar(input, size, lookup, output, stream);
+}
+
+void HostHistogram(const unsigned char* data, size_t size, int* histogram) {
+    if (CpuSupportsAVX2())
+        HistogramAVX2(data, size, histogram);
+    else
+        HistogramScalar(data, size, histogram);
+}
+
+std::vector<unsigned char> HostLookupTable(const std::vector<int>& histogram) {
+    std::vector<unsigned char> lookup(histogram.size(), 0);
+    long long total = 0;
+    for (int count : histogram)
+        total += count;
+    if (total <= 0)
+        return lookup;
+
+    long long running = 0;
+    for (size_t i = 0; i < histogram.size(); i++) {
+        running += histogram[i];
+        lookup[i] = (unsigned char)((float)running * 255.0f / total);
+    }
+
+    return lookup;
+}
+
+namespace {
+
+// about 256 KiB of whole rows per tile, enough work per task to hide the scheduling cost
+size_t TileSize(size_t size, size_t row_size) {
+    const size_t target = 256 * 1024;
+
+    if (row_size == 0 || row_size > size)
+        row_size = 1;
+    size_t rows = std::max<size_t>(1, target / row_size);
+
+    return rows * row_size;
+}
+
+}
+
+void ParallelHistogram(ThreadPool& pool, const unsigned char* data, size_t size, size_t row_size, int* histogram) {
+    std::mutex merge_mutex;
+
+    pool.ParallelFor(0, size, TileSize(size, row_size), [&](size_t begin, size_t end) {
+        int tile_histogram[256] = { 0 };
+        HostHistogram(data + begin, end - begin, tile_histogram);
+
+        std::lock_guard<std::mutex> lock(merge_mutex);
+        for (int b = 0; b < 256; b++)
+            histogram[b] += tile_histogram[b];
+    });
+}
+
+void ParallelApplyLookup(ThreadPool& pool, const unsigned char* input, size_t size, size_t row_size,
+    const unsigned char* lookup, unsigned char* output) {
+    // tiles are cache sized, decide on streaming stores from the whole output
+    bool stream = size > LastLevelCacheSize();
+
+    pool.ParallelFor(0, size, TileSize(size, row_size), [&](size_t begin, size_t end) {
+        HostApplyLookup(input + begin, end - begin, lookup, output + begin, stream);
+    });
+}
+
+void EqualizeCPU(const unsigned char* input, size_t size, unsigned char* output, ThreadPool* pool, size_t row_size) {
+    std::vector<int> histogram(256, 0);
+
+    if (pool)
+        ParallelHistogram(*pool, input, size, row_size, histogram.data());
+    else
+        HostHistogram(input, size, histogram.data());
+
+    EqualizeFromHistogramCPU(input, size, histogram, output, pool, row_size);
+}
+
+void EqualizeFromHistogramCPU(const unsigned char* input, size_t size, const std::vector<int>& histogram,
+    unsigned char* output, ThreadPool* pool, size_t row_size) {
+    std::vector<unsigned char> lookup = HostLookupTable(histogram);
+
+    if (pool)
+        ParallelApplyLookup(*pool, input, size, row_size, lookup.data(), output);
+    else
+        HostApplyLookup(input, size, lookup.data(), output);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+class ThreadPool;
+
+// Host implementations of the equalisation steps, used when no OpenCL device is available (-cpu)
+// and as the reference the device kernels are checked against in the benchmarks
+
+// add the 256-bin histogram of data to histogram
+void HistogramScalar(const unsigned char* data, size_t size, int* histogram);
+
+// as HistogramScalar with 8 interleaved sub-histograms and 32-byte loads, requires AVX2
+void HistogramAVX2(const unsigned char* data, size_t size, int* histogram);
+
+// the fastest histogram the CPU supports
+void HostHistogram(const unsigned char* data, size_t size, int* histogram);
+
+bool CpuSupportsAVX2();
+bool CpuSupportsAVX512VBMI();
+
+// output[i] = lookup[input[i]] for a 256-entry byte LUT. stream selects non-temporal stores,
+// which keep outputs larger than the last level cache from evicting the input
+void ApplyLookupScalar(const unsigned char* input, size_t size, const unsigned char* lookup, unsigned char* output, bool stream);
+
+// 32 pixels per step, 16 pshufb lookups into 16-entry slices of the LUT selected by the high nibble
+void ApplyLookupAVX2(const unsigned char* input, size_t size, const unsigned char* lookup, unsigned char* output, bool stream);
+
+// 64 pixels per step, vpermi2b over the LUT held in four 64-byte registers
+void ApplyLookupAVX512VBMI(const unsigned char* input, size_t size, const unsigned char* lookup, unsigned char* output, bool stream);
+
+// the fastest LUT apply the CPU supports, streaming stores once size exceeds the last level cache
+void HostApplyLookup(const unsigned char* input, size_t size, const unsigned char* lookup, unsigned char* output);
+void HostApplyLookup(const unsigned char* input, size_t size, const unsigned char* lookup, unsigned char* output, bool stream);
+
+// name of the tier HostApplyLookup uses
+const char* HostApplyLookupTier();
+
+// last level cache size in bytes, 32 MiB when it cannot be queried
+size_t LastLevelCacheSize();
+
+// the lookup table lookuptable computes, on the host
+std::vector<unsigned char> HostLookupTable(const std::vector<int>& histogram);
+
+// histogram, cumulative histogram, LUT and apply for one 8-bit image on the host.
+// with a pool the histogram and apply passes are split into tiles of whole rows of row_size pixels
+void EqualizeCPU(const unsigned char* input, size_t size, unsigned char* output,
+    ThreadPool* pool = nullptr, size_t row_size = 0);
+
+// LUT and apply on the host from a histogram that is already known
+void EqualizeFromHistogramCPU(const unsigned char* input, size_t size, const std::vector<int>& histogram,
+    unsigned char* output, ThreadPool* pool = nullptr, size_t row_size = 0);
+
+// HostHistogram over row tiles on the pool, adds to histogram
+void ParallelHistogram(ThreadPool& pool, const unsigned char* data, size_t size, size_t row_size, int* histogram);
+
+// HostApplyLookup over row tiles on the pool
+void ParallelApplyLookup(ThreadPool& pool, const unsigned char* input, size_t size, size_t row_size,
+    const unsigned char* lookup, unsigned char* output);
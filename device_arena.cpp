@@ -0,0 +1,97 @@
+#include "device_arena.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include "equalizer.h"
+#include "memory_budget.h"
+
+DeviceArena::DeviceArena(const cl::Context& context, const cl::Device& device, const cl::CommandQueue& queue)
+    : context_(context), queue_(queue) {
+    // reported in bits, sub-buffer origins must be a multiple of it
+    alignment_ = std::max<size_t>(device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8, 1);
+    max_allocation_ = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+}
+
+DeviceArena::~DeviceArena() {
+    Free();
+}
+
+void DeviceArena::Free() {
+    input_ = output_ = cum_histogram_ = lookup_ = cl::Buffer();
+    histograms_[0] = histograms_[1] = cl::Buffer();
+    backing_ = cl::Buffer();
+    if (budget_)
+        budget_->Release(capacity_);
+
+    capacity_ = 0;
+    image_size_ = 0;
+    bin_size_ = 0;
+    counter_bytes_ = 0;
+}
+
+void DeviceArena::SetBudget(MemoryBudget* budget) {
+    if (capacity_ > 0)
+        throw std::logic_error("DeviceArena::SetBudget called after the backing buffer was allocated");
+    budget_ = budget;
+}
+
+size_t DeviceArena::Footprint(size_t image_size, int binSize, bool in_place, size_t counter_bytes) const {
+    size_t image_bytes = RoundUp(image_size, alignment_);
+    size_t table_bytes = RoundUp(binSize * counter_bytes, alignment_);
+    return (in_place ? 1 : 2) * image_bytes + 4 * table_bytes;
+}
+
+cl::Buffer DeviceArena::Carve(size_t& offset, size_t size) {
+    cl_buffer_region region = { offset, size };
+    offset = RoundUp(offset + size, alignment_);
+    return backing_.createSubBuffer(CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region);
+}
+
+void DeviceArena::Reserve(size_t image_size, int binSize, bool in_place, size_t counter_bytes, bool charged) {
+    if (image_size == image_size_ && binSize == bin_size_ && in_place == in_place_ && counter_bytes == counter_bytes_)
+        return;
+
+    size_t table_size = binSize * counter_bytes;
+    size_t needed = Footprint(image_size, binSize, in_place, counter_bytes);
+
+    if (needed > max_allocation_)
+        throw std::runtime_error("Image needs " + std::to_string(needed) + " bytes of device memory, more than the "
+            + std::to_string(max_allocation_) + " one allocation can hold" + (in_place ? "" : ", try equalising in place"));
+
+    if (needed > capacity_) {
+        // the old buffer is given back before waiting, holding it could keep the new one from ever fitting
+        Free();
+        if (budget_ && !charged)
+            budget_->Acquire(needed);
+
+        try {
+            backing_ = cl::Buffer(context_, CL_MEM_READ_WRITE, needed);
+        }
+        catch (...) {
+            if (budget_)
+                budget_->Release(needed);
+            throw;
+        }
+        capacity_ = needed;
+        allocations_++;
+    }
+
+    size_t offset = 0;
+    input_ = image_size > 0 ? Carve(offset, image_size) : cl::Buffer();
+    output_ = (image_size > 0 && !in_place) ? Carve(offset, image_size) : cl::Buffer();
+    histograms_[0] = Carve(offset, table_size);
+    histograms_[1] = Carve(offset, table_size);
+    cum_histogram_ = Carve(offset, table_size);
+    lookup_ = Carve(offset, table_size);
+
+    // the only fill, from here on the histogram kernels keep the next histogram zeroed
+    current_ = 0;
+    queue_.enqueueFillBuffer(histograms_[current_], (cl_uchar)0, 0, table_size);
+
+    image_size_ = image_size;
+    bin_size_ = binSize;
+    in_place_ = in_place;
+    counter_bytes_ = counter_bytes;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "include/Utils.h"
+
+class MemoryBudget;
+
+// One device allocation shared by every buffer of a pipeline run. The backing buffer grows to
+// the largest image seen and is carved into aligned sub-buffers for the input, output, two
+// histograms, the cumulative histogram and the LUT, so consecutive images allocate nothing.
+// In place runs skip the output region and write the result over the input.
+// The two histograms take turns: the histogram kernel of one image zeroes the other one for
+// the next image, so no fill is queued between images
+class DeviceArena {
+public:
+    DeviceArena(const cl::Context& context, const cl::Device& device, const cl::CommandQueue& queue);
+
+    // refunds the budget for the backing buffer
+    ~DeviceArena();
+
+    DeviceArena(const DeviceArena&) = delete;
+    DeviceArena& operator=(const DeviceArena&) = delete;
+
+    // charge growth of the backing buffer to budget, before the first Reserve
+    void SetBudget(MemoryBudget* budget);
+
+    // carve the regions for an image of image_size pixels and binSize bins of counter_bytes each,
+    // reallocating the backing buffer only when they do not fit. regions stay valid until the
+    // next Reserve. throws when they would not fit in one device allocation. image_size 0 carves only
+    // the tables, for callers that bring their own image buffers.
+    // with a budget the old buffer is refunded and the new one charged first, waiting behind
+    // other requests until it fits. charged tells that the caller already took Footprint bytes
+    // for a new buffer itself, after a Free
+    void Reserve(size_t image_size, int binSize, bool in_place = false, size_t counter_bytes = sizeof(int), bool charged = false);
+
+    // bytes of backing buffer Reserve needs for this layout
+    size_t Footprint(size_t image_size, int binSize, bool in_place = false, size_t counter_bytes = sizeof(int)) const;
+
+    // drop the backing buffer and its regions and refund the budget, the next Reserve allocates again
+    void Free();
+
+    const cl::Buffer& Input() const { return input_; }
+    const cl::Buffer& Output() const { return in_place_ ? input_ : output_; }
+    const cl::Buffer& CumHistogram() const { return cum_histogram_; }
+    const cl::Buffer& Lookup() const { return lookup_; }   // binSize counters, also fits a byte LUT
+
+    // zeroed histogram for the current image
+    const cl::Buffer& Histogram() const { return histograms_[current_]; }
+
+    // histogram for the following image, the current histogram kernel must zero it
+    const cl::Buffer& NextHistogram() const { return histograms_[1 - current_]; }
+
+    // once a histogram kernel has zeroed NextHistogram, make it the current one
+    void Swap() { current_ = 1 - current_; }
+
+    size_t Capacity() const { return capacity_; }
+    size_t Alignment() const { return alignment_; }
+    size_t Allocations() const { return allocations_; }
+
+private:
+    // sub-buffer of size bytes at offset, offset then moves past it to the next aligned start
+    cl::Buffer Carve(size_t& offset, size_t size);
+
+    cl::Context context_;
+    cl::CommandQueue queue_;
+    size_t alignment_;          // CL_DEVICE_MEM_BASE_ADDR_ALIGN in bytes
+    size_t max_allocation_;     // CL_DEVICE_MAX_MEM_ALLOC_SIZE
+    MemoryBudget* budget_ = nullptr;
+    cl::Buffer backing_;
+    size_t capacity_ = 0;
+    size_t allocations_ = 0;
+
+    size_t image_size_ = 0;     // layout the regions were carved for
+    int bin_size_ = 0;
+    bool in_place_ = false;
+    size_t counter_bytes_ = 0;
+
+    cl::Buffer input_;
+    cl::Buffer output_;
+    cl::Buffer histograms_[2];
+    cl::Buffer cum_histogram_;
+    cl::Buffer lookup_;
+    int current_ = 0;
+};
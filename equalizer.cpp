@@ -0,0 +1,974 @@
+#include "equalizer.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <stdexcept>
+
+Equalizer::Equalizer(const cl::Context& context, const cl::CommandQueue& queue, ProgramCache& programs)
+    : context_(context), queue_(queue), device_(context.getInfo<CL_CONTEXT_DEVICES>()[0]), programs_(programs),
+      arena_(context, device_, queue) {
+    // use at most 256 work items per group, fewer if the device cannot handle that many
+    size_t max_wg_size = device_.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+    local_size_ = std::min(max_wg_size, (size_t)(256));
+
+    compute_units_ = device_.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+    int64_atomics_ = device_.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_int64_base_atomics") != std::string::npos;
+}
+
+cl::Program Equalizer::ProgramFor(const EqualizeOptions& options, size_t image_size) {
+    KernelConfig config;
+    config.pixels_per_item = std::max(options.pixels_per_item, 1);
+
+    if (options.specialise) {
+        config.bin_size = options.bin_size;
+        if (image_size <= INT_MAX)
+            config.image_size = static_cast<int>(image_size);
+    }
+
+    // histogram_wide only exists in programs built with the extension enabled
+    if ((options.wide || image_size >= INT_MAX) && int64_atomics_)
+        config.extra_options = "-D INT64_ATOMICS";
+
+    return programs_.Get(config);
+}
+
+double ApproxLutDeviation(size_t samples, double confidence) {
+    if (samples == 0)
+        return 255.0;
+
+    double epsilon = std::sqrt(std::log(2.0 / (1.0 - confidence)) / (2.0 * samples));
+    return std::min(255.0, 255.0 * epsilon);
+}
+
+HistogramVariant Equalizer::PlanHistogram(const EqualizeOptions& options, const unsigned char* input, size_t image_size) {
+    if (options.histogram != HIST_AUTO)
+        return options.histogram;
+
+    HistogramProbe probe = ProbeHistogram(input, image_size);
+    HistogramVariant variant = planner_.Choose(probe);
+
+    std::cout << "Histogram plan: " << probe.samples << " samples, entropy " << probe.entropy
+        << " bits, max bin " << probe.max_bin_fraction * 100 << "% -> " << HistogramVariantName(variant) << std::endl;
+
+    return variant;
+}
+
+void Equalizer::EnqueueHistogram(cl::Program& program, HistogramVariant variant, const cl::Buffer& input,
+    const cl::Buffer& histogram, size_t image_size, int binSize, int pixels_per_item, cl::Event* event,
+    const cl::Buffer* next_histogram) {
+    // each work item covers pixels_per_item pixels, so launch that many times fewer items
+    size_t ppi = std::max(pixels_per_item, 1);
+    size_t items = (image_size + ppi - 1) / ppi;
+    cl::NDRange global_size(RoundUp(items, local_size_));
+    cl::NDRange local_size(local_size_);
+
+    const char* name = "histogram";
+    if (variant == HIST_LOCAL) name = "histogram_local";
+    else if (variant == HIST_REPLICATED) name = "histogram_replicated";
+
+    cl::Kernel histogramKernel = programs_.Kernel(program, name);
+    histogramKernel.setArg(0, input);
+    histogramKernel.setArg(1, histogram);
+
+    if (variant == HIST_LOCAL || variant == HIST_REPLICATED) {
+        size_t copies = (variant == HIST_REPLICATED) ? histogram_replicas : 1;
+        histogramKernel.setArg(2, cl::Local(copies * binSize * sizeof(int)));
+        histogramKernel.setArg(3, static_cast<int>(image_size));
+        histogramKernel.setArg(4, binSize);
+        histogramKernel.setArg(5, next_histogram ? *next_histogram : cl::Buffer());
+    }
+    else {
+        histogramKernel.setArg(2, static_cast<int>(image_size));
+        histogramKernel.setArg(3, next_histogram ? *next_histogram : cl::Buffer());
+        histogramKernel.setArg(4, binSize);
+    }
+
+    queue_.enqueueNDRangeKernel(histogramKernel, cl::NullRange, global_size, local_size, NULL, event);
+}
+
+void Equalizer::EnqueueSampledHistogram(cl::Program& program, const cl::Buffer& input, const cl::Buffer& histogram,
+    size_t image_size, int binSize, int stride, cl::Event* event, const cl::Buffer* next_histogram) {
+    size_t samples = (image_size + stride - 1) / stride;
+
+    cl::Kernel sampledKernel = programs_.Kernel(program, "histogram_sampled");
+    sampledKernel.setArg(0, input);
+    sampledKernel.setArg(1, histogram);
+    sampledKernel.setArg(2, cl::Local(binSize * sizeof(int)));
+    sampledKernel.setArg(3, static_cast<int>(image_size));
+    sampledKernel.setArg(4, stride);
+    sampledKernel.setArg(5, binSize);
+    sampledKernel.setArg(6, next_histogram ? *next_histogram : cl::Buffer());
+
+    queue_.enqueueNDRangeKernel(sampledKernel, cl::NullRange, cl::NDRange(RoundUp(samples, local_size_)), cl::NDRange(local_size_), NULL, event);
+}
+
+void Equalizer::EnqueueLookup(cl::Program& program, const cl::Buffer& cum_histogram, const cl::Buffer& lookup,
+    int binSize, bool byte_lut, cl::Event* event) {
+    cl::Kernel lookupKernel = programs_.Kernel(program, byte_lut ? "lookuptable_uchar" : "lookuptable");
+
+    lookupKernel.setArg(0, cum_histogram);
+    lookupKernel.setArg(1, lookup);
+    lookupKernel.setArg(2, binSize);
+
+    queue_.enqueueNDRangeKernel(lookupKernel, cl::NullRange, cl::NDRange(binSize), cl::NullRange, NULL, event);
+}
+
+void Equalizer::EnqueueApply(cl::Program& program, const cl::Buffer& input, const cl::Buffer& lookup, const cl::Buffer& output,
+    size_t image_size, int binSize, bool byte_lut, int pixels_per_item, cl::Event* event) {
+    size_t ppi = std::max(pixels_per_item, 1);
+    size_t items = (image_size + ppi - 1) / ppi;
+
+    cl::Kernel createimgKernel = programs_.Kernel(program, byte_lut ? "createimg_local" : "createimg");
+
+    createimgKernel.setArg(0, input);
+    createimgKernel.setArg(1, lookup);
+    createimgKernel.setArg(2, output);
+    if (byte_lut) {
+        createimgKernel.setArg(3, cl::Local(binSize * sizeof(cl_uchar)));
+        createimgKernel.setArg(4, static_cast<int>(image_size));
+        createimgKernel.setArg(5, binSize);
+    }
+    else {
+        createimgKernel.setArg(3, static_cast<int>(image_size));
+    }
+
+    queue_.enqueueNDRangeKernel(createimgKernel, cl::NullRange, cl::NDRange(RoundUp(items, local_size_)), cl::NDRange(local_size_), NULL, event);
+}
+
+void Equalizer::Scan(cl::Program& program, const cl::Buffer& histogram, const cl::Buffer& cum_histogram,
+    int binSize, ScanMode mode, std::vector<cl::Event>& events) {
+    if (mode == SCAN_AUTO)
+        mode = ((size_t)binSize > local_size_) ? SCAN_BLOCK : SCAN_SEQUENTIAL;
+
+    if (mode == SCAN_SEQUENTIAL) {
+        cl::Kernel cum_histogramKernel = programs_.Kernel(program, "cumulative_histo");
+
+        cum_histogramKernel.setArg(0, histogram);
+        cum_histogramKernel.setArg(1, cum_histogram);
+        cum_histogramKernel.setArg(2, binSize);
+
+        events.emplace_back();
+        queue_.enqueueNDRangeKernel(cum_histogramKernel, cl::NullRange, cl::NDRange(1), cl::NullRange, NULL, &events.back());
+        return;
+    }
+
+    // one block per work group, the block sums buffer is kept between runs
+    size_t blocks = (binSize + local_size_ - 1) / local_size_;
+    size_t scratch_size = local_size_ * sizeof(int);
+
+    if (blocks > block_sums_count_) {
+        block_sums_ = cl::Buffer(context_, CL_MEM_READ_WRITE, blocks * sizeof(int));
+        block_sums_count_ = blocks;
+    }
+
+    cl::Kernel reduceKernel = programs_.Kernel(program, "scan_block_reduce");
+    reduceKernel.setArg(0, histogram);
+    reduceKernel.setArg(1, block_sums_);
+    reduceKernel.setArg(2, cl::Local(scratch_size));
+    reduceKernel.setArg(3, binSize);
+
+    cl::Kernel sumsKernel = programs_.Kernel(program, "scan_block_sums");
+    sumsKernel.setArg(0, block_sums_);
+    sumsKernel.setArg(1, cl::Local(scratch_size));
+    sumsKernel.setArg(2, cl::Local(scratch_size));
+    sumsKernel.setArg(3, static_cast<int>(blocks));
+
+    cl::Kernel applyKernel = programs_.Kernel(program, "scan_block_apply");
+    applyKernel.setArg(0, histogram);
+    applyKernel.setArg(1, cum_histogram);
+    applyKernel.setArg(2, block_sums_);
+    applyKernel.setArg(3, cl::Local(scratch_size));
+    applyKernel.setArg(4, cl::Local(scratch_size));
+    applyKernel.setArg(5, binSize);
+
+    cl::NDRange global_size(blocks * local_size_);
+    cl::NDRange local_size(local_size_);
+
+    events.emplace_back();
+    queue_.enqueueNDRangeKernel(reduceKernel, cl::NullRange, global_size, local_size, NULL, &events.back());
+    events.emplace_back();
+    queue_.enqueueNDRangeKernel(sumsKernel, cl::NullRange, local_size, local_size, NULL, &events.back());
+    events.emplace_back();
+    queue_.enqueueNDRangeKernel(applyKernel, cl::NullRange, global_size, local_size, NULL, &events.back());
+}
+
+void Equalizer::RunBatch(const std::vector<ImageView>& images, const std::vector<unsigned char*>& outputs,
+    const EqualizeOptions& options, BatchResult& result) {
+    int binSize = options.bin_size;
+    int count = static_cast<int>(images.size());
+    int stride = std::max(options.approx_stride, 1);
+
+    // offsets table, offsets[i] is the first pixel of image i
+    std::vector<int> offsets(images.size() + 1, 0);
+    for (size_t i = 0; i < images.size(); i++) {
+        if (offsets[i] + images[i].size > INT_MAX)
+            throw std::length_error("Batch exceeds INT_MAX pixels, split it into smaller batches");
+        offsets[i + 1] = offsets[i] + static_cast<int>(images[i].size);
+    }
+
+    size_t total = offsets.back();
+    result.images = images.size();
+    result.pixels = total;
+    if (total == 0)
+        return;
+
+    // more than the budget could ever hold at once, each half goes on its own and a single image is tiled
+    if (budget_ && arena_.Footprint(total, count * binSize, options.in_place) > budget_->Capacity()) {
+        if (images.size() == 1) {
+            EqualizeResult single;
+            Run(images[0].data, images[0].size, outputs[0], options, single);
+            result.histogram_event = single.histogram_event;
+            result.cum_histogram_event = single.cum_histogram_event;
+            result.lookup_event = single.lookup_event;
+            result.createimg_event = single.createimg_event;
+            result.upload_event = single.upload_event;
+            result.download_event = single.download_event;
+            return;
+        }
+
+        size_t half = images.size() / 2;
+        BatchResult first;
+        RunBatch(std::vector<ImageView>(images.begin(), images.begin() + half),
+            std::vector<unsigned char*>(outputs.begin(), outputs.begin() + half), options, first);
+        RunBatch(std::vector<ImageView>(images.begin() + half, images.end()),
+            std::vector<unsigned char*>(outputs.begin() + half, outputs.end()), options, result);
+
+        // the upload to download span then covers both halves, unless one was tiled without transfers
+        if (result.upload_event() && first.upload_event())
+            result.upload_event = first.upload_event;
+        else
+            result.upload_event = cl::Event();
+        result.images = images.size();
+        result.pixels = total;
+        return;
+    }
+
+    // pack all images into one host buffer so they go over in a single transfer
+    std::vector<unsigned char> packed(total);
+    for (size_t i = 0; i < images.size(); i++)
+        std::copy(images[i].data, images[i].data + images[i].size, packed.begin() + offsets[i]);
+
+    // image sizes vary within a batch, so only the bin count can be specialised
+    KernelConfig config;
+    if (options.specialise)
+        config.bin_size = binSize;
+    cl::Program program = programs_.Get(config);
+
+    size_t histograms_size = images.size() * binSize * sizeof(int);
+
+    // the packed images and one table of binSize counters per image come from the arena, the
+    // byte LUTs fit in its lookup region
+    ArenaUse use(*this);
+    arena_.Reserve(total, count * binSize, options.in_place);
+    cl::Buffer buffer_image_input = arena_.Input();
+    cl::Buffer buffer_image_output = arena_.Output();
+    cl::Buffer buffer_histo_output = arena_.Histogram();
+    cl::Buffer buffer_cum_histo_output = arena_.CumHistogram();
+    cl::Buffer buffer_lookup_output = arena_.Lookup();
+
+    // kept between batches like the block sums
+    if (offsets.size() > batch_offsets_count_) {
+        batch_offsets_ = cl::Buffer(context_, CL_MEM_READ_ONLY, offsets.size() * sizeof(int));
+        batch_offsets_count_ = offsets.size();
+    }
+
+    queue_.enqueueWriteBuffer(buffer_image_input, CL_FALSE, 0, total, packed.data(), NULL, &result.upload_event);
+    queue_.enqueueWriteBuffer(batch_offsets_, CL_FALSE, 0, offsets.size() * sizeof(int), offsets.data());
+
+    cl::NDRange pixel_range(RoundUp(total, local_size_));
+    cl::NDRange local_size(local_size_);
+
+    // the arena keeps its current histogram zeroed
+    cl::Kernel histogramKernel = programs_.Kernel(program, "histogram_batch");
+    histogramKernel.setArg(0, buffer_image_input);
+    histogramKernel.setArg(1, batch_offsets_);
+    histogramKernel.setArg(2, buffer_histo_output);
+    histogramKernel.setArg(3, count);
+    histogramKernel.setArg(4, binSize);
+    histogramKernel.setArg(5, stride);
+    queue_.enqueueNDRangeKernel(histogramKernel, cl::NullRange, pixel_range, local_size, NULL, &result.histogram_event);
+
+    cl::Kernel cum_histogramKernel = programs_.Kernel(program, "cumulative_histo_batch");
+    cum_histogramKernel.setArg(0, buffer_histo_output);
+    cum_histogramKernel.setArg(1, buffer_cum_histo_output);
+    cum_histogramKernel.setArg(2, count);
+    cum_histogramKernel.setArg(3, binSize);
+    queue_.enqueueNDRangeKernel(cum_histogramKernel, cl::NullRange, cl::NDRange(images.size()), cl::NullRange, NULL, &result.cum_histogram_event);
+
+    cl::Kernel lookupKernel = programs_.Kernel(program, "lookuptable_batch");
+    lookupKernel.setArg(0, buffer_cum_histo_output);
+    lookupKernel.setArg(1, buffer_lookup_output);
+    lookupKernel.setArg(2, count);
+    lookupKernel.setArg(3, binSize);
+    queue_.enqueueNDRangeKernel(lookupKernel, cl::NullRange, cl::NDRange(binSize, images.size()), cl::NullRange, NULL, &result.lookup_event);
+
+    cl::Kernel createimgKernel = programs_.Kernel(program, "createimg_batch");
+    createimgKernel.setArg(0, buffer_image_input);
+    createimgKernel.setArg(1, batch_offsets_);
+    createimgKernel.setArg(2, buffer_lookup_output);
+    createimgKernel.setArg(3, buffer_image_output);
+    createimgKernel.setArg(4, count);
+    createimgKernel.setArg(5, binSize);
+    queue_.enqueueNDRangeKernel(createimgKernel, cl::NullRange, pixel_range, local_size, NULL, &result.createimg_event);
+
+    // the next run of this layout expects the histogram zeroed again
+    queue_.enqueueFillBuffer(buffer_histo_output, 0, 0, histograms_size);
+
+    // read the packed result back and hand each image its slice
+    queue_.enqueueReadBuffer(buffer_image_output, CL_TRUE, 0, total, packed.data(), NULL, &result.download_event);
+    for (size_t i = 0; i < images.size(); i++)
+        std::copy(packed.begin() + offsets[i], packed.begin() + offsets[i + 1], outputs[i]);
+}
+
+void Equalizer::RunProgressive(const unsigned char* input, int width, int height, int planes, unsigned char* output,
+    int factor, const PreviewCallback& on_preview, const EqualizeOptions& options, EqualizeResult& result) {
+    int binSize = options.bin_size;
+    size_t image_size = (size_t)width * height * planes;
+    factor = std::max(factor, 1);
+
+    int preview_width = (width + factor - 1) / factor;
+    int preview_height = (height + factor - 1) / factor;
+    size_t preview_size = (size_t)preview_width * preview_height * planes;
+
+    // pick the histogram strategy now, before anything is queued
+    HistogramVariant variant = PlanHistogram(options, input, image_size);
+    cl::Program program = ProgramFor(options, image_size);
+    cl::Program preview_program = programs_.Get(KernelConfig());
+
+    size_t histogram_size = binSize * sizeof(int);
+    size_t lookup_size = binSize * sizeof(cl_uchar);
+
+    // both chains are queued at once, so their buffers are charged together rather than from the arena
+    BudgetCharge charge(budget_, 2 * image_size + 2 * preview_size + 4 * histogram_size + 2 * lookup_size);
+    cl::Buffer buffer_image_input(context_, CL_MEM_READ_ONLY, image_size);
+    cl::Buffer buffer_image_output(context_, CL_MEM_WRITE_ONLY, image_size);
+    cl::Buffer buffer_preview_input(context_, CL_MEM_READ_WRITE, preview_size);
+    cl::Buffer buffer_preview_output(context_, CL_MEM_WRITE_ONLY, preview_size);
+    cl::Buffer buffer_preview_histo(context_, CL_MEM_READ_WRITE, histogram_size);
+    cl::Buffer buffer_preview_cum_histo(context_, CL_MEM_READ_WRITE, histogram_size);
+    cl::Buffer buffer_preview_lookup(context_, CL_MEM_READ_WRITE, lookup_size);
+    cl::Buffer buffer_histo_output(context_, CL_MEM_READ_WRITE, histogram_size);
+    cl::Buffer buffer_cum_histo_output(context_, CL_MEM_READ_WRITE, histogram_size);
+    cl::Buffer buffer_lookup_output(context_, CL_MEM_READ_WRITE, lookup_size);
+
+    // nothing below blocks until the preview read, the in-order queue keeps the dependencies
+    queue_.enqueueWriteBuffer(buffer_image_input, CL_FALSE, 0, image_size, input);
+
+    // ------- PREVIEW CHAIN -------
+    cl::Kernel downsampleKernel = programs_.Kernel(preview_program, "downsample");
+    downsampleKernel.setArg(0, buffer_image_input);
+    downsampleKernel.setArg(1, buffer_preview_input);
+    downsampleKernel.setArg(2, width);
+    downsampleKernel.setArg(3, height);
+    downsampleKernel.setArg(4, factor);
+    queue_.enqueueNDRangeKernel(downsampleKernel, cl::NullRange, cl::NDRange(preview_width, preview_height, planes), cl::NullRange);
+
+    std::vector<cl::Event> preview_scan_events;
+    queue_.enqueueFillBuffer(buffer_preview_histo, 0, 0, histogram_size);
+    EnqueueHistogram(preview_program, HIST_LOCAL, buffer_preview_input, buffer_preview_histo, preview_size, binSize, 1, NULL);
+    Scan(preview_program, buffer_preview_histo, buffer_preview_cum_histo, binSize, options.scan, preview_scan_events);
+    EnqueueLookup(preview_program, buffer_preview_cum_histo, buffer_preview_lookup, binSize, true, NULL);
+    EnqueueApply(preview_program, buffer_preview_input, buffer_preview_lookup, buffer_preview_output, preview_size, binSize, true, 1, NULL);
+
+    std::vector<unsigned char> preview(preview_size);
+    cl::Event preview_read;
+    queue_.enqueueReadBuffer(buffer_preview_output, CL_FALSE, 0, preview_size, preview.data(), NULL, &preview_read);
+
+    // ------- FULL RESOLUTION CHAIN -------
+    queue_.enqueueFillBuffer(buffer_histo_output, 0, 0, histogram_size);
+    result.histogram_variant = variant;
+    result.histogram_samples = image_size;
+    EnqueueHistogram(program, variant, buffer_image_input, buffer_histo_output, image_size, binSize,
+        options.pixels_per_item, &result.histogram_event);
+
+    result.scan_events.clear();
+    Scan(program, buffer_histo_output, buffer_cum_histo_output, binSize, options.scan, result.scan_events);
+    result.cum_histogram_event = result.scan_events.back();
+
+    EnqueueLookup(program, buffer_cum_histo_output, buffer_lookup_output, binSize, true, &result.lookup_event);
+    EnqueueApply(program, buffer_image_input, buffer_lookup_output, buffer_image_output, image_size, binSize, true,
+        options.pixels_per_item, &result.createimg_event);
+
+    cl::Event full_read;
+    queue_.enqueueReadBuffer(buffer_image_output, CL_FALSE, 0, image_size, output, NULL, &full_read);
+    queue_.flush();
+
+    // show the preview while the device carries on with the full image
+    preview_read.wait();
+    if (on_preview)
+        on_preview(preview.data(), preview_width, preview_height);
+
+    full_read.wait();
+}
+
+void Equalizer::Run(const unsigned char* input, size_t image_size, unsigned char* output,
+    const EqualizeOptions& options, EqualizeResult& result, const int* host_histogram) {
+    // int indices and counters would overflow, the fused read histogram included
+    if (options.wide || image_size >= INT_MAX) {
+        RunWide(input, image_size, output, options, result);
+        return;
+    }
+
+    // more than the budget could ever hold at once, only one tile goes to the device at a time
+    if (budget_ && arena_.Footprint(image_size, options.bin_size, options.in_place) > budget_->Capacity()) {
+        RunTiled(input, image_size, output, options, result, TilePixels(options), host_histogram);
+        return;
+    }
+
+    // Carve buffers out of the arena, nothing is allocated unless this image is the largest yet
+    ArenaUse use(*this);
+    arena_.Reserve(image_size, options.bin_size, options.in_place);
+    cl::Buffer buffer_image_input = arena_.Input();
+    cl::Buffer buffer_image_output = arena_.Output();
+
+    // Copy image to device memory
+    queue_.enqueueWriteBuffer(buffer_image_input, CL_TRUE, 0, image_size, input, NULL, &result.upload_event);
+
+    EnqueuePipeline(buffer_image_input, buffer_image_output, input, image_size, options, result, host_histogram);
+
+    queue_.enqueueReadBuffer(buffer_image_output, CL_TRUE, 0, image_size, output, NULL, &result.download_event);
+
+    // Make sure all operations are finished
+    queue_.finish();
+}
+
+void Equalizer::RunBuffers(const cl::Buffer& input, const cl::Buffer& output, const unsigned char* host_input,
+    size_t image_size, const EqualizeOptions& options, EqualizeResult& result) {
+    if (options.wide || image_size >= INT_MAX)
+        throw std::runtime_error("RunBuffers is limited to images of fewer than INT_MAX pixels");
+
+    // only the tables come from the arena
+    ArenaUse use(*this);
+    arena_.Reserve(0, options.bin_size);
+    EnqueuePipeline(input, output, host_input, image_size, options, result, nullptr);
+    queue_.finish();
+}
+
+void Equalizer::RunTiled(const unsigned char* input, size_t image_size, unsigned char* output,
+    const EqualizeOptions& options, EqualizeResult& result, size_t tile_pixels, const int* host_histogram) {
+    typedef int vec_type;
+
+    int binSize = options.bin_size;
+    tile_pixels = std::min(std::max<size_t>(tile_pixels, 1), image_size);
+    size_t histogram_size = binSize * sizeof(vec_type);
+
+    // the last tile is shorter, so the program is not specialised on the tile size
+    EqualizeOptions tile_options = options;
+    tile_options.specialise = false;
+    cl::Program program = ProgramFor(tile_options, tile_pixels);
+
+    ArenaUse use(*this);
+    arena_.Reserve(tile_pixels, binSize, options.in_place, sizeof(vec_type));
+    cl::Buffer buffer_tile_input = arena_.Input();
+    cl::Buffer buffer_tile_output = arena_.Output();
+    cl::Buffer buffer_histo_output = arena_.Histogram();
+    cl::Buffer buffer_cum_histo_output = arena_.CumHistogram();
+    cl::Buffer buffer_lookup_output = arena_.Lookup();
+
+    result.histogram.assign(binSize, 0);
+    result.cum_histogram.assign(binSize, 0);
+    result.lookup.assign(binSize, 0);
+    result.upload_event = cl::Event();
+    result.download_event = cl::Event();
+
+    // ------- HISTOGRAM KERNEL -------
+    // every tile adds into the same histogram, the in-order queue keeps the next upload behind the kernel
+    if (host_histogram) {
+        queue_.enqueueWriteBuffer(buffer_histo_output, CL_FALSE, 0, histogram_size, host_histogram);
+        std::copy(host_histogram, host_histogram + binSize, result.histogram.begin());
+        result.histogram_event = cl::Event();
+        result.histogram_samples = image_size;
+        result.lut_deviation_bound = 0;
+    }
+    else {
+        result.histogram_variant = (options.approx_stride > 1) ? HIST_LOCAL : PlanHistogram(tile_options, input, tile_pixels);
+        result.histogram_samples = 0;
+
+        for (size_t offset = 0; offset < image_size; offset += tile_pixels) {
+            size_t length = std::min(tile_pixels, image_size - offset);
+            queue_.enqueueWriteBuffer(buffer_tile_input, CL_FALSE, 0, length, input + offset);
+
+            if (options.approx_stride > 1) {
+                EnqueueSampledHistogram(program, buffer_tile_input, buffer_histo_output, length, binSize,
+                    options.approx_stride, &result.histogram_event);
+                result.histogram_samples += (length + options.approx_stride - 1) / options.approx_stride;
+            }
+            else {
+                EnqueueHistogram(program, result.histogram_variant, buffer_tile_input, buffer_histo_output, length,
+                    binSize, options.pixels_per_item, &result.histogram_event);
+                result.histogram_samples += length;
+            }
+        }
+
+        result.lut_deviation_bound = (options.approx_stride > 1) ? ApproxLutDeviation(result.histogram_samples) : 0;
+        queue_.enqueueReadBuffer(buffer_histo_output, CL_TRUE, 0, histogram_size, result.histogram.data());
+    }
+
+    // ------- CUMULATIVE HISTOGRAM KERNEL -------
+    result.scan_events.clear();
+    Scan(program, buffer_histo_output, buffer_cum_histo_output, binSize, options.scan, result.scan_events);
+    result.cum_histogram_event = result.scan_events.back();
+    queue_.enqueueReadBuffer(buffer_cum_histo_output, CL_TRUE, 0, histogram_size, result.cum_histogram.data());
+
+    // ------- LOOKUP TABLE KERNEL -------
+    EnqueueLookup(program, buffer_cum_histo_output, buffer_lookup_output, binSize, options.byte_lut, &result.lookup_event);
+
+    if (options.byte_lut) {
+        std::vector<cl_uchar> lookup_uchar(binSize);
+        queue_.enqueueReadBuffer(buffer_lookup_output, CL_TRUE, 0, binSize * sizeof(cl_uchar), lookup_uchar.data());
+        std::copy(lookup_uchar.begin(), lookup_uchar.end(), result.lookup.begin());
+    }
+    else {
+        queue_.enqueueReadBuffer(buffer_lookup_output, CL_TRUE, 0, histogram_size, result.lookup.data());
+    }
+
+    // ------- IMAGE OUTPUT KERNEL -------
+    // each tile is uploaded again, a tile's result is read back before the next tile overwrites it
+    for (size_t offset = 0; offset < image_size; offset += tile_pixels) {
+        size_t length = std::min(tile_pixels, image_size - offset);
+        queue_.enqueueWriteBuffer(buffer_tile_input, CL_FALSE, 0, length, input + offset);
+        EnqueueApply(program, buffer_tile_input, buffer_lookup_output, buffer_tile_output, length, binSize,
+            options.byte_lut, options.pixels_per_item, &result.createimg_event);
+        queue_.enqueueReadBuffer(buffer_tile_output, CL_FALSE, 0, length, output + offset);
+    }
+
+    // the arena expects its current histogram zeroed for the next run
+    queue_.enqueueFillBuffer(buffer_histo_output, 0, 0, histogram_size);
+    queue_.finish();
+}
+
+void Equalizer::EnqueuePipeline(const cl::Buffer& buffer_image_input, const cl::Buffer& buffer_image_output,
+    const unsigned char* input, size_t image_size, const EqualizeOptions& options, EqualizeResult& result,
+    const int* host_histogram) {
+    typedef int vec_type;
+
+    int binSize = options.bin_size;
+    cl::Program program = ProgramFor(options, image_size);
+
+    result.histogram.assign(binSize, 0);
+    size_t histogram_size = result.histogram.size() * sizeof(vec_type);
+
+    result.cum_histogram.assign(binSize, 0);
+    size_t cum_histogram_size = result.cum_histogram.size() * sizeof(vec_type);
+
+    result.lookup.assign(binSize, 0);
+    size_t lookup_size = result.lookup.size() * (options.byte_lut ? sizeof(cl_uchar) : sizeof(vec_type));
+
+    cl::Buffer buffer_histo_output = arena_.Histogram();
+    cl::Buffer buffer_cum_histo_output = arena_.CumHistogram();
+    cl::Buffer buffer_lookup_output = arena_.Lookup();
+
+    // ------- HISTOGRAM KERNEL -------
+    if (host_histogram) {
+        // computed while the image was read, only upload it. it goes into the spare histogram
+        // so the zeroed one is still waiting for the next image
+        buffer_histo_output = arena_.NextHistogram();
+        queue_.enqueueWriteBuffer(buffer_histo_output, CL_FALSE, 0, histogram_size, host_histogram);
+        std::copy(host_histogram, host_histogram + binSize, result.histogram.begin());
+        result.histogram_event = cl::Event();
+        result.histogram_samples = image_size;
+        result.lut_deviation_bound = 0;
+    }
+    else if (options.approx_stride > 1) {
+        // the histogram is already zero, the kernel clears the other one for the next image
+        EnqueueSampledHistogram(program, buffer_image_input, buffer_histo_output, image_size, binSize,
+            options.approx_stride, &result.histogram_event, &arena_.NextHistogram());
+        arena_.Swap();
+        result.histogram_samples = (image_size + options.approx_stride - 1) / options.approx_stride;
+        result.lut_deviation_bound = ApproxLutDeviation(result.histogram_samples);
+    }
+    else {
+        result.histogram_variant = PlanHistogram(options, input, image_size);
+        EnqueueHistogram(program, result.histogram_variant, buffer_image_input, buffer_histo_output,
+            image_size, binSize, options.pixels_per_item, &result.histogram_event, &arena_.NextHistogram());
+        arena_.Swap();
+        result.histogram_samples = image_size;
+        result.lut_deviation_bound = 0;
+    }
+
+    if (!host_histogram) {
+        result.histogram_event.wait(); // wait for kernel to finish
+        queue_.enqueueReadBuffer(buffer_histo_output, CL_TRUE, 0, histogram_size, result.histogram.data());
+    }
+
+    // ------- CUMULATIVE HISTOGRAM KERNEL -------
+    // both scans write every bin, so the region needs no clearing
+    result.scan_events.clear();
+    Scan(program, buffer_histo_output, buffer_cum_histo_output, binSize, options.scan, result.scan_events);
+    result.cum_histogram_event = result.scan_events.back();
+    result.cum_histogram_event.wait();
+    queue_.enqueueReadBuffer(buffer_cum_histo_output, CL_TRUE, 0, cum_histogram_size, result.cum_histogram.data());
+
+    // ------- LOOKUP TABLE KERNEL -------
+    EnqueueLookup(program, buffer_cum_histo_output, buffer_lookup_output, binSize, options.byte_lut, &result.lookup_event);
+    result.lookup_event.wait();
+
+    if (options.byte_lut) {
+        std::vector<cl_uchar> lookup_uchar(binSize);
+        queue_.enqueueReadBuffer(buffer_lookup_output, CL_TRUE, 0, lookup_size, lookup_uchar.data());
+        std::copy(lookup_uchar.begin(), lookup_uchar.end(), result.lookup.begin());
+    }
+    else {
+        queue_.enqueueReadBuffer(buffer_lookup_output, CL_TRUE, 0, lookup_size, result.lookup.data());
+    }
+
+    // ------- IMAGE OUTPUT KERNEL -------
+    EnqueueApply(program, buffer_image_input, buffer_lookup_output, buffer_image_output, image_size, binSize,
+        options.byte_lut, options.pixels_per_item, &result.createimg_event);
+    result.createimg_event.wait();
+}
+
+void Equalizer::RunWide(const unsigned char* input, size_t image_size, unsigned char* output,
+    const EqualizeOptions& options, EqualizeResult& result) {
+    int binSize = options.bin_size;
+    cl::Program program = ProgramFor(options, image_size);
+    size_t histogram_size = binSize * sizeof(cl_ulong);
+
+    result.histogram.clear();
+    result.cum_histogram.clear();
+    result.wide_histogram.assign(binSize, 0);
+    result.wide_cum_histogram.assign(binSize, 0);
+    result.lookup.assign(binSize, 0);
+    result.histogram_variant = HIST_LOCAL;
+    result.histogram_samples = image_size;
+    result.lut_deviation_bound = 0;
+
+    ArenaUse use(*this);
+    arena_.Reserve(image_size, binSize, options.in_place, sizeof(cl_ulong));
+    cl::Buffer buffer_image_input = arena_.Input();
+    cl::Buffer buffer_histo_output = arena_.Histogram();
+    cl::Buffer buffer_cum_histo_output = arena_.CumHistogram();
+    cl::Buffer buffer_lookup_output = arena_.Lookup();
+    cl::Buffer buffer_image_output = arena_.Output();
+
+    // enough groups to fill the device, and enough that no group counts 2^31 pixels into its 32-bit bins
+    size_t groups = std::max<size_t>(compute_units_ * 8, (image_size >> 31) + 1);
+    cl::NDRange global_size(groups * local_size_);
+    cl::NDRange local_size(local_size_);
+
+    queue_.enqueueWriteBuffer(buffer_image_input, CL_TRUE, 0, image_size, input, NULL, &result.upload_event);
+
+    // ------- HISTOGRAM KERNEL -------
+    if (int64_atomics_) {
+        cl::Kernel histogramKernel = programs_.Kernel(program, "histogram_wide");
+        histogramKernel.setArg(0, buffer_image_input);
+        histogramKernel.setArg(1, buffer_histo_output);
+        histogramKernel.setArg(2, cl::Local(binSize * sizeof(cl_uint)));
+        histogramKernel.setArg(3, static_cast<cl_ulong>(image_size));
+        histogramKernel.setArg(4, binSize);
+        queue_.enqueueNDRangeKernel(histogramKernel, cl::NullRange, global_size, local_size, NULL, &result.histogram_event);
+
+        // the ulong kernel does not clear the spare histogram itself
+        queue_.enqueueFillBuffer(arena_.NextHistogram(), (cl_ulong)0, 0, histogram_size);
+        arena_.Swap();
+
+        queue_.enqueueReadBuffer(buffer_histo_output, CL_TRUE, 0, histogram_size, result.wide_histogram.data());
+    }
+    else {
+        cl::Buffer buffer_partials(context_, CL_MEM_WRITE_ONLY, groups * binSize * sizeof(cl_uint));
+
+        cl::Kernel histogramKernel = programs_.Kernel(program, "histogram_wide_partials");
+        histogramKernel.setArg(0, buffer_image_input);
+        histogramKernel.setArg(1, buffer_partials);
+        histogramKernel.setArg(2, cl::Local(binSize * sizeof(cl_uint)));
+        histogramKernel.setArg(3, static_cast<cl_ulong>(image_size));
+        histogramKernel.setArg(4, binSize);
+        queue_.enqueueNDRangeKernel(histogramKernel, cl::NullRange, global_size, local_size, NULL, &result.histogram_event);
+
+        std::vector<cl_uint> partials(groups * binSize);
+        queue_.enqueueReadBuffer(buffer_partials, CL_TRUE, 0, partials.size() * sizeof(cl_uint), partials.data());
+        for (size_t group = 0; group < groups; group++)
+            for (int i = 0; i < binSize; i++)
+                result.wide_histogram[i] += partials[group * binSize + i];
+
+        // merged on the host, uploaded into the spare histogram so the zeroed one waits for the next image
+        buffer_histo_output = arena_.NextHistogram();
+        queue_.enqueueWriteBuffer(buffer_histo_output, CL_FALSE, 0, histogram_size, result.wide_histogram.data());
+    }
+
+    // ------- CUMULATIVE HISTOGRAM KERNEL -------
+    cl::Kernel cum_histogramKernel = programs_.Kernel(program, "cumulative_histo_wide");
+    cum_histogramKernel.setArg(0, buffer_histo_output);
+    cum_histogramKernel.setArg(1, buffer_cum_histo_output);
+    cum_histogramKernel.setArg(2, binSize);
+
+    result.scan_events.assign(1, cl::Event());
+    queue_.enqueueNDRangeKernel(cum_histogramKernel, cl::NullRange, cl::NDRange(1), cl::NullRange, NULL, &result.scan_events.back());
+    result.cum_histogram_event = result.scan_events.back();
+    queue_.enqueueReadBuffer(buffer_cum_histo_output, CL_TRUE, 0, histogram_size, result.wide_cum_histogram.data());
+
+    // ------- LOOKUP TABLE KERNEL -------
+    cl::Kernel lookupKernel = programs_.Kernel(program, "lookuptable_wide");
+    lookupKernel.setArg(0, buffer_cum_histo_output);
+    lookupKernel.setArg(1, buffer_lookup_output);
+    lookupKernel.setArg(2, binSize);
+    queue_.enqueueNDRangeKernel(lookupKernel, cl::NullRange, cl::NDRange(binSize), cl::NullRange, NULL, &result.lookup_event);
+
+    std::vector<cl_uchar> lookup_uchar(binSize);
+    queue_.enqueueReadBuffer(buffer_lookup_output, CL_TRUE, 0, binSize, lookup_uchar.data());
+    std::copy(lookup_uchar.begin(), lookup_uchar.end(), result.lookup.begin());
+
+    // ------- IMAGE OUTPUT KERNEL -------
+    cl::Kernel createimgKernel = programs_.Kernel(program, "createimg_wide");
+    createimgKernel.setArg(0, buffer_image_input);
+    createimgKernel.setArg(1, buffer_lookup_output);
+    createimgKernel.setArg(2, buffer_image_output);
+    createimgKernel.setArg(3, cl::Local(binSize * sizeof(cl_uchar)));
+    createimgKernel.setArg(4, static_cast<cl_ulong>(image_size));
+    createimgKernel.setArg(5, binSize);
+    queue_.enqueueNDRangeKernel(createimgKernel, cl::NullRange, global_size, local_size, NULL, &result.createimg_event);
+
+    queue_.enqueueReadBuffer(buffer_image_output, CL_TRUE, 0, image_size, output, NULL, &result.download_event);
+    queue_.finish();
+}
+
+// ------- ASYNCHRONOUS RUNS -------
+
+// Everything one EqualizeAsync run needs until its final read completes
+struct Equalizer::AsyncRequest {
+    Equalizer* owner;
+    std::unique_ptr<DeviceArena> arena;
+    AsyncResult result;
+    std::promise<AsyncResult> promise;
+};
+
+Equalizer::~Equalizer() {
+    WaitAsync();
+    if (budget_)
+        budget_->RemoveReclaimer(reclaimer_);
+}
+
+std::unique_ptr<DeviceArena> Equalizer::AcquireArena() {
+    std::lock_guard<std::mutex> lock(async_mutex_);
+    in_flight_++;
+
+    if (idle_arenas_.empty()) {
+        std::unique_ptr<DeviceArena> arena(new DeviceArena(context_, device_, queue_));
+        arena->SetBudget(budget_);
+        return arena;
+    }
+
+    std::unique_ptr<DeviceArena> arena = std::move(idle_arenas_.back());
+    idle_arenas_.pop_back();
+    return arena;
+}
+
+void Equalizer::ReleaseArena(std::unique_ptr<DeviceArena> arena) {
+    // refunded to the budget while the run still counts as in flight, once in_flight_ drops
+    // ~Equalizer may return and the budget go out of scope
+    if (arena && budget_ && budget_->QueueDepth() > 0)
+        arena.reset();
+
+    std::lock_guard<std::mutex> lock(async_mutex_);
+    if (arena)
+        idle_arenas_.push_back(std::move(arena));
+    in_flight_--;
+    async_done_.notify_all();
+}
+
+void Equalizer::TrimIdleArenas() {
+    std::vector<std::unique_ptr<DeviceArena>> idle;
+    {
+        std::lock_guard<std::mutex> lock(async_mutex_);
+        idle.swap(idle_arenas_);
+    }
+}
+
+Equalizer::ArenaUse::ArenaUse(Equalizer& owner) : owner_(owner) {
+    std::lock_guard<std::mutex> lock(owner_.async_mutex_);
+    owner_.arena_users_++;
+}
+
+Equalizer::ArenaUse::~ArenaUse() {
+    std::lock_guard<std::mutex> lock(owner_.async_mutex_);
+    // kept warm for the next run unless someone needs the memory now
+    if (--owner_.arena_users_ == 0 && owner_.budget_ && owner_.budget_->QueueDepth() > 0)
+        owner_.arena_.Free();
+}
+
+void Equalizer::Reclaim() {
+    TrimIdleArenas();
+
+    std::lock_guard<std::mutex> lock(async_mutex_);
+    if (arena_users_ == 0)
+        arena_.Free();
+}
+
+void Equalizer::SetMemoryBudget(MemoryBudget* budget) {
+    if (budget_)
+        budget_->RemoveReclaimer(reclaimer_);
+
+    budget_ = budget;
+    arena_.SetBudget(budget);
+
+    // pooled arenas were never charged
+    TrimIdleArenas();
+
+    // requests from anywhere on the budget may need the memory this Equalizer holds idle
+    if (budget_)
+        reclaimer_ = budget_->AddReclaimer([this]() { Reclaim(); });
+}
+
+size_t Equalizer::TilePixels(const EqualizeOptions& options) const {
+    // without a budget one tile covers anything Run takes
+    if (!budget_)
+        return INT_MAX - 1;
+
+    size_t half = budget_->Capacity() / 2;
+    size_t tables = arena_.Footprint(0, options.bin_size);
+    if (half <= tables + arena_.Alignment())
+        throw std::runtime_error("Device memory budget of " + std::to_string(half * 2) + " bytes cannot hold the tables of one run");
+
+    size_t per_pixel = options.in_place ? 1 : 2;
+    size_t tile = (half - tables) / per_pixel;
+    return std::max(tile / arena_.Alignment() * arena_.Alignment(), arena_.Alignment());
+}
+
+void Equalizer::WaitAsync() {
+    queue_.flush();
+
+    std::unique_lock<std::mutex> lock(async_mutex_);
+    async_done_.wait(lock, [this]() { return in_flight_ == 0; });
+}
+
+void CL_CALLBACK Equalizer::AsyncComplete(cl_event, cl_int status, void* user_data) {
+    std::unique_ptr<AsyncRequest> request(static_cast<AsyncRequest*>(user_data));
+
+    // the owner may be destroyed as soon as its last arena is back, so it is not touched after this
+    request->owner->ReleaseArena(std::move(request->arena));
+
+    if (status < 0)
+        request->promise.set_exception(std::make_exception_ptr(
+            std::runtime_error(std::string("Asynchronous equalisation failed: ") + getErrorString(status))));
+    else
+        request->promise.set_value(std::move(request->result));
+}
+
+std::future<AsyncResult> Equalizer::EqualizeAsync(const ImageView& image, const EqualizeOptions& options) {
+    if (options.wide || image.size >= INT_MAX)
+        throw std::runtime_error("EqualizeAsync is limited to images of fewer than INT_MAX pixels");
+
+    int binSize = options.bin_size;
+    cl::Program program = ProgramFor(options, image.size);
+    HistogramVariant variant = (options.approx_stride > 1) ? HIST_LOCAL : PlanHistogram(options, image.data, image.size);
+
+    std::unique_ptr<AsyncRequest> request(new AsyncRequest());
+    request->owner = this;
+    request->arena = AcquireArena();
+    request->result.histogram.resize(binSize);
+    request->result.output.resize(image.size);
+
+    std::future<AsyncResult> future = request->promise.get_future();
+
+    try {
+        DeviceArena& arena = *request->arena;
+        // may wait for memory, runs already in flight release theirs from their callbacks
+        arena.Reserve(image.size, binSize, options.in_place);
+        cl::Buffer histogram = arena.Histogram();
+
+        // no waits between stages, the in-order queue sequences them
+        queue_.enqueueWriteBuffer(arena.Input(), CL_FALSE, 0, image.size, image.data);
+
+        if (options.approx_stride > 1)
+            EnqueueSampledHistogram(program, arena.Input(), histogram, image.size, binSize, options.approx_stride, NULL, &arena.NextHistogram());
+        else
+            EnqueueHistogram(program, variant, arena.Input(), histogram, image.size, binSize, options.pixels_per_item, NULL, &arena.NextHistogram());
+        arena.Swap();
+
+        queue_.enqueueReadBuffer(histogram, CL_FALSE, 0, binSize * sizeof(int), request->result.histogram.data());
+
+        std::vector<cl::Event> scan_events;
+        Scan(program, histogram, arena.CumHistogram(), binSize, options.scan, scan_events);
+        EnqueueLookup(program, arena.CumHistogram(), arena.Lookup(), binSize, options.byte_lut, NULL);
+        EnqueueApply(program, arena.Input(), arena.Lookup(), arena.Output(), image.size, binSize,
+            options.byte_lut, options.pixels_per_item, NULL);
+
+        cl::Event read_event;
+        queue_.enqueueReadBuffer(arena.Output(), CL_FALSE, 0, image.size, request->result.output.data(), NULL, &read_event);
+
+        read_event.setCallback(CL_COMPLETE, AsyncComplete, request.get());
+        request.release();
+    }
+    catch (...) {
+        // commands already queued keep their buffers alive, the arena itself is dropped
+        ReleaseArena(nullptr);
+        throw;
+    }
+
+    // make sure the commands reach the device, nothing else may flush the queue for a while
+    queue_.flush();
+    return future;
+}
+
+// ------- COROUTINE RUNS -------
+
+Task<AsyncResult> Equalizer::EqualizeTask(ImageView image, EqualizeOptions options, CoroutineExecutor& executor) {
+    if (options.wide || image.size >= INT_MAX)
+        throw std::runtime_error("EqualizeTask is limited to images of fewer than INT_MAX pixels");
+
+    int binSize = options.bin_size;
+    cl::Program program = ProgramFor(options, image.size);
+    HistogramVariant variant = (options.approx_stride > 1) ? HIST_LOCAL : PlanHistogram(options, image.data, image.size);
+
+    AsyncResult result;
+    result.histogram.resize(binSize);
+    result.output.resize(image.size);
+
+    std::unique_ptr<DeviceArena> arena = AcquireArena();
+
+    try {
+        // the executor thread must not block, the memory may be held by a suspended task, so a
+        // new buffer is charged by suspending until a release makes room
+        size_t needed = arena->Footprint(image.size, binSize, options.in_place);
+        bool charged = false;
+        if (budget_ && needed > arena->Capacity()) {
+            arena->Free();
+            co_await AcquireBudget(*budget_, needed, executor);
+            charged = true;
+        }
+        arena->Reserve(image.size, binSize, options.in_place, sizeof(int), charged);
+        cl::Buffer histogram = arena->Histogram();
+
+        co_await EnqueueWrite(queue_, arena->Input(), image.size, image.data, executor);
+
+        // ------- HISTOGRAM KERNEL -------
+        cl::Event histogram_event;
+        if (options.approx_stride > 1)
+            EnqueueSampledHistogram(program, arena->Input(), histogram, image.size, binSize, options.approx_stride,
+                &histogram_event, &arena->NextHistogram());
+        else
+            EnqueueHistogram(program, variant, arena->Input(), histogram, image.size, binSize, options.pixels_per_item,
+                &histogram_event, &arena->NextHistogram());
+        arena->Swap();
+        co_await Await(histogram_event, executor);
+
+        co_await EnqueueRead(queue_, histogram, binSize * sizeof(int), result.histogram.data(), executor);
+
+        // ------- CUMULATIVE HISTOGRAM KERNEL -------
+        std::vector<cl::Event> scan_events;
+        Scan(program, histogram, arena->CumHistogram(), binSize, options.scan, scan_events);
+        co_await Await(scan_events.back(), executor);
+
+        // ------- LOOKUP TABLE KERNEL -------
+        cl::Event lookup_event;
+        EnqueueLookup(program, arena->CumHistogram(), arena->Lookup(), binSize, options.byte_lut, &lookup_event);
+        co_await Await(lookup_event, executor);
+
+        // ------- IMAGE OUTPUT KERNEL -------
+        cl::Event createimg_event;
+        EnqueueApply(program, arena->Input(), arena->Lookup(), arena->Output(), image.size, binSize,
+            options.byte_lut, options.pixels_per_item, &createimg_event);
+        co_await Await(createimg_event, executor);
+
+        co_await EnqueueRead(queue_, arena->Output(), image.size, result.output.data(), executor);
+    }
+    catch (...) {
+        // a failed stage may leave commands queued on its buffers, the arena is dropped
+        ReleaseArena(nullptr);
+        throw;
+    }
+
+    ReleaseArena(std::move(arena));
+    co_return result;
+}
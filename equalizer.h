@@ -0,0 +1,278 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "cl_coroutine.h"
+#include "device_arena.h"
+#include "histogram_planner.h"
+#include "memory_budget.h"
+#include "program_cache.h"
+
+// How the cumulative histogram is computed
+enum ScanMode {
+    SCAN_AUTO,          // sequential for small histograms, multi-block once bins exceed one work group
+    SCAN_SEQUENTIAL,    // single work item cumulative_histo
+    SCAN_BLOCK          // reduce-then-scan across work groups
+};
+
+// Options controlling how an image is equalised on the device
+struct EqualizeOptions {
+    int bin_size = 256;         // 256 bins for 8-bit images
+    bool byte_lut = false;      // compact uchar LUT staged in local memory
+    bool specialise = false;    // bake bin count and image size into the program
+    int pixels_per_item = 1;    // pixels processed by each histogram/createimg work item
+    ScanMode scan = SCAN_AUTO;
+    HistogramVariant histogram = HIST_AUTO;
+    int approx_stride = 1;      // >1 builds the histogram from every approx_stride-th pixel
+    bool in_place = false;      // createimg overwrites the input, one image sized device buffer instead of two
+    bool wide = false;          // 64-bit indices and counters, always used from INT_MAX pixels up
+};
+
+// Intermediate results and profiling events of one pipeline run
+struct EqualizeResult {
+    std::vector<int> histogram;
+    std::vector<int> cum_histogram;
+    std::vector<int> lookup;
+    std::vector<cl_ulong> wide_histogram;       // filled instead of histogram and cum_histogram by 64-bit runs
+    std::vector<cl_ulong> wide_cum_histogram;
+
+    HistogramVariant histogram_variant = HIST_GLOBAL;   // strategy actually used
+    size_t histogram_samples = 0;                       // pixels read by the histogram pass
+    double lut_deviation_bound = 0;                     // estimated max LUT error of an approximate histogram
+    cl::Event histogram_event;
+    cl::Event cum_histogram_event;     // last kernel of the scan
+    std::vector<cl::Event> scan_events; // every kernel of the scan, in order
+    cl::Event lookup_event;
+    cl::Event createimg_event;
+    cl::Event upload_event;     // image transfers of Run and RunWide, empty for other paths
+    cl::Event download_event;
+};
+
+// A borrowed 8-bit image, size is the number of pixels (width * height * depth * spectrum)
+struct ImageView {
+    const unsigned char* data;
+    size_t size;
+};
+
+// Profiling events of one batched run, each stage is a single launch for the whole batch
+struct BatchResult {
+    cl::Event histogram_event;
+    cl::Event cum_histogram_event;
+    cl::Event lookup_event;
+    cl::Event createimg_event;
+    cl::Event upload_event;     // the packed images
+    cl::Event download_event;
+
+    size_t images = 0;
+    size_t pixels = 0;
+};
+
+// Output of one EqualizeAsync call
+struct AsyncResult {
+    std::vector<int> histogram;
+    std::vector<unsigned char> output;
+};
+
+// Called with the equalised preview as soon as it is back on the host
+typedef std::function<void(const unsigned char* preview, int width, int height)> PreviewCallback;
+
+// Runs histogram -> cumulative_histo -> lookuptable -> createimg for 8-bit images on one device
+class Equalizer {
+public:
+    Equalizer(const cl::Context& context, const cl::CommandQueue& queue, ProgramCache& programs);
+
+    // waits for any asynchronous runs still in flight
+    ~Equalizer();
+
+    // host_histogram, when given, is used in place of the histogram pass and
+    // result.histogram_event is left empty. output may be input, the image is uploaded before it is written.
+    // images of INT_MAX pixels or more, or options.wide, go through RunWide
+    void Run(const unsigned char* input, size_t image_size, unsigned char* output,
+        const EqualizeOptions& options, EqualizeResult& result, const int* host_histogram = nullptr);
+
+    // Run in two passes over tiles of tile_pixels, so only one tile is on the device at a time: the
+    // first pass uploads every tile and adds it to one histogram, the second uploads it again and applies
+    // the LUT. Run uses it for images whose buffers would exceed the memory budget
+    void RunTiled(const unsigned char* input, size_t image_size, unsigned char* output, const EqualizeOptions& options,
+        EqualizeResult& result, size_t tile_pixels, const int* host_histogram = nullptr);
+
+    // Share budget with every arena of this Equalizer, before the first run. a run whose memory
+    // does not fit waits until other runs, of any Equalizer on the budget, release theirs. images
+    // too large for the whole budget are tiled by Run, the paths that cannot tile them throw
+    void SetMemoryBudget(MemoryBudget* budget);
+    MemoryBudget* Budget() const { return budget_; }
+
+    // largest tile RunTiled can use within half the budget
+    size_t TilePixels(const EqualizeOptions& options) const;
+
+    // Run on caller owned device buffers, e.g. CL_MEM_USE_HOST_PTR wrappers of shared memory, without
+    // copying the image in or out. host_input is the same pixels as seen by the host, read by the
+    // histogram planner. output may be input
+    void RunBuffers(const cl::Buffer& input, const cl::Buffer& output, const unsigned char* host_input,
+        size_t image_size, const EqualizeOptions& options, EqualizeResult& result);
+
+    // Run with ulong indices, 64-bit bins and a byte LUT, for images past 2^31 pixels. group totals are
+    // merged with 64-bit atomics when the device has cl_khr_int64_base_atomics, on the host otherwise
+    void RunWide(const unsigned char* input, size_t image_size, unsigned char* output,
+        const EqualizeOptions& options, EqualizeResult& result);
+
+    // enqueue the whole pipeline without blocking and return at once. the future is completed from
+    // the event callback of the final read, each run in flight has its own arena from a pool.
+    // image.data must stay valid until the future is ready. enqueue errors throw here, device errors
+    // are stored in the future. images of INT_MAX pixels or more are not supported
+    std::future<AsyncResult> EqualizeAsync(const ImageView& image, const EqualizeOptions& options);
+
+    // the same pipeline as EqualizeAsync written as a coroutine, each stage is enqueued once the one
+    // before it has completed and the task resumes on executor. it has its own arena from the pool,
+    // a task whose memory does not fit the budget is suspended until it does, and it must run to
+    // completion before the Equalizer is destroyed
+    Task<AsyncResult> EqualizeTask(ImageView image, EqualizeOptions options, CoroutineExecutor& executor);
+
+    // block until every EqualizeAsync run has completed
+    void WaitAsync();
+
+    // cl_khr_int64_base_atomics is available
+    bool Int64Atomics() const { return int64_atomics_; }
+
+    const cl::Context& Context() const { return context_; }
+    const cl::CommandQueue& Queue() const { return queue_; }
+    const cl::Device& Device() const { return device_; }
+    ProgramCache& Programs() { return programs_; }
+
+    // device memory Run carves its buffers from
+    DeviceArena& Arena() { return arena_; }
+
+    // work group size used for the pixel kernels
+    size_t LocalSize() const { return local_size_; }
+
+    // equalise a factor times smaller copy first and hand it to on_preview while the
+    // full resolution chain, already queued behind it, runs with the exact LUT.
+    // planes is depth * spectrum, only the profiling events of the full resolution run are filled in
+    void RunProgressive(const unsigned char* input, int width, int height, int planes, unsigned char* output,
+        int factor, const PreviewCallback& on_preview, const EqualizeOptions& options, EqualizeResult& result);
+
+    // equalise many images with one launch per stage, outputs[i] receives images[i].size pixels.
+    // the total pixel count of a batch must fit in an int. the buffers come from the arena and
+    // approx_stride and in_place apply as in Run; the LUT is always bytes and the histogram the
+    // batched kernel, which give the same result as byte_lut and histogram would. a batch larger
+    // than the whole budget is split, down to single images that Run tiles
+    void RunBatch(const std::vector<ImageView>& images, const std::vector<unsigned char*>& outputs,
+        const EqualizeOptions& options, BatchResult& result);
+
+    // enqueue one of the histogram kernels over image_size pixels of input, H must be zeroed.
+    // next_histogram, when given, is zeroed by the same launch for the following image
+    void EnqueueHistogram(cl::Program& program, HistogramVariant variant, const cl::Buffer& input,
+        const cl::Buffer& histogram, size_t image_size, int binSize, int pixels_per_item, cl::Event* event,
+        const cl::Buffer* next_histogram = nullptr);
+
+    // enqueue lookuptable (int LUT) or lookuptable_uchar (byte LUT)
+    void EnqueueLookup(cl::Program& program, const cl::Buffer& cum_histogram, const cl::Buffer& lookup,
+        int binSize, bool byte_lut, cl::Event* event);
+
+    // enqueue createimg or, for a byte LUT, createimg_local
+    void EnqueueApply(cl::Program& program, const cl::Buffer& input, const cl::Buffer& lookup, const cl::Buffer& output,
+        size_t image_size, int binSize, bool byte_lut, int pixels_per_item, cl::Event* event);
+
+    // enqueue histogram_sampled, reading every stride-th pixel, H must be zeroed
+    void EnqueueSampledHistogram(cl::Program& program, const cl::Buffer& input, const cl::Buffer& histogram,
+        size_t image_size, int binSize, int stride, cl::Event* event, const cl::Buffer* next_histogram = nullptr);
+
+    // the strategy options.histogram resolves to for this image, logs planner decisions
+    HistogramVariant PlanHistogram(const EqualizeOptions& options, const unsigned char* input, size_t image_size);
+
+    HistogramPlanner& Planner() { return planner_; }
+
+    // enqueue the inclusive scan of binSize ints from histogram into cum_histogram,
+    // appending one event per kernel launched
+    void Scan(cl::Program& program, const cl::Buffer& histogram, const cl::Buffer& cum_histogram,
+        int binSize, ScanMode mode, std::vector<cl::Event>& events);
+
+    // the program specialised for options and image_size
+    cl::Program ProgramFor(const EqualizeOptions& options, size_t image_size);
+
+private:
+    struct AsyncRequest;
+
+    // completes an EqualizeAsync future, user_data is its AsyncRequest
+    static void CL_CALLBACK AsyncComplete(cl_event event, cl_int status, void* user_data);
+
+    // idle arena from the pool, or a new one
+    std::unique_ptr<DeviceArena> AcquireArena();
+    // back to the pool once its run has completed, freed instead while others wait for memory
+    void ReleaseArena(std::unique_ptr<DeviceArena> arena);
+
+    // free the pooled arenas, their memory goes back to the budget
+    void TrimIdleArenas();
+
+    // Marks arena_ in use by a synchronous run for its lifetime. the last one out frees it
+    // when other requests are waiting for memory
+    class ArenaUse {
+    public:
+        explicit ArenaUse(Equalizer& owner);
+        ~ArenaUse();
+
+    private:
+        Equalizer& owner_;
+    };
+
+    // the budget's reclaimer: frees the pooled arenas, and arena_ unless a run is using it
+    void Reclaim();
+
+    // histogram, scan, lookup and apply from input to output, the tables come from the arena
+    void EnqueuePipeline(const cl::Buffer& input, const cl::Buffer& output, const unsigned char* host_input,
+        size_t image_size, const EqualizeOptions& options, EqualizeResult& result, const int* host_histogram);
+
+    cl::Context context_;
+    cl::CommandQueue queue_;
+    cl::Device device_;
+    ProgramCache& programs_;
+    DeviceArena arena_;
+    MemoryBudget* budget_ = nullptr;
+    size_t local_size_;
+    cl_uint compute_units_;
+    bool int64_atomics_;
+    HistogramPlanner planner_;
+    cl::Buffer block_sums_;
+    size_t block_sums_count_ = 0;
+    cl::Buffer batch_offsets_;
+    size_t batch_offsets_count_ = 0;
+
+    // asynchronous runs, the callbacks come from a runtime thread
+    std::mutex async_mutex_;
+    std::condition_variable async_done_;
+    std::vector<std::unique_ptr<DeviceArena>> idle_arenas_;
+    size_t in_flight_ = 0;
+    size_t arena_users_ = 0;    // ArenaUse scopes open, guarded by async_mutex_
+    int reclaimer_ = -1;
+};
+
+// round n up to a multiple of m
+inline size_t RoundUp(size_t n, size_t m) {
+    return ((n + m - 1) / m) * m;
+}
+
+// Estimated bound on the LUT error, in grey levels, of a histogram built from n samples.
+// by the Dvoretzky-Kiefer-Wolfowitz inequality the sampled CDF is within
+// sqrt(ln(2 / alpha) / 2n) of the true one with probability 1 - alpha
+double ApproxLutDeviation(size_t samples, double confidence = 0.95);
+
+// device time from the start of the first event to the end of the last one [ns]
+inline cl_ulong EventSpan(const cl::Event& first, const cl::Event& last) {
+    return last.getProfilingInfo<CL_PROFILING_COMMAND_END>() - first.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+}
+
+// device time of a run from its upload, or first kernel, to its download, or last kernel [s]. -1 without events
+inline double DeviceSeconds(const EqualizeResult& result) {
+    const cl::Event& first = result.upload_event() ? result.upload_event
+        : result.histogram_event() ? result.histogram_event
+        : !result.scan_events.empty() ? result.scan_events.front() : result.createimg_event;
+    const cl::Event& last = result.download_event() ? result.download_event : result.createimg_event;
+    if (!first() || !last())
+        return -1;
+    return EventSpan(first, last) * 1e-9;
+}
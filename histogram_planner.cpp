@@ -0,0 +1,89 @@
+#include "histogram_planner.h"
+
+#include <cmath>
+#include <fstream>
+#include <vector>
+
+const char* HistogramVariantName(HistogramVariant variant) {
+    switch (variant) {
+    case HIST_AUTO: return "auto";
+    case HIST_GLOBAL: return "global";
+    case HIST_LOCAL: return "local";
+    case HIST_REPLICATED: return "replicated";
+    default: return "unknown";
+    }
+}
+
+HistogramVariant ParseHistogramVariant(const std::string& name) {
+    if (name == "global") return HIST_GLOBAL;
+    if (name == "local") return HIST_LOCAL;
+    if (name == "replicated") return HIST_REPLICATED;
+    return HIST_AUTO;
+}
+
+HistogramProbe ProbeHistogram(const unsigned char* data, size_t size, size_t max_samples) {
+    HistogramProbe probe;
+    if (size == 0 || max_samples == 0)
+        return probe;
+
+    // odd strides avoid sampling the same column of every row on power of two widths
+    size_t stride = size / max_samples;
+    if (stride > 1 && stride % 2 == 0)
+        stride++;
+    if (stride == 0)
+        stride = 1;
+
+    std::vector<size_t> counts(256, 0);
+    for (size_t i = 0; i < size; i += stride) {
+        counts[data[i]]++;
+        probe.samples++;
+    }
+
+    size_t max_count = 0;
+    for (size_t count : counts) {
+        if (count == 0)
+            continue;
+
+        double p = (double)count / probe.samples;
+        probe.entropy -= p * std::log2(p);
+        if (count > max_count)
+            max_count = count;
+    }
+    probe.max_bin_fraction = (double)max_count / probe.samples;
+
+    return probe;
+}
+
+HistogramVariant HistogramPlanner::Choose(const HistogramProbe& probe) const {
+    if (probe.max_bin_fraction >= thresholds_.replicate_above_max_fraction)
+        return HIST_REPLICATED;
+    if (probe.entropy >= thresholds_.global_above_entropy)
+        return HIST_GLOBAL;
+    return HIST_LOCAL;
+}
+
+bool HistogramPlanner::Load(const std::string& file_name) {
+    std::ifstream file(file_name);
+    if (!file)
+        return false;
+
+    std::string key;
+    double value;
+    while (file >> key >> value) {
+        if (key == "replicate_above_max_fraction") thresholds_.replicate_above_max_fraction = value;
+        else if (key == "global_above_entropy") thresholds_.global_above_entropy = value;
+    }
+
+    return true;
+}
+
+bool HistogramPlanner::Save(const std::string& file_name) const {
+    std::ofstream file(file_name);
+    if (!file)
+        return false;
+
+    file << "replicate_above_max_fraction " << thresholds_.replicate_above_max_fraction << std::endl;
+    file << "global_above_entropy " << thresholds_.global_above_entropy << std::endl;
+
+    return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+
+// private copies per work group in histogram_replicated, HIST_REPLICAS in assessment_kernels.cl
+const int histogram_replicas = 8;
+
+// Histogram kernel strategies
+enum HistogramVariant {
+    HIST_AUTO,          // let the planner decide per image
+    HIST_GLOBAL,        // histogram, one global atomic per pixel
+    HIST_LOCAL,         // histogram_local, work group private histogram
+    HIST_REPLICATED     // histogram_replicated, several private copies per work group
+};
+
+const char* HistogramVariantName(HistogramVariant variant);
+HistogramVariant ParseHistogramVariant(const std::string& name);
+
+// Cheap statistics from a strided sample of the pixels
+struct HistogramProbe {
+    size_t samples = 0;
+    double entropy = 0;             // bits, 0 (constant image) to 8 (uniform)
+    double max_bin_fraction = 0;    // share of samples in the most common value
+};
+
+// sample at most max_samples pixels evenly across the image
+HistogramProbe ProbeHistogram(const unsigned char* data, size_t size, size_t max_samples = 4096);
+
+// Decision rule: replicated when one value dominates, global atomics when values are spread
+// widely enough that contention is low, the local private histogram otherwise
+struct PlannerThresholds {
+    double replicate_above_max_fraction = 0.2;
+    double global_above_entropy = 8.5;      // above the 8-bit maximum, never pick global by default
+};
+
+class HistogramPlanner {
+public:
+    // load thresholds written by -bench hist, keeps the defaults if the file is missing
+    bool Load(const std::string& file_name);
+    bool Save(const std::string& file_name) const;
+
+    HistogramVariant Choose(const HistogramProbe& probe) const;
+
+    PlannerThresholds& Thresholds() { return thresholds_; }
+    const PlannerThresholds& Thresholds() const { return thresholds_; }
+
+private:
+    PlannerThresholds thresholds_;
+};
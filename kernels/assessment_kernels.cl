@@ -1,11 +1,143 @@
-kernel void histogram(global const uchar* A, global int* H, const int size) { // histogram kernel, tutorial 3 used as base
+// Compile-time specialisation. The host can rebuild this file with -D BIN_SIZE=n, -D IMAGE_SIZE=n
+// and -D PIXELS_PER_ITEM=n so loop bounds become constants; without them the runtime arguments are used
+#ifdef BIN_SIZE
+#define BINS BIN_SIZE
+#else
+#define BINS binSize
+#endif
+
+#ifdef IMAGE_SIZE
+#define PIXELS IMAGE_SIZE
+#else
+#define PIXELS size
+#endif
+
+#ifndef PIXELS_PER_ITEM
+#define PIXELS_PER_ITEM 1
+#endif
+
+// The histogram kernels also clear H_next, the histogram the next image will count into, so the
+// host never has to fill one before a launch. H_next may be NULL when the caller zeroes H itself
+void zero_next_histogram(global int* H_next, const int binSize) {
+	if (!H_next)
+		return;
+
+	for (int i = get_global_id(0); i < BINS; i += get_global_size(0))
+		H_next[i] = 0;
+}
+
+kernel void histogram(global const uchar* A, global int* H, const int size, global int* H_next, const int binSize) { // histogram kernel, tutorial 3 used as base
 	int id = get_global_id(0);
+	int G = get_global_size(0);
 
-	if (id < size) {
-		//assumes that H has been initialised to 0
-		int bin_index = A[id];//take value as a bin index
+	zero_next_histogram(H_next, binSize);
 
-		atomic_inc(&H[bin_index]);//serial operation, not very efficient!
+	// each work item handles PIXELS_PER_ITEM pixels, strided by the global size to keep reads coalesced
+	for (int k = 0; k < PIXELS_PER_ITEM; k++) {
+		int idx = id + k * G;
+
+		if (idx < PIXELS) {
+			//assumes that H has been initialised to 0
+			int bin_index = A[idx];//take value as a bin index
+
+			atomic_inc(&H[bin_index]);//serial operation, not very efficient!
+		}
+	}
+}
+
+// number of private sub-histograms per work group in histogram_replicated
+#ifndef HIST_REPLICAS
+#define HIST_REPLICAS 8
+#endif
+
+// work group private histogram in local memory, merged into H with one atomic per non-empty bin
+// cuts global atomic traffic when the image has many distinct values
+kernel void histogram_local(global const uchar* A, global int* H, local int* LH, const int size, const int binSize, global int* H_next) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	int G = get_global_size(0);
+
+	zero_next_histogram(H_next, binSize);
+
+	for (int i = lid; i < BINS; i += N)
+		LH[i] = 0;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int k = 0; k < PIXELS_PER_ITEM; k++) {
+		int idx = id + k * G;
+
+		if (idx < PIXELS)
+			atomic_inc(&LH[A[idx]]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < BINS; i += N) {
+		if (LH[i] > 0)
+			atomic_add(&H[i], LH[i]);
+	}
+}
+
+// as histogram_local but with HIST_REPLICAS interleaved copies of the local histogram,
+// neighbouring work items update different copies so skewed images do not serialise on one bin
+kernel void histogram_replicated(global const uchar* A, global int* H, local int* LH, const int size, const int binSize, global int* H_next) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	int G = get_global_size(0);
+	local int* copy = LH + (lid % HIST_REPLICAS) * BINS;
+
+	zero_next_histogram(H_next, binSize);
+
+	for (int i = lid; i < BINS * HIST_REPLICAS; i += N)
+		LH[i] = 0;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int k = 0; k < PIXELS_PER_ITEM; k++) {
+		int idx = id + k * G;
+
+		if (idx < PIXELS)
+			atomic_inc(&copy[A[idx]]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < BINS; i += N) {
+		int sum = 0;
+		for (int r = 0; r < HIST_REPLICAS; r++)
+			sum += LH[r * BINS + i];
+
+		if (sum > 0)
+			atomic_add(&H[i], sum);
+	}
+}
+
+// approximate histogram from every stride-th pixel, one sample per work item.
+// counts are scaled by stride when merged so the totals still match the image size
+kernel void histogram_sampled(global const uchar* A, global int* H, local int* LH, const int size, const int stride, const int binSize, global int* H_next) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	long idx = (long)id * stride;
+
+	zero_next_histogram(H_next, binSize);
+
+	for (int i = lid; i < BINS; i += N)
+		LH[i] = 0;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (idx < PIXELS)
+		atomic_inc(&LH[A[idx]]);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < BINS; i += N) {
+		if (LH[i] > 0)
+			atomic_add(&H[i], LH[i] * stride);
 	}
 }
 
@@ -16,20 +148,115 @@ kernel void cumulative_histo(global const int* A, global int* cH, const int binS
 	if (id == 0) {
 		cH[0] = A[0];
 		// calculate cumulative sum
-		for (int i = 1; i < binSize; i++) {
+		for (int i = 1; i < BINS; i++) {
 			cH[i] = cH[i - 1] + A[i];
 		}
 	}
 }
 
+// ------- DEVICE-WIDE SCAN -------
+// reduce-then-scan over any number of bins, used by the host instead of cumulative_histo
+// when the histogram is larger than one work group can cover:
+//   1. scan_block_reduce - each work group sums its block of bins
+//   2. scan_block_sums   - a single work group turns the block sums into exclusive offsets
+//   3. scan_block_apply  - each work group scans its block locally and adds its offset
+
+// Hillis-Steele inclusive scan of one work group's values in a, using b as the double buffer
+// returns the buffer holding the result
+local int* scan_hs_local(local int* a, local int* b) {
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	local int* tmp;
+
+	for (int stride = 1; stride < N; stride *= 2) {
+		b[lid] = (lid >= stride) ? a[lid] + a[lid - stride] : a[lid];
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		tmp = a; a = b; b = tmp;
+	}
+
+	return a;
+}
+
+kernel void scan_block_reduce(global const int* A, global int* sums, local int* scratch, const int binSize) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+
+	scratch[lid] = (id < BINS) ? A[id] : 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// tree reduction, works for any work group size
+	for (int stride = 1; stride < N; stride *= 2) {
+		if (!(lid % (stride * 2)) && ((lid + stride) < N))
+			scratch[lid] += scratch[lid + stride];
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (lid == 0)
+		sums[get_group_id(0)] = scratch[0];
+}
+
+kernel void scan_block_sums(global int* sums, local int* scratch_1, local int* scratch_2, const int blocks) {
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	int carry = 0;
+
+	// walk the block sums one work group sized chunk at a time, carrying the running total
+	for (int base = 0; base < blocks; base += N) {
+		int i = base + lid;
+		int value = (i < blocks) ? sums[i] : 0;
+
+		scratch_1[lid] = value;
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		local int* scanned = scan_hs_local(scratch_1, scratch_2);
+
+		// exclusive offset of block i
+		if (i < blocks)
+			sums[i] = carry + scanned[lid] - value;
+
+		carry += scanned[N - 1];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+}
+
+kernel void scan_block_apply(global const int* A, global int* cH, global const int* sums, local int* scratch_1, local int* scratch_2, const int binSize) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+
+	scratch_1[lid] = (id < BINS) ? A[id] : 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	local int* scanned = scan_hs_local(scratch_1, scratch_2);
+
+	if (id < BINS)
+		cH[id] = scanned[lid] + sums[get_group_id(0)];
+}
+
 kernel void lookuptable(global const int* A, global int* B, const int binSize) {
 	// create lookup value with values for each pixel
 	int id = get_global_id(0);
 
-	if (id < binSize) {
+	if (id < BINS) {
 		// avoid division by zero
-		if (A[binSize - 1] > 0) {
-			B[id] = (int)((float)A[id] * 255.0f / A[binSize - 1]);
+		if (A[BINS - 1] > 0) {
+			B[id] = (int)((float)A[id] * 255.0f / A[BINS - 1]);
+		}
+		else {
+			B[id] = 0;
+		}
+	}
+}
+
+// compact variant of lookuptable, emits one byte per bin so the whole 256 entry LUT is 256 bytes
+kernel void lookuptable_uchar(global const int* A, global uchar* B, const int binSize) {
+	int id = get_global_id(0);
+
+	if (id < BINS) {
+		if (A[BINS - 1] > 0) {
+			B[id] = (uchar)((float)A[id] * 255.0f / A[BINS - 1]);
 		}
 		else {
 			B[id] = 0;
@@ -40,12 +267,220 @@ kernel void lookuptable(global const int* A, global int* B, const int binSize) {
 
 // kernel to adjust input image with normalised histogram from lookup table
 // casts onto image to produce output image
+// nImg may be A for in place runs, every pixel is read and then written by the same work item
 
 kernel void createimg(global uchar* A, global int* lookup, global uchar* nImg, const int size) {
 	int id = get_global_id(0);
+	int G = get_global_size(0);
+
+	for (int k = 0; k < PIXELS_PER_ITEM; k++) {
+		int idx = id + k * G;
+
+		if (idx < PIXELS) {
+			// create new image with normalised histogram
+			nImg[idx] = (uchar)lookup[A[idx]];
+		}
+	}
+}
+
+// createimg using the compact uchar LUT, staged into local memory once per work group
+// so that every pixel lookup hits local memory and global traffic is only input + output
+kernel void createimg_local(global const uchar* A, global const uchar* lookup, global uchar* nImg, local uchar* lut, const int size, const int binSize) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	int G = get_global_size(0);
+
+	// cooperative copy, works for any work group size
+	for (int i = lid; i < BINS; i += N)
+		lut[i] = lookup[i];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int k = 0; k < PIXELS_PER_ITEM; k++) {
+		int idx = id + k * G;
+
+		if (idx < PIXELS) {
+			nImg[idx] = lut[A[idx]];
+		}
+	}
+}
+
+// ------- BATCHED KERNELS -------
+// many small images packed back to back into one buffer, offsets holds images + 1 entries
+// with offsets[i] the first pixel of image i and offsets[images] the total pixel count.
+// histograms, cumulative histograms and LUTs are stored image after image, BINS entries each
+
+// index of the image containing pixel id (largest i with offsets[i] <= id)
+int find_image(global const int* offsets, const int images, const int id) {
+	int lo = 0;
+	int hi = images - 1;
+
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (offsets[mid] <= id)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+// stride > 1 counts every stride-th pixel of each image, scaled by stride as in histogram_sampled
+kernel void histogram_batch(global const uchar* A, global const int* offsets, global int* H, const int images, const int binSize, const int stride) {
+	int id = get_global_id(0);
+
+	if (id < offsets[images]) {
+		int image = find_image(offsets, images, id);
+		if ((id - offsets[image]) % stride == 0)
+			atomic_add(&H[image * BINS + A[id]], stride);
+	}
+}
+
+// one work item per image
+kernel void cumulative_histo_batch(global const int* A, global int* cH, const int images, const int binSize) {
+	int image = get_global_id(0);
+
+	if (image < images) {
+		global const int* h = A + image * BINS;
+		global int* c = cH + image * BINS;
+
+		c[0] = h[0];
+		for (int i = 1; i < BINS; i++) {
+			c[i] = c[i - 1] + h[i];
+		}
+	}
+}
+
+// 2D range, bins x images
+kernel void lookuptable_batch(global const int* A, global uchar* B, const int images, const int binSize) {
+	int id = get_global_id(0);
+	int image = get_global_id(1);
+
+	if (id < BINS && image < images) {
+		global const int* c = A + image * BINS;
+		int total = c[BINS - 1];
+
+		B[image * BINS + id] = (total > 0) ? (uchar)((float)c[id] * 255.0f / total) : 0;
+	}
+}
+
+// nImg may be A for in place batches, each work item reads its pixel before writing it
+kernel void createimg_batch(global uchar* A, global const int* offsets, global const uchar* lookup, global uchar* nImg, const int images, const int binSize) {
+	int id = get_global_id(0);
 
-	if (id < size) {
-		// create new image with normalised histogram
-		nImg[id] = (uchar)lookup[A[id]];
+	if (id < offsets[images]) {
+		int image = find_image(offsets, images, id);
+		nImg[id] = lookup[image * BINS + A[id]];
 	}
-}
\ No newline at end of file
+}
+
+// ------- PROGRESSIVE PREVIEW -------
+// box filter downsample by factor, 3D range (out_width, out_height, planes) where planes is
+// depth * spectrum of the CImg layout. edge blocks average only the pixels that exist
+kernel void downsample(global const uchar* A, global uchar* B, const int width, const int height, const int factor) {
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int plane = get_global_id(2);
+	int out_width = get_global_size(0);
+	int out_height = get_global_size(1);
+
+	int x0 = x * factor;
+	int y0 = y * factor;
+	int x1 = min(x0 + factor, width);
+	int y1 = min(y0 + factor, height);
+
+	global const uchar* src = A + (long)plane * width * height;
+	uint sum = 0;
+
+	for (int j = y0; j < y1; j++)
+		for (int i = x0; i < x1; i++)
+			sum += src[j * width + i];
+
+	uint count = (uint)((x1 - x0) * (y1 - y0));
+	B[((long)plane * out_height + y) * out_width + x] = (uchar)((sum + count / 2) / count);
+}
+
+// ------- 64-BIT KERNELS -------
+// images of 2^31 pixels or more: ulong sizes and indices, grid-stride loops over a launch sized
+// by the host, and 64-bit bins. each work group counts into 32-bit local bins and the host
+// launches enough groups that none sees 2^32 pixels, so only the merge needs 64 bits
+
+#ifdef INT64_ATOMICS
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+
+// group totals merged straight into the 64-bit H, which must be zeroed
+kernel void histogram_wide(global const uchar* A, global ulong* H, local uint* LH, const ulong size, const int binSize) {
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+
+	for (int i = lid; i < BINS; i += N)
+		LH[i] = 0;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (ulong idx = get_global_id(0); idx < PIXELS; idx += get_global_size(0))
+		atomic_inc(&LH[A[idx]]);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < BINS; i += N) {
+		if (LH[i] > 0)
+			atom_add(&H[i], (ulong)LH[i]);
+	}
+}
+#endif
+
+// without 64-bit atomics every group writes its 32-bit totals to row get_group_id(0) of P
+// and the host adds the rows up
+kernel void histogram_wide_partials(global const uchar* A, global uint* P, local uint* LH, const ulong size, const int binSize) {
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+
+	for (int i = lid; i < BINS; i += N)
+		LH[i] = 0;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (ulong idx = get_global_id(0); idx < PIXELS; idx += get_global_size(0))
+		atomic_inc(&LH[A[idx]]);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	global uint* row = P + (ulong)get_group_id(0) * BINS;
+	for (int i = lid; i < BINS; i += N)
+		row[i] = LH[i];
+}
+
+kernel void cumulative_histo_wide(global const ulong* A, global ulong* cH, const int binSize) {
+	if (get_global_id(0) == 0) {
+		cH[0] = A[0];
+		for (int i = 1; i < BINS; i++) {
+			cH[i] = cH[i - 1] + A[i];
+		}
+	}
+}
+
+kernel void lookuptable_wide(global const ulong* A, global uchar* B, const int binSize) {
+	int id = get_global_id(0);
+
+	if (id < BINS) {
+		ulong total = A[BINS - 1];
+		B[id] = (total > 0) ? (uchar)((float)A[id] * 255.0f / (float)total) : 0;
+	}
+}
+
+// createimg_local with ulong indices, nImg may be A
+kernel void createimg_wide(global const uchar* A, global const uchar* lookup, global uchar* nImg, local uchar* lut, const ulong size, const int binSize) {
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+
+	for (int i = lid; i < BINS; i += N)
+		lut[i] = lookup[i];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (ulong idx = get_global_id(0); idx < PIXELS; idx += get_global_size(0))
+		nImg[idx] = lut[A[idx]];
+}
@@ -0,0 +1,111 @@
+#include "latency_histogram.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+
+namespace {
+
+const int linear_bits = 7;                          // values below 2^7 are exact
+const uint64_t linear_limit = 1 << linear_bits;
+const uint64_t half_buckets = linear_limit / 2;     // buckets per power of two above that
+
+// index of the highest set bit
+int HighestBit(uint64_t value) {
+    int bit = 0;
+    while (value >>= 1)
+        bit++;
+    return bit;
+}
+
+}
+
+LatencyHistogram::LatencyHistogram()
+    : counts_(linear_limit + (64 - linear_bits) * half_buckets, 0) {
+}
+
+size_t LatencyHistogram::Index(uint64_t value) {
+    if (value < linear_limit)
+        return (size_t)value;
+
+    // value >> shift keeps the top linear_bits - 1 bits after the leading one: 64..127
+    int shift = HighestBit(value) - (linear_bits - 1);
+    return (size_t)(linear_limit + (shift - 1) * half_buckets + ((value >> shift) - half_buckets));
+}
+
+uint64_t LatencyHistogram::HighestEquivalent(size_t index) {
+    if (index < linear_limit)
+        return index;
+
+    size_t offset = index - linear_limit;
+    int shift = (int)(offset / half_buckets) + 1;
+    uint64_t sub_bucket = offset % half_buckets + half_buckets;
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(uint64_t nanoseconds) {
+    counts_[Index(nanoseconds)]++;
+    count_++;
+    sum_ += nanoseconds;
+    max_ = std::max(max_, nanoseconds);
+}
+
+void LatencyHistogram::RecordSeconds(double seconds) {
+    Record((uint64_t)std::llround(std::max(seconds, 0.0) * 1e9));
+}
+
+uint64_t LatencyHistogram::Percentile(double percentile) const {
+    if (count_ == 0)
+        return 0;
+
+    uint64_t target = (uint64_t)std::ceil(std::min(std::max(percentile, 0.0), 100.0) / 100 * count_);
+    target = std::max<uint64_t>(target, 1);
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts_.size(); i++) {
+        seen += counts_[i];
+        if (seen >= target)
+            return std::min(HighestEquivalent(i), max_);
+    }
+    return max_;
+}
+
+std::string LatencyHistogram::Summary(const std::string& name) const {
+    std::ostringstream out;
+    out << name << ": " << count_ << " sample(s)";
+    if (count_ > 0)
+        out << ", p50 " << Percentile(50) * 1e-6 << " ms, p90 " << Percentile(90) * 1e-6 << " ms, p99 "
+            << Percentile(99) * 1e-6 << " ms, p99.9 " << Percentile(99.9) * 1e-6 << " ms, max " << max_ * 1e-6 << " ms";
+    return out.str();
+}
+
+LatencyTracker::LatencyTracker(double interval_seconds)
+    : interval_seconds_(interval_seconds), last_report_(std::chrono::steady_clock::now()) {
+}
+
+void LatencyTracker::Record(double end_to_end, double queue_wait, double device) {
+    end_to_end_.RecordSeconds(end_to_end);
+    if (queue_wait >= 0)
+        queue_wait_.RecordSeconds(queue_wait);
+    if (device >= 0)
+        device_.RecordSeconds(device);
+}
+
+void LatencyTracker::Tick() {
+    auto now = std::chrono::steady_clock::now();
+    if (interval_seconds_ <= 0 || std::chrono::duration<double>(now - last_report_).count() < interval_seconds_)
+        return;
+
+    last_report_ = now;
+    if (end_to_end_.Count() > 0)
+        std::cout << Report();
+}
+
+std::string LatencyTracker::Report() const {
+    std::ostringstream out;
+    out << end_to_end_.Summary("End to end") << std::endl;
+    out << queue_wait_.Summary("Queue wait") << std::endl;
+    out << device_.Summary("Device time") << std::endl;
+    return out.str();
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Log-linear latency histogram in the style of HdrHistogram. Values below 128 ns get a bucket each,
+// above that every power of two is split into 64 linear buckets, so a recorded value and the
+// percentiles read back are within 1/64 of each other over the whole range
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void Record(uint64_t nanoseconds);
+    void RecordSeconds(double seconds);
+
+    // value below which percentile (0-100) of the samples fall, the top of its bucket capped at
+    // the largest sample [ns], 0 when empty
+    uint64_t Percentile(double percentile) const;
+
+    uint64_t Count() const { return count_; }
+    uint64_t Max() const { return max_; }
+    double Mean() const { return count_ ? (double)sum_ / count_ : 0; }
+
+    // "<name>: n samples, p50 ... ms, p90, p99, p99.9, max"
+    std::string Summary(const std::string& name) const;
+
+private:
+    static size_t Index(uint64_t value);
+    static uint64_t HighestEquivalent(size_t index);
+
+    std::vector<uint64_t> counts_;
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t max_ = 0;
+};
+
+// Per image wall time, queue wait and device time of the batch and server modes, reported
+// every interval and on demand. Not thread safe, recorded from the loop that runs the images
+class LatencyTracker {
+public:
+    explicit LatencyTracker(double interval_seconds = 10);
+
+    // seconds, a negative queue wait or device time is left out, e.g. an image equalised on the host
+    void Record(double end_to_end, double queue_wait, double device);
+
+    // print the report once interval_seconds have passed since the last one
+    void Tick();
+
+    std::string Report() const;
+
+private:
+    LatencyHistogram end_to_end_;
+    LatencyHistogram queue_wait_;
+    LatencyHistogram device_;
+    double interval_seconds_;
+    std::chrono::steady_clock::time_point last_report_;
+};
@@ -0,0 +1,173 @@
+#include "memory_budget.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+MemoryBudget::MemoryBudget(const cl::Device& device, size_t limit, double fraction)
+    : capacity_((size_t)(device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>() * std::min(std::max(fraction, 0.0), 1.0))) {
+    if (limit > 0)
+        capacity_ = std::min(capacity_, limit);
+}
+
+MemoryBudget::MemoryBudget(size_t capacity) : capacity_(capacity) {
+}
+
+void MemoryBudget::ThrowIfTooLarge(size_t bytes) const {
+    if (bytes > capacity_)
+        throw std::runtime_error("Request for " + std::to_string(bytes) + " bytes exceeds the whole device memory budget of "
+            + std::to_string(capacity_) + " bytes");
+}
+
+bool MemoryBudget::TryAcquire(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // jumping a waiting request could starve it
+    if (!waiting_.empty() || used_ + bytes > capacity_)
+        return false;
+
+    used_ += bytes;
+    peak_ = std::max(peak_, used_);
+    admitted_++;
+    return true;
+}
+
+void MemoryBudget::Acquire(size_t bytes) {
+    ThrowIfTooLarge(bytes);
+    if (TryAcquire(bytes))
+        return;
+
+    Waiter waiter;
+    waiter.bytes = bytes;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        waiting_.push_back(&waiter);
+    }
+
+    Reclaim();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    admitted_cv_.wait(lock, [&waiter]() { return waiter.admitted; });
+}
+
+bool MemoryBudget::AcquireOrQueue(size_t bytes, std::function<void()> on_admitted) {
+    ThrowIfTooLarge(bytes);
+    if (TryAcquire(bytes))
+        return true;
+
+    Waiter* waiter = new Waiter();
+    waiter->bytes = bytes;
+    waiter->on_admitted = std::move(on_admitted);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        waiting_.push_back(waiter);
+    }
+
+    // the waiter is owned by the queue from here on, AdmitWaiting deletes it
+    Reclaim();
+    return false;
+}
+
+std::vector<std::function<void()>> MemoryBudget::AdmitWaiting() {
+    std::vector<std::function<void()>> callbacks;
+    bool woke = false;
+
+    while (!waiting_.empty() && used_ + waiting_.front()->bytes <= capacity_) {
+        Waiter* waiter = waiting_.front();
+        waiting_.pop_front();
+
+        used_ += waiter->bytes;
+        peak_ = std::max(peak_, used_);
+        delayed_++;
+
+        if (waiter->on_admitted) {
+            callbacks.push_back(std::move(waiter->on_admitted));
+            delete waiter;
+        }
+        else {
+            waiter->admitted = true;
+            woke = true;
+        }
+    }
+
+    if (woke)
+        admitted_cv_.notify_all();
+    return callbacks;
+}
+
+void MemoryBudget::Release(size_t bytes) {
+    std::vector<std::function<void()>> callbacks;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        used_ -= std::min(bytes, used_);
+        callbacks = AdmitWaiting();
+    }
+
+    for (std::function<void()>& callback : callbacks)
+        callback();
+}
+
+void MemoryBudget::Reclaim() {
+    {
+        std::lock_guard<std::mutex> lock(reclaim_mutex_);
+        for (auto& reclaimer : reclaimers_)
+            reclaimer.second();
+    }
+
+    // the request may fit without anything having been released
+    Release(0);
+}
+
+int MemoryBudget::AddReclaimer(std::function<void()> reclaim) {
+    std::lock_guard<std::mutex> lock(reclaim_mutex_);
+    int id = next_reclaimer_++;
+    reclaimers_[id] = std::move(reclaim);
+    return id;
+}
+
+void MemoryBudget::RemoveReclaimer(int id) {
+    std::lock_guard<std::mutex> lock(reclaim_mutex_);
+    reclaimers_.erase(id);
+}
+
+bool MemoryBudget::Fits(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return waiting_.empty() && used_ + bytes <= capacity_;
+}
+
+size_t MemoryBudget::Used() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return used_;
+}
+
+size_t MemoryBudget::Peak() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return peak_;
+}
+
+size_t MemoryBudget::QueueDepth() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return waiting_.size();
+}
+
+std::string MemoryBudget::Report() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::ostringstream out;
+    out << "Device memory budget: " << used_ << " of " << capacity_ << " bytes in use, peak " << peak_
+        << ", " << waiting_.size() << " request(s) waiting, " << admitted_ << " admitted at once, "
+        << delayed_ << " after waiting" << std::endl;
+    return out.str();
+}
+
+
+BudgetCharge::BudgetCharge(MemoryBudget* budget, size_t bytes) : budget_(budget), bytes_(bytes) {
+    if (budget_)
+        budget_->Acquire(bytes_);
+}
+
+BudgetCharge::~BudgetCharge() {
+    if (budget_)
+        budget_->Release(bytes_);
+}
+
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "include/Utils.h"
+
+// Device memory admission control. Every DeviceArena given the budget is charged for its backing
+// buffer before allocating it and refunded when it is freed, so concurrent pipelines share
+// a fixed amount of CL_DEVICE_GLOBAL_MEM_SIZE instead of failing with CL_MEM_OBJECT_ALLOCATION_FAILURE.
+// Requests that do not fit wait in arrival order until earlier ones release their memory
+class MemoryBudget {
+public:
+    // fraction of the device's global memory, the rest is left to the runtime and other programs.
+    // a non-zero limit in bytes lowers it further, it never raises it
+    MemoryBudget(const cl::Device& device, size_t limit = 0, double fraction = 0.8);
+
+    // a fixed number of bytes
+    explicit MemoryBudget(size_t capacity);
+
+    // take bytes without waiting, false when they do not fit now or others are already waiting
+    bool TryAcquire(size_t bytes);
+
+    // take bytes, waiting behind earlier requests until memory held elsewhere is released. idle
+    // memory is reclaimed first, so a wait only ends badly when bytes exceed the whole budget,
+    // which throws at once
+    void Acquire(size_t bytes);
+
+    // take bytes without blocking: true when they were taken at once, otherwise the request is
+    // queued like Acquire and on_admitted is called, from the thread whose Release made room,
+    // once they have been taken. throws when bytes exceed the whole budget
+    bool AcquireOrQueue(size_t bytes, std::function<void()> on_admitted);
+
+    // give back bytes taken by TryAcquire, Acquire or AcquireOrQueue
+    void Release(size_t bytes);
+
+    // bytes would fit right now
+    bool Fits(size_t bytes);
+
+    // reclaim is called, with no budget lock held, before a request is queued. it frees memory
+    // that is charged but idle, e.g. pooled arenas, so nothing waits on memory no run will give back
+    int AddReclaimer(std::function<void()> reclaim);
+    void RemoveReclaimer(int id);
+
+    size_t Capacity() const { return capacity_; }
+    size_t Used();
+    size_t Peak();
+
+    // requests waiting for memory
+    size_t QueueDepth();
+
+    // usage, peak, queue depth, and how many requests were admitted at once or had to wait
+    std::string Report();
+
+private:
+    // A queued request, admitted in arrival order once the ones ahead of it are
+    struct Waiter {
+        size_t bytes;
+        bool admitted = false;
+        std::function<void()> on_admitted;  // empty for Acquire, which waits on admitted_cv_
+    };
+
+    // run every reclaimer, then admit what now fits
+    void Reclaim();
+
+    // take memory for queued requests from the front while they fit, mutex_ held. returns the
+    // AcquireOrQueue callbacks to run once it is released
+    std::vector<std::function<void()>> AdmitWaiting();
+
+    void ThrowIfTooLarge(size_t bytes) const;
+
+    std::mutex mutex_;
+    std::condition_variable admitted_cv_;
+    std::deque<Waiter*> waiting_;
+    size_t capacity_;
+    size_t used_ = 0;
+    size_t peak_ = 0;
+    uint64_t admitted_ = 0;
+    uint64_t delayed_ = 0;
+
+    // held while reclaimers run, so one is never removed mid call
+    std::mutex reclaim_mutex_;
+    std::map<int, std::function<void()>> reclaimers_;
+    int next_reclaimer_ = 0;
+};
+
+
+// Bytes held from a budget for the lifetime of a scope, for buffers that do not come from an
+// arena. waits like MemoryBudget::Acquire, a null budget charges nothing
+class BudgetCharge {
+public:
+    BudgetCharge(MemoryBudget* budget, size_t bytes);
+    ~BudgetCharge();
+
+    BudgetCharge(const BudgetCharge&) = delete;
+    BudgetCharge& operator=(const BudgetCharge&) = delete;
+
+private:
+    MemoryBudget* budget_;
+    size_t bytes_;
+};
+
@@ -0,0 +1,341 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const char* TypeName(MetricType type) {
+    switch (type) {
+    case METRIC_COUNTER: return "counter";
+    case METRIC_GAUGE: return "gauge";
+    default: return "histogram";
+    }
+}
+
+// {a="1",b="2"}, backslash, quote and newline escaped as the format requires
+std::string RenderLabels(const MetricLabels& labels) {
+    if (labels.empty())
+        return "";
+
+    std::string out = "{";
+    for (size_t i = 0; i < labels.size(); i++) {
+        if (i > 0)
+            out += ",";
+        out += labels[i].first + "=\"";
+        for (char c : labels[i].second) {
+            if (c == '\\' || c == '"')
+                out += '\\';
+            if (c == '\n')
+                out += "\\n";
+            else
+                out += c;
+        }
+        out += "\"";
+    }
+    return out + "}";
+}
+
+// labels of a series plus the bucket bound, inserted before the closing brace
+std::string WithBound(const std::string& labels, const std::string& bound) {
+    std::string le = "le=\"" + bound + "\"";
+    if (labels.empty())
+        return "{" + le + "}";
+    return labels.substr(0, labels.size() - 1) + "," + le + "}";
+}
+
+// device time of a profiled command, -1 when there is no event
+double EventSeconds(const cl::Event& event) {
+    if (!event())
+        return -1;
+    return (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
+}
+
+void ObserveEvent(MetricsRegistry& metrics, const std::string& name, const MetricLabels& labels, const cl::Event& event) {
+    double seconds = EventSeconds(event);
+    if (seconds >= 0)
+        metrics.Observe(name, labels, seconds);
+}
+
+void DescribePipeline(MetricsRegistry& metrics) {
+    metrics.Describe("heq_images_total", METRIC_COUNTER, "Images equalised");
+    metrics.Describe("heq_bytes_total", METRIC_COUNTER, "Image bytes moved between host and device");
+    metrics.Describe("heq_kernel_seconds", METRIC_HISTOGRAM, "Device time of each pipeline kernel");
+    metrics.Describe("heq_transfer_seconds", METRIC_HISTOGRAM, "Device time of image transfers");
+    metrics.Describe("heq_errors_total", METRIC_COUNTER, "Failed requests by OpenCL error code");
+    metrics.Describe("heq_pending_requests", METRIC_GAUGE, "Socket requests queued for the next batch");
+    metrics.Describe("heq_batches_total", METRIC_COUNTER, "Server batches by what flushed them");
+    metrics.Describe("heq_batch_wait_seconds", METRIC_HISTOGRAM, "Queue wait of the oldest request of each batch");
+}
+
+}
+
+MetricsRegistry::MetricsRegistry()
+    : bounds_({ 1e-5, 5e-5, 1e-4, 5e-4, 1e-3, 5e-3, 0.01, 0.05, 0.1, 0.5, 1, 5 }) {
+    DescribePipeline(*this);
+}
+
+void MetricsRegistry::Describe(const std::string& name, MetricType type, const std::string& help) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Family& family = families_[name];
+    family.type = type;
+    family.help = help;
+}
+
+MetricsRegistry::Series& MetricsRegistry::SeriesFor(const std::string& name, MetricType type, const MetricLabels& labels) {
+    Family& family = families_[name];
+    if (family.series.empty() && family.help.empty())
+        family.type = type;
+
+    Series& series = family.series[RenderLabels(labels)];
+    if (type == METRIC_HISTOGRAM && series.buckets.empty())
+        series.buckets.assign(bounds_.size() + 1, 0);
+    return series;
+}
+
+void MetricsRegistry::Increment(const std::string& name, const MetricLabels& labels, double value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    SeriesFor(name, METRIC_COUNTER, labels).value += value;
+}
+
+void MetricsRegistry::Set(const std::string& name, const MetricLabels& labels, double value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    SeriesFor(name, METRIC_GAUGE, labels).value = value;
+}
+
+void MetricsRegistry::SetFunction(const std::string& name, const MetricLabels& labels, std::function<double()> read) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    SeriesFor(name, METRIC_GAUGE, labels).read = read;
+}
+
+void MetricsRegistry::Observe(const std::string& name, const MetricLabels& labels, double seconds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Series& series = SeriesFor(name, METRIC_HISTOGRAM, labels);
+
+    // the last bucket is +Inf
+    size_t bucket = std::lower_bound(bounds_.begin(), bounds_.end(), seconds) - bounds_.begin();
+    series.buckets[bucket]++;
+    series.sum += seconds;
+    series.count++;
+}
+
+std::string MetricsRegistry::Exposition() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::ostringstream out;
+    out.precision(9);
+
+    for (auto& entry : families_) {
+        const std::string& name = entry.first;
+        Family& family = entry.second;
+        if (family.series.empty())
+            continue;
+
+        if (!family.help.empty())
+            out << "# HELP " << name << " " << family.help << "\n";
+        out << "# TYPE " << name << " " << TypeName(family.type) << "\n";
+
+        for (auto& labelled : family.series) {
+            const std::string& labels = labelled.first;
+            Series& series = labelled.second;
+
+            if (family.type != METRIC_HISTOGRAM) {
+                out << name << labels << " " << (series.read ? series.read() : series.value) << "\n";
+                continue;
+            }
+
+            uint64_t cumulative = 0;
+            for (size_t i = 0; i < bounds_.size(); i++) {
+                cumulative += series.buckets[i];
+                std::ostringstream bound;
+                bound << bounds_[i];
+                out << name << "_bucket" << WithBound(labels, bound.str()) << " " << cumulative << "\n";
+            }
+            out << name << "_bucket" << WithBound(labels, "+Inf") << " " << series.count << "\n";
+            out << name << "_sum" << labels << " " << series.sum << "\n";
+            out << name << "_count" << labels << " " << series.count << "\n";
+        }
+    }
+
+    return out.str();
+}
+
+void RecordRun(MetricsRegistry& metrics, const std::string& path, const EqualizeResult& result, size_t image_size) {
+    metrics.Increment("heq_images_total", { { "path", path } });
+
+    ObserveEvent(metrics, "heq_kernel_seconds", { { "kernel", "histogram" } }, result.histogram_event);
+    for (const cl::Event& event : result.scan_events)
+        ObserveEvent(metrics, "heq_kernel_seconds", { { "kernel", "scan" } }, event);
+    ObserveEvent(metrics, "heq_kernel_seconds", { { "kernel", "lookup" } }, result.lookup_event);
+    ObserveEvent(metrics, "heq_kernel_seconds", { { "kernel", "createimg" } }, result.createimg_event);
+
+    // paths on caller owned buffers move no image bytes
+    if (result.upload_event()) {
+        ObserveEvent(metrics, "heq_transfer_seconds", { { "direction", "upload" } }, result.upload_event);
+        metrics.Increment("heq_bytes_total", { { "direction", "upload" } }, (double)image_size);
+    }
+    if (result.download_event()) {
+        ObserveEvent(metrics, "heq_transfer_seconds", { { "direction", "download" } }, result.download_event);
+        metrics.Increment("heq_bytes_total", { { "direction", "download" } }, (double)image_size);
+    }
+}
+
+void RecordBatch(MetricsRegistry& metrics, const std::string& path, const BatchResult& result) {
+    metrics.Increment("heq_images_total", { { "path", path } }, (double)result.images);
+
+    ObserveEvent(metrics, "heq_kernel_seconds", { { "kernel", "histogram_batch" } }, result.histogram_event);
+    ObserveEvent(metrics, "heq_kernel_seconds", { { "kernel", "cumulative_histo_batch" } }, result.cum_histogram_event);
+    ObserveEvent(metrics, "heq_kernel_seconds", { { "kernel", "lookuptable_batch" } }, result.lookup_event);
+    ObserveEvent(metrics, "heq_kernel_seconds", { { "kernel", "createimg_batch" } }, result.createimg_event);
+    ObserveEvent(metrics, "heq_transfer_seconds", { { "direction", "upload" } }, result.upload_event);
+    ObserveEvent(metrics, "heq_transfer_seconds", { { "direction", "download" } }, result.download_event);
+
+    metrics.Increment("heq_bytes_total", { { "direction", "upload" } }, (double)result.pixels);
+    metrics.Increment("heq_bytes_total", { { "direction", "download" } }, (double)result.pixels);
+}
+
+void RecordError(MetricsRegistry& metrics, const std::string& path, const std::string& code) {
+    metrics.Increment("heq_errors_total", { { "path", path }, { "code", code } });
+}
+
+#ifndef _WIN32
+bool MetricsServer::Start(const std::string& endpoint, std::string& error) {
+    if (endpoint.find('/') != std::string::npos) {
+        sockaddr_un address;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (endpoint.size() >= sizeof(address.sun_path)) {
+            error = "socket path too long: " + endpoint;
+            return false;
+        }
+        std::strcpy(address.sun_path, endpoint.c_str());
+
+        listener_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(endpoint.c_str());
+        if (listener_ < 0 || bind(listener_, (sockaddr*)&address, sizeof(address)) < 0) {
+            error = "cannot bind " + endpoint + ": " + std::strerror(errno);
+            Stop();
+            return false;
+        }
+        socket_path_ = endpoint;
+    }
+    else {
+        int port = std::atoi(endpoint.c_str());
+        if (port <= 0 || port > 65535) {
+            error = "metrics endpoint is neither a socket path nor a port: " + endpoint;
+            return false;
+        }
+
+        // local only, the endpoint has no authentication
+        sockaddr_in address;
+        std::memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons((uint16_t)port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        listener_ = socket(AF_INET, SOCK_STREAM, 0);
+        int reuse = 1;
+        if (listener_ >= 0)
+            setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (listener_ < 0 || bind(listener_, (sockaddr*)&address, sizeof(address)) < 0) {
+            error = "cannot bind 127.0.0.1:" + endpoint + ": " + std::strerror(errno);
+            Stop();
+            return false;
+        }
+    }
+
+    if (listen(listener_, 8) < 0) {
+        error = std::string("listen: ") + std::strerror(errno);
+        Stop();
+        return false;
+    }
+
+    stop_ = false;
+    thread_ = std::thread(&MetricsServer::Loop, this);
+    return true;
+}
+
+void MetricsServer::Stop() {
+    stop_ = true;
+    if (thread_.joinable())
+        thread_.join();
+
+    if (listener_ >= 0) {
+        close(listener_);
+        listener_ = -1;
+    }
+    if (!socket_path_.empty()) {
+        unlink(socket_path_.c_str());
+        socket_path_.clear();
+    }
+}
+
+void MetricsServer::Loop() {
+    // SIGINT and SIGTERM are for the serve loop, they must not land on this thread
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    while (!stop_) {
+        pollfd listener = { listener_, POLLIN, 0 };
+        if (poll(&listener, 1, 100) <= 0)
+            continue;
+
+        int fd = accept(listener_, nullptr, nullptr);
+        if (fd < 0)
+            continue;
+
+        Answer(fd);
+        close(fd);
+    }
+}
+
+void MetricsServer::Answer(int fd) {
+    // the request line is all that matters, a scraper that stalls is dropped after a second
+    timeval timeout = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n <= 0)
+            break;
+        request.append(buffer, n);
+    }
+
+    bool found = request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 6, "GET / ") == 0;
+    std::string body = found ? metrics_.Exposition() : "not found, try /metrics\n";
+
+    std::ostringstream response;
+    response << "HTTP/1.0 " << (found ? "200 OK" : "404 Not Found") << "\r\n"
+        << "Content-Type: text/plain; version=0.0.4\r\n"
+        << "Content-Length: " << body.size() << "\r\n\r\n" << body;
+
+    std::string text = response.str();
+    const char* p = text.data();
+    size_t size = text.size();
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+        p += n;
+        size -= n;
+    }
+}
+#endif
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "equalizer.h"
+
+typedef std::vector<std::pair<std::string, std::string>> MetricLabels;
+
+enum MetricType {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM
+};
+
+// Counters, gauges and latency histograms rendered in the Prometheus text exposition format.
+// Thread safe, a series is created the first time a name and label set is used
+class MetricsRegistry {
+public:
+    MetricsRegistry();
+
+    // HELP text and type of a metric family, before or after its first use
+    void Describe(const std::string& name, MetricType type, const std::string& help);
+
+    void Increment(const std::string& name, const MetricLabels& labels = {}, double value = 1);
+    void Set(const std::string& name, const MetricLabels& labels, double value);
+
+    // gauge read at scrape time, e.g. the memory budget in use
+    void SetFunction(const std::string& name, const MetricLabels& labels, std::function<double()> read);
+
+    // one latency sample in seconds
+    void Observe(const std::string& name, const MetricLabels& labels, double seconds);
+
+    // every family in the text format, version 0.0.4
+    std::string Exposition();
+
+private:
+    struct Series {
+        double value = 0;
+        std::function<double()> read;
+        std::vector<uint64_t> buckets;  // per bucket, made cumulative when rendered
+        double sum = 0;
+        uint64_t count = 0;
+    };
+
+    struct Family {
+        MetricType type = METRIC_COUNTER;
+        std::string help;
+        std::map<std::string, Series> series;   // keyed by the rendered label set
+    };
+
+    Series& SeriesFor(const std::string& name, MetricType type, const MetricLabels& labels);
+
+    std::mutex mutex_;
+    std::map<std::string, Family> families_;
+    std::vector<double> bounds_;    // histogram bucket upper bounds [s]
+};
+
+// Pipeline metrics from the profiling events of one run: kernel and transfer times, images and bytes moved
+void RecordRun(MetricsRegistry& metrics, const std::string& path, const EqualizeResult& result, size_t image_size);
+void RecordBatch(MetricsRegistry& metrics, const std::string& path, const BatchResult& result);
+
+// heq_errors_total by getErrorString code, "host" for exceptions that are not cl::Error
+void RecordError(MetricsRegistry& metrics, const std::string& path, const std::string& code);
+
+#ifndef _WIN32
+// Answers GET /metrics with the registry over HTTP/1.0 from a background thread. endpoint is
+// a Unix socket path (anything with a '/') or a TCP port on 127.0.0.1
+class MetricsServer {
+public:
+    explicit MetricsServer(MetricsRegistry& metrics) : metrics_(metrics) {}
+    ~MetricsServer() { Stop(); }
+
+    // bind and start serving, false with a reason in error when the endpoint cannot be set up
+    bool Start(const std::string& endpoint, std::string& error);
+    void Stop();
+
+private:
+    void Loop();
+    void Answer(int fd);
+
+    MetricsRegistry& metrics_;
+    std::string socket_path_;
+    int listener_ = -1;
+    std::atomic<bool> stop_{ false };
+    std::thread thread_;
+};
+#endif
@@ -0,0 +1,86 @@
+#include "pgm_stream.h"
+
+#include <algorithm>
+#include <cctype>
+
+#include "cpu_backend.h"
+
+namespace {
+
+// bytes read and histogrammed at a time, small enough to still be in L2 for the histogram
+const size_t chunk_size = 256 * 1024;
+
+// next whitespace separated header integer, skipping # comments
+bool ReadHeaderValue(FILE* file, int& value) {
+    int c = fgetc(file);
+
+    while (c != EOF) {
+        if (c == '#') {
+            while (c != EOF && c != '\n')
+                c = fgetc(file);
+        }
+        else if (!isspace(c)) {
+            break;
+        }
+        c = fgetc(file);
+    }
+
+    if (c == EOF || !isdigit(c))
+        return false;
+
+    value = 0;
+    while (c != EOF && isdigit(c)) {
+        value = value * 10 + (c - '0');
+        c = fgetc(file);
+    }
+
+    // exactly one whitespace character follows the last header value, which c has consumed
+    return true;
+}
+
+}
+
+bool PGMReader::Open(const std::string& file_name, std::string& error) {
+    file_.reset(fopen(file_name.c_str(), "rb"));
+    if (!file_) {
+        error = "could not open file";
+        return false;
+    }
+
+    char magic[2];
+    if (fread(magic, 1, 2, file_.get()) != 2 || magic[0] != 'P' || magic[1] != '5') {
+        error = "not a binary (P5) PGM";
+        return false;
+    }
+
+    int max_value;
+    if (!ReadHeaderValue(file_.get(), width_) || !ReadHeaderValue(file_.get(), height_)
+        || !ReadHeaderValue(file_.get(), max_value)) {
+        error = "malformed PGM header";
+        return false;
+    }
+
+    if (max_value <= 0 || max_value > 255) {
+        error = "only 8-bit PGMs can be streamed";
+        return false;
+    }
+
+    return true;
+}
+
+bool PGMReader::ReadWithHistogram(unsigned char* pixels, int* histogram, std::string& error) {
+    size_t size = (size_t)width_ * height_;
+
+    // read straight into the image and count each chunk while it is still in cache
+    for (size_t offset = 0; offset < size; offset += chunk_size) {
+        size_t count = std::min(chunk_size, size - offset);
+        if (fread(pixels + offset, 1, count, file_.get()) != count) {
+            error = "file is shorter than its header says";
+            return false;
+        }
+
+        HostHistogram(pixels + offset, count, histogram);
+    }
+
+    return true;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdio>
+#include <memory>
+#include <string>
+
+// Streams a binary (P5) PGM with a maximum value of at most 255 into caller-owned memory,
+// adding the 256-bin histogram of the pixels chunk by chunk as they arrive from disk, so the
+// histogram costs no extra pass over the image
+class PGMReader {
+public:
+    PGMReader() : file_(nullptr, fclose) {}
+
+    // read the header, returns false with a reason in error for anything but an 8-bit P5 PGM
+    bool Open(const std::string& file_name, std::string& error);
+
+    int Width() const { return width_; }
+    int Height() const { return height_; }
+
+    // read Width() * Height() pixels into pixels and add their histogram to histogram
+    bool ReadWithHistogram(unsigned char* pixels, int* histogram, std::string& error);
+
+private:
+    std::unique_ptr<FILE, int (*)(FILE*)> file_;
+    int width_ = 0;
+    int height_ = 0;
+};
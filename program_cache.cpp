@@ -0,0 +1,80 @@
+#include "program_cache.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+std::string KernelConfig::BuildOptions() const {
+    std::stringstream options;
+
+    if (bin_size > 0)
+        options << " -D BIN_SIZE=" << bin_size;
+    if (image_size > 0)
+        options << " -D IMAGE_SIZE=" << image_size;
+    if (pixels_per_item > 1)
+        options << " -D PIXELS_PER_ITEM=" << pixels_per_item;
+    if (!extra_options.empty())
+        options << " " << extra_options;
+
+    return options.str();
+}
+
+ProgramCache::ProgramCache(const cl::Context& context, const std::string& file_name, size_t capacity)
+    : context_(context), capacity_(std::max<size_t>(capacity, 1)) {
+    std::ifstream file(file_name);
+    if (!file)
+        throw std::runtime_error("Could not open kernel file " + file_name);
+
+    source_.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+cl::Program ProgramCache::Get(const KernelConfig& config) {
+    std::string options = config.BuildOptions();
+
+    auto it = index_.find(options);
+    if (it != index_.end()) {
+        hits_++;
+        programs_.splice(programs_.begin(), programs_, it->second);
+        return it->second->program;
+    }
+
+    misses_++;
+    cl::Program program(context_, source_);
+    cl::Device device = context_.getInfo<CL_CONTEXT_DEVICES>()[0];
+
+    // Build and debug the kernel code, throw errors if any
+    try {
+        program.build(options.c_str());
+    }
+    catch (const cl::Error& err) {
+        std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device) << std::endl;
+        std::cout << "Build Options: " << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(device) << std::endl;
+        std::cout << "Build Log: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+        throw err;
+    }
+
+    programs_.push_front(Entry{ options, program, {} });
+    index_[options] = programs_.begin();
+    handles_[program()] = programs_.begin();
+
+    if (programs_.size() > capacity_) {
+        index_.erase(programs_.back().options);
+        handles_.erase(programs_.back().program());
+        programs_.pop_back();
+        evictions_++;
+    }
+    return program;
+}
+
+cl::Kernel ProgramCache::Kernel(const cl::Program& program, const std::string& name) {
+    // an evicted program still works, its kernels are just not kept
+    auto it = handles_.find(program());
+    if (it == handles_.end())
+        return cl::Kernel(program, name.c_str());
+
+    std::map<std::string, cl::Kernel>& kernels = it->second->kernels;
+    auto kernel = kernels.find(name);
+    if (kernel == kernels.end())
+        kernel = kernels.emplace(name, cl::Kernel(program, name.c_str())).first;
+    return kernel->second;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <list>
+#include <map>
+#include <string>
+
+#include "include/Utils.h"
+
+// Compile-time parameters baked into assessment_kernels.cl through -D build options.
+// A value of 0 leaves the corresponding runtime kernel argument in charge.
+struct KernelConfig {
+    int bin_size = 0;
+    int image_size = 0;
+    int pixels_per_item = 1;
+    std::string extra_options;
+
+    std::string BuildOptions() const;
+};
+
+// Builds the kernel file once per distinct set of build options and keeps the capacity most
+// recently used programs in memory. specialising on the image size makes a new program for every
+// size a server sees, so the least recently used one is dropped once capacity are cached
+class ProgramCache {
+public:
+    ProgramCache(const cl::Context& context, const std::string& file_name, size_t capacity = 32);
+
+    // return the program specialised for config, building it on first use. a copy shares the
+    // program, so one that is evicted stays valid for as long as the caller holds it
+    cl::Program Get(const KernelConfig& config);
+
+    // kernel name of a program Get returned, created on first use and kept while the program is
+    // cached. arguments are captured when a kernel is enqueued, so callers only set them again.
+    // like Get, not thread safe
+    cl::Kernel Kernel(const cl::Program& program, const std::string& name);
+
+    size_t Hits() const { return hits_; }
+    size_t Misses() const { return misses_; }
+    size_t Evictions() const { return evictions_; }
+
+private:
+    // A built program and the kernels created from it so far
+    struct Entry {
+        std::string options;
+        cl::Program program;
+        std::map<std::string, cl::Kernel> kernels;
+    };
+    typedef std::list<Entry> ProgramList;
+
+    cl::Context context_;
+    std::string source_;
+    size_t capacity_;
+    ProgramList programs_;      // most recently used first
+    std::map<std::string, ProgramList::iterator> index_;
+    std::map<cl_program, ProgramList::iterator> handles_;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+    size_t evictions_ = 0;
+};
@@ -0,0 +1,180 @@
+#include "router.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+#include "cpu_backend.h"
+#include "thread_pool.h"
+
+const char* RouteName(Route route) {
+    return route == ROUTE_HOST ? "host" : "device";
+}
+
+namespace {
+
+// shortest wall time of several runs of body [s], the first run also warms up caches and builds
+template <typename Body>
+double BestOf(int repeats, Body body) {
+    double best = 0;
+    for (int r = 0; r < repeats; r++) {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (r == 0 || seconds < best)
+            best = seconds;
+    }
+    return best;
+}
+
+// a spread of grey levels, so neither path gets an unusually cheap histogram
+std::vector<unsigned char> CalibrationImage(size_t size) {
+    std::mt19937 rng(11);
+    std::normal_distribution<double> normal(128.0, 40.0);
+    std::vector<unsigned char> pixels(size);
+    for (unsigned char& p : pixels)
+        p = (unsigned char)std::min(255.0, std::max(0.0, normal(rng)));
+    return pixels;
+}
+
+}
+
+void Router::Calibrate(Equalizer& equalizer, ThreadPool& pool, size_t max_pixels) {
+    const size_t small_pixels = 4096;
+    max_pixels = std::max(max_pixels, small_pixels * 2);
+
+    std::vector<unsigned char> image = CalibrationImage(max_pixels);
+    std::vector<unsigned char> output(max_pixels);
+    const cl::CommandQueue& queue = equalizer.Queue();
+
+    // ------- BANDWIDTH -------
+    cl::Buffer buffer(equalizer.Context(), CL_MEM_READ_WRITE, max_pixels);
+    double upload = BestOf(3, [&]() { queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, max_pixels, image.data()); });
+    double download = BestOf(3, [&]() { queue.enqueueReadBuffer(buffer, CL_TRUE, 0, max_pixels, output.data()); });
+    profile_.upload_bytes_per_second = max_pixels / upload;
+    profile_.download_bytes_per_second = max_pixels / download;
+    double transfer_per_pixel = 1.0 / profile_.upload_bytes_per_second + 1.0 / profile_.download_bytes_per_second;
+
+    // ------- DEVICE PIPELINE -------
+    // a fixed strategy keeps the planner quiet, the slope between the two sizes is the per pixel cost
+    EqualizeOptions options;
+    options.histogram = HIST_LOCAL;
+    EqualizeResult result;
+
+    double device_small = BestOf(5, [&]() { equalizer.Run(image.data(), small_pixels, output.data(), options, result); });
+    double device_large = BestOf(3, [&]() { equalizer.Run(image.data(), max_pixels, output.data(), options, result); });
+
+    double device_slope = (device_large - device_small) / (max_pixels - small_pixels);
+    profile_.device_seconds_per_pixel = std::max(0.0, device_slope - transfer_per_pixel);
+    profile_.device_fixed_seconds = std::max(0.0, device_small - small_pixels * device_slope);
+
+    // ------- HOST BACKEND -------
+    double host_small = BestOf(5, [&]() { EqualizeCPU(image.data(), small_pixels, output.data(), &pool); });
+    double host_large = BestOf(3, [&]() { EqualizeCPU(image.data(), max_pixels, output.data(), &pool); });
+
+    profile_.host_seconds_per_pixel = std::max(0.0, (host_large - host_small) / (max_pixels - small_pixels));
+    profile_.host_fixed_seconds = std::max(0.0, host_small - small_pixels * profile_.host_seconds_per_pixel);
+
+    std::cout << "Routing calibration: upload " << profile_.upload_bytes_per_second / 1e9 << " GB/s, download "
+        << profile_.download_bytes_per_second / 1e9 << " GB/s, device " << profile_.device_fixed_seconds * 1e6 << " us + "
+        << profile_.device_seconds_per_pixel * 1e9 << " ns/pixel, host " << profile_.host_fixed_seconds * 1e6 << " us + "
+        << profile_.host_seconds_per_pixel * 1e9 << " ns/pixel";
+    if (Crossover() == (size_t)-1)
+        std::cout << ", the host always wins";
+    else
+        std::cout << ", device wins from " << Crossover() << " pixels";
+    std::cout << std::endl;
+}
+
+bool Router::Load(const std::string& file_name) {
+    std::ifstream file(file_name);
+    if (!file)
+        return false;
+
+    std::string key;
+    double value;
+    while (file >> key >> value) {
+        if (key == "upload_bytes_per_second") profile_.upload_bytes_per_second = value;
+        else if (key == "download_bytes_per_second") profile_.download_bytes_per_second = value;
+        else if (key == "device_fixed_seconds") profile_.device_fixed_seconds = value;
+        else if (key == "device_seconds_per_pixel") profile_.device_seconds_per_pixel = value;
+        else if (key == "host_fixed_seconds") profile_.host_fixed_seconds = value;
+        else if (key == "host_seconds_per_pixel") profile_.host_seconds_per_pixel = value;
+    }
+
+    return true;
+}
+
+bool Router::Save(const std::string& file_name) const {
+    std::ofstream file(file_name);
+    if (!file)
+        return false;
+
+    file << "upload_bytes_per_second " << profile_.upload_bytes_per_second << std::endl;
+    file << "download_bytes_per_second " << profile_.download_bytes_per_second << std::endl;
+    file << "device_fixed_seconds " << profile_.device_fixed_seconds << std::endl;
+    file << "device_seconds_per_pixel " << profile_.device_seconds_per_pixel << std::endl;
+    file << "host_fixed_seconds " << profile_.host_fixed_seconds << std::endl;
+    file << "host_seconds_per_pixel " << profile_.host_seconds_per_pixel << std::endl;
+
+    return true;
+}
+
+double Router::PredictHost(size_t pixels) const {
+    return profile_.host_fixed_seconds + pixels * profile_.host_seconds_per_pixel;
+}
+
+double Router::PredictDevice(size_t pixels) const {
+    return profile_.device_fixed_seconds
+        + pixels / profile_.upload_bytes_per_second
+        + pixels / profile_.download_bytes_per_second
+        + pixels * profile_.device_seconds_per_pixel;
+}
+
+size_t Router::Crossover() const {
+    double device_per_pixel = 1.0 / profile_.upload_bytes_per_second + 1.0 / profile_.download_bytes_per_second
+        + profile_.device_seconds_per_pixel;
+    double saving_per_pixel = profile_.host_seconds_per_pixel - device_per_pixel;
+
+    // the host is cheaper per pixel, the device never catches up
+    if (saving_per_pixel <= 0)
+        return (size_t)-1;
+
+    double extra_fixed = profile_.device_fixed_seconds - profile_.host_fixed_seconds;
+    if (extra_fixed <= 0)
+        return 0;
+
+    return (size_t)std::ceil(extra_fixed / saving_per_pixel);
+}
+
+Route Router::Choose(size_t pixels) const {
+    return PredictHost(pixels) <= PredictDevice(pixels) ? ROUTE_HOST : ROUTE_DEVICE;
+}
+
+void Router::Record(Route route, size_t pixels, double actual_seconds) {
+    double host = PredictHost(pixels);
+    double device = PredictDevice(pixels);
+    double predicted = route == ROUTE_HOST ? host : device;
+
+    std::cout << "Routed " << pixels << " pixels to the " << RouteName(route) << ": predicted host "
+        << host * 1000 << " ms, device " << device * 1000 << " ms; actual " << actual_seconds * 1000 << " ms" << std::endl;
+
+    routed_[route]++;
+    if (actual_seconds > 0)
+        error_sum_[route] += std::fabs(actual_seconds - predicted) / actual_seconds;
+}
+
+std::string Router::Report() const {
+    std::ostringstream report;
+    for (Route route : { ROUTE_HOST, ROUTE_DEVICE }) {
+        report << RouteName(route) << ": " << routed_[route] << " image(s)";
+        if (routed_[route] > 0)
+            report << ", mean prediction error " << error_sum_[route] / routed_[route] * 100 << "%";
+        report << std::endl;
+    }
+    return report.str();
+}
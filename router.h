@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+
+#include "equalizer.h"
+
+class ThreadPool;
+
+// Where an image is equalised
+enum Route {
+    ROUTE_HOST,     // CPU backend on the thread pool
+    ROUTE_DEVICE    // OpenCL pipeline
+};
+
+const char* RouteName(Route route);
+
+// Measured costs of the two paths, all in seconds or bytes per second
+struct CostProfile {
+    double upload_bytes_per_second = 4e9;
+    double download_bytes_per_second = 4e9;
+    double device_fixed_seconds = 200e-6;       // launches, fills and readbacks of one Run on a tiny image
+    double device_seconds_per_pixel = 0.1e-9;   // kernel time once the image is resident
+    double host_fixed_seconds = 20e-6;          // dispatching a tiny image to the pool
+    double host_seconds_per_pixel = 1e-9;
+};
+
+// Sends each image down whichever path the cost model predicts will finish first.
+// device(n) = fixed + n / upload + n / download + n * per_pixel, host(n) = fixed + n * per_pixel
+class Router {
+public:
+    // measure the profile on this device and pool with synthetic images of up to max_pixels
+    void Calibrate(Equalizer& equalizer, ThreadPool& pool, size_t max_pixels = 16 * 1024 * 1024);
+
+    // key value profile file, as written by Save
+    bool Load(const std::string& file_name);
+    bool Save(const std::string& file_name) const;
+
+    double PredictHost(size_t pixels) const;
+    double PredictDevice(size_t pixels) const;
+
+    // smallest image the device is predicted to finish first, 0 if it always wins and SIZE_MAX if it never does
+    size_t Crossover() const;
+
+    Route Choose(size_t pixels) const;
+
+    // log the prediction for a routed image against its measured wall time
+    void Record(Route route, size_t pixels, double actual_seconds);
+
+    // images per route and the mean prediction error
+    std::string Report() const;
+
+    const CostProfile& Profile() const { return profile_; }
+
+private:
+    CostProfile profile_;
+    size_t routed_[2] = { 0, 0 };
+    double error_sum_[2] = { 0, 0 };    // sum of |actual - predicted| / actual
+};
@@ -0,0 +1,275 @@
+#include "scheduler.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+
+#include <CL/cl_ext.h>
+
+// cl_khr_priority_hints is a clCreateCommandQueueWithProperties property, an OpenCL 2.0 entry point
+// the 1.2 target leaves undeclared. it is only called once the device reports 2.0 or later
+#ifndef CL_VERSION_2_0
+extern "C" CL_API_ENTRY cl_command_queue CL_API_CALL clCreateCommandQueueWithProperties(cl_context context,
+    cl_device_id device, const cl_ulong* properties, cl_int* errcode_ret);
+#endif
+
+const char* JobClassName(JobClass job_class) {
+    return job_class == JOB_INTERACTIVE ? "Interactive" : "Bulk";
+}
+
+cl::CommandQueue CreatePriorityQueue(const cl::Context& context, const cl::Device& device, QueuePriority priority, bool& hinted) {
+    hinted = false;
+
+    // "OpenCL <major>.<minor> <vendor specific>"
+    std::string version = device.getInfo<CL_DEVICE_VERSION>();
+    int major = version.size() > 7 ? std::atoi(version.c_str() + 7) : 1;
+    std::string extensions = device.getInfo<CL_DEVICE_EXTENSIONS>();
+
+    if (major >= 2 && extensions.find("cl_khr_priority_hints") != std::string::npos) {
+        cl_ulong properties[] = {
+            CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE,
+            CL_QUEUE_PRIORITY_KHR, (cl_ulong)(priority == QUEUE_PRIORITY_HIGH ? CL_QUEUE_PRIORITY_HIGH_KHR : CL_QUEUE_PRIORITY_LOW_KHR),
+            0
+        };
+
+        cl_int err = CL_SUCCESS;
+        cl_command_queue queue = clCreateCommandQueueWithProperties(context(), device(), properties, &err);
+        if (err == CL_SUCCESS) {
+            hinted = true;
+            return cl::CommandQueue(queue);
+        }
+    }
+
+    return cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE);
+}
+
+DeadlineScheduler::DeadlineScheduler(const cl::Context& context, const cl::Device& device, ProgramCache& programs,
+    const EqualizeOptions& options, size_t chunk_pixels)
+    : high_queue_(CreatePriorityQueue(context, device, QUEUE_PRIORITY_HIGH, high_hinted_)),
+      low_queue_(CreatePriorityQueue(context, device, QUEUE_PRIORITY_LOW, low_hinted_)),
+      interactive_(context, high_queue_, programs),
+      bulk_(context, low_queue_, programs),
+      options_(options),
+      bulk_options_(options),
+      chunk_pixels_(std::max<size_t>(chunk_pixels, 1)) {
+    // chunks differ in size, so the bulk program is not specialised on it
+    bulk_options_.specialise = false;
+}
+
+DeadlineScheduler::~DeadlineScheduler() {
+    if (budget_)
+        budget_->RemoveReclaimer(reclaimer_);
+}
+
+void DeadlineScheduler::SetMemoryBudget(MemoryBudget* budget) {
+    if (budget_)
+        budget_->RemoveReclaimer(reclaimer_);
+
+    budget_ = budget;
+    interactive_.SetMemoryBudget(budget);
+    bulk_.SetMemoryBudget(budget);
+
+    // jobs run on one thread, so an interactive job waiting on memory held by idle chunks would
+    // wait forever. try_to_lock, a bulk step waiting for its own charge calls this too
+    if (budget_)
+        reclaimer_ = budget_->AddReclaimer([this]() {
+            std::unique_lock<std::mutex> lock(bulk_mutex_, std::try_to_lock);
+            if (lock.owns_lock())
+                FreeChunks();
+        });
+}
+
+void DeadlineScheduler::FreeChunks() {
+    chunk_input_ = cl::Buffer();
+    chunk_output_ = cl::Buffer();
+    chunk_charge_.reset();
+}
+
+uint64_t DeadlineScheduler::Submit(JobClass job_class, const ImageView& image, unsigned char* output, double deadline_ms) {
+    if (job_class == JOB_BULK && image.size >= INT_MAX)
+        throw std::runtime_error("Bulk jobs are limited to images of fewer than INT_MAX pixels");
+
+    std::unique_ptr<Job> job(new Job());
+    job->job_class = job_class;
+    job->image = image;
+    job->output = output;
+    job->submitted = std::chrono::steady_clock::now();
+    job->deadline = job->submitted + std::chrono::microseconds((long long)(deadline_ms * 1000));
+
+    uint64_t id;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_)
+            throw std::runtime_error("Job submitted to a closed scheduler");
+        id = job->id = next_id_++;
+        jobs_.push_back(std::move(job));
+        outstanding_[job_class]++;
+    }
+    submitted_.notify_one();
+    return id;
+}
+
+void DeadlineScheduler::Close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+    }
+    submitted_.notify_one();
+}
+
+size_t DeadlineScheduler::Outstanding(JobClass job_class) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return outstanding_[job_class];
+}
+
+void DeadlineScheduler::Run() {
+    // the build would otherwise land on the first job's deadline
+    interactive_.ProgramFor(options_, 0);
+
+    for (;;) {
+        Job* job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            submitted_.wait(lock, [this]() { return closed_ || !jobs_.empty(); });
+            if (jobs_.empty())
+                return;
+
+            // earliest deadline first, interactive ahead of bulk on a tie. a started bulk job holds the
+            // bulk buffers, so other bulk jobs wait until it completes. only this thread removes jobs,
+            // so the pointer stays valid once the lock is dropped
+            job = nullptr;
+            for (const std::unique_ptr<Job>& queued : jobs_) {
+                if (queued->job_class == JOB_BULK && bulk_job_ && queued.get() != bulk_job_)
+                    continue;
+                if (!job || queued->deadline < job->deadline || (queued->deadline == job->deadline && queued->job_class < job->job_class))
+                    job = queued.get();
+            }
+        }
+
+        bool done = true;
+        try {
+            if (job->job_class == JOB_INTERACTIVE) {
+                EqualizeResult result;
+                interactive_.Run(job->image.data, job->image.size, job->output, options_, result);
+            }
+            else {
+                done = StepBulk(*job);
+            }
+        }
+        catch (const cl::Error& err) {
+            std::cerr << JobClassName(job->job_class) << " job " << job->id << " failed: " << err.what()
+                << " (" << getErrorString(err.err()) << ")" << std::endl;
+            job->failed = true;
+        }
+        catch (const std::exception& err) {
+            std::cerr << JobClassName(job->job_class) << " job " << job->id << " failed: " << err.what() << std::endl;
+            job->failed = true;
+        }
+
+        if (done)
+            Complete(*job);
+    }
+}
+
+bool DeadlineScheduler::StepBulk(Job& job) {
+    const cl::Context& context = bulk_.Context();
+    int binSize = bulk_options_.bin_size;
+    size_t size = job.image.size;
+    cl::Program program = bulk_.ProgramFor(bulk_options_, 0);
+    std::lock_guard<std::mutex> lock(bulk_mutex_);
+
+    // one chunk in and out and the tables of one job, whatever the image size. the chunks are
+    // refilled every step, so they may have been reclaimed since the last one
+    if (!chunk_input_()) {
+        chunk_charge_.reset(new BudgetCharge(budget_, 2 * chunk_pixels_));
+        chunk_input_ = cl::Buffer(context, CL_MEM_READ_ONLY, chunk_pixels_);
+        chunk_output_ = cl::Buffer(context, CL_MEM_WRITE_ONLY, chunk_pixels_);
+    }
+
+    if (!job.started) {
+        if (!histogram_()) {
+            table_charge_.reset(new BudgetCharge(budget_, 3 * binSize * sizeof(int)));
+            histogram_ = cl::Buffer(context, CL_MEM_READ_WRITE, binSize * sizeof(int));
+            cum_histogram_ = cl::Buffer(context, CL_MEM_READ_WRITE, binSize * sizeof(int));
+            lookup_ = cl::Buffer(context, CL_MEM_READ_WRITE, binSize * sizeof(int));
+        }
+        low_queue_.enqueueFillBuffer(histogram_, 0, 0, binSize * sizeof(int));
+
+        // the chunk histograms are exact and add up in one table
+        job.variant = bulk_.PlanHistogram(bulk_options_, job.image.data, std::min(chunk_pixels_, size));
+        job.started = true;
+        bulk_job_ = &job;
+    }
+
+    size_t offset = job.next_offset;
+    size_t length = std::min(chunk_pixels_, size - offset);
+    low_queue_.enqueueWriteBuffer(chunk_input_, CL_FALSE, 0, length, job.image.data + offset);
+
+    if (!job.applying) {
+        bulk_.EnqueueHistogram(program, job.variant, chunk_input_, histogram_, length, binSize, bulk_options_.pixels_per_item, NULL);
+        job.next_offset += length;
+
+        if (job.next_offset == size) {
+            std::vector<cl::Event> scan_events;
+            bulk_.Scan(program, histogram_, cum_histogram_, binSize, bulk_options_.scan, scan_events);
+            bulk_.EnqueueLookup(program, cum_histogram_, lookup_, binSize, bulk_options_.byte_lut, NULL);
+            job.applying = true;
+            job.next_offset = 0;
+        }
+
+        // one chunk in flight at a time, that bounds how long an interactive job waits for the device
+        low_queue_.finish();
+        return false;
+    }
+
+    bulk_.EnqueueApply(program, chunk_input_, lookup_, chunk_output_, length, binSize, bulk_options_.byte_lut,
+        bulk_options_.pixels_per_item, NULL);
+    low_queue_.enqueueReadBuffer(chunk_output_, CL_TRUE, 0, length, job.output + offset);
+
+    job.next_offset += length;
+    return job.next_offset == size;
+}
+
+void DeadlineScheduler::Complete(Job& job) {
+    auto now = std::chrono::steady_clock::now();
+    double latency_ms = std::chrono::duration<double, std::milli>(now - job.submitted).count();
+    double lateness_ms = std::chrono::duration<double, std::milli>(now - job.deadline).count();
+
+    DeadlineStats& stats = stats_[job.job_class];
+    stats.jobs++;
+    if (job.failed || lateness_ms > 0)
+        stats.missed++;
+    stats.total_latency_ms += latency_ms;
+    stats.max_latency_ms = std::max(stats.max_latency_ms, latency_ms);
+    stats.max_lateness_ms = std::max(stats.max_lateness_ms, lateness_ms);
+
+    if (bulk_job_ == &job)
+        bulk_job_ = nullptr;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    outstanding_[job.job_class]--;
+    jobs_.erase(std::find_if(jobs_.begin(), jobs_.end(), [&job](const std::unique_ptr<Job>& queued) { return queued.get() == &job; }));
+}
+
+std::string DeadlineScheduler::Report() const {
+    std::ostringstream out;
+    out << "Queue priorities: " << (PriorityHints() ? "cl_khr_priority_hints" : "not supported, plain queues") << std::endl;
+    out << "Bulk chunks: " << chunk_pixels_ << " pixels";
+    if (options_.specialise)
+        out << ", bulk program not specialised since chunks differ in size";
+    out << std::endl;
+
+    for (int job_class = JOB_INTERACTIVE; job_class <= JOB_BULK; job_class++) {
+        const DeadlineStats& stats = stats_[job_class];
+        if (stats.jobs == 0)
+            continue;
+
+        out << JobClassName((JobClass)job_class) << ": " << stats.jobs << " job(s), " << stats.missed << " missed ("
+            << stats.MissRate() * 100 << "%), mean latency " << stats.total_latency_ms / stats.jobs << " ms, max "
+            << stats.max_latency_ms << " ms, worst lateness " << stats.max_lateness_ms << " ms" << std::endl;
+    }
+
+    return out.str();
+}
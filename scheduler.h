@@ -0,0 +1,134 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "equalizer.h"
+
+// Interactive jobs run whole on the high priority queue, bulk jobs advance a chunk at a time on the low one
+enum JobClass {
+    JOB_INTERACTIVE,
+    JOB_BULK
+};
+
+const char* JobClassName(JobClass job_class);
+
+enum QueuePriority {
+    QUEUE_PRIORITY_HIGH,
+    QUEUE_PRIORITY_LOW
+};
+
+// a profiling queue with the given priority when the device supports cl_khr_priority_hints,
+// a plain one otherwise. hinted tells which one was made
+cl::CommandQueue CreatePriorityQueue(const cl::Context& context, const cl::Device& device, QueuePriority priority, bool& hinted);
+
+// Deadline statistics of one job class
+struct DeadlineStats {
+    uint64_t jobs = 0;
+    uint64_t missed = 0;
+    double total_latency_ms = 0;
+    double max_latency_ms = 0;
+    double max_lateness_ms = 0;     // worst finish past the deadline, 0 if every job made it
+
+    double MissRate() const { return jobs ? (double)missed / jobs : 0; }
+};
+
+// Orders equalisation jobs by deadline over a high and a low priority queue. Run works on the job
+// with the earliest deadline; a bulk job only uploads and histograms or applies one chunk before the
+// choice is made again, so an interactive job submitted meanwhile waits for at most one chunk.
+// bulk jobs share one chunk of device memory and run one after another
+class DeadlineScheduler {
+public:
+    DeadlineScheduler(const cl::Context& context, const cl::Device& device, ProgramCache& programs,
+        const EqualizeOptions& options, size_t chunk_pixels);
+    ~DeadlineScheduler();
+
+    // charge both Equalizers and the bulk buffers to budget, before Run. the chunk buffers are
+    // given back between steps when an interactive job needs their memory
+    void SetMemoryBudget(MemoryBudget* budget);
+
+    // queue a job due deadline_ms from now, output receives image.size pixels. thread safe,
+    // image.data and output must stay valid until the job completes
+    uint64_t Submit(JobClass job_class, const ImageView& image, unsigned char* output, double deadline_ms);
+
+    // no more jobs will be submitted, Run returns once the queued ones are done
+    void Close();
+
+    // run jobs until Close has been called and none are left
+    void Run();
+
+    // jobs of a class submitted but not completed
+    size_t Outstanding(JobClass job_class);
+
+    // both queues carry cl_khr_priority_hints priorities
+    bool PriorityHints() const { return high_hinted_ && low_hinted_; }
+
+    const DeadlineStats& Stats(JobClass job_class) const { return stats_[job_class]; }
+
+    // miss rate, latency and lateness per class
+    std::string Report() const;
+
+private:
+    // A queued job. a bulk job keeps its progress between steps: first every chunk is uploaded and
+    // added to the histogram, then the LUT is built and every chunk uploaded again and applied
+    struct Job {
+        uint64_t id;
+        JobClass job_class;
+        ImageView image;
+        unsigned char* output;
+        std::chrono::steady_clock::time_point submitted;
+        std::chrono::steady_clock::time_point deadline;
+        bool failed = false;
+
+        bool started = false;
+        bool applying = false;
+        size_t next_offset = 0;
+        HistogramVariant variant = HIST_GLOBAL;
+    };
+
+    // one chunk of a bulk job, true once the job is complete
+    bool StepBulk(Job& job);
+
+    // release the chunk buffers and their charge, bulk_mutex_ held
+    void FreeChunks();
+    void Complete(Job& job);
+
+    // declared before the queues, CreatePriorityQueue sets them while the queues are built
+    bool high_hinted_ = false;
+    bool low_hinted_ = false;
+    cl::CommandQueue high_queue_;
+    cl::CommandQueue low_queue_;
+    Equalizer interactive_;
+    Equalizer bulk_;
+    EqualizeOptions options_;
+    EqualizeOptions bulk_options_;      // options_ unspecialised
+    size_t chunk_pixels_;
+
+    // bulk device memory, allocated by the first bulk job and reused by the rest. the charges are
+    // declared first so they are refunded after the buffers are released
+    MemoryBudget* budget_ = nullptr;
+    int reclaimer_ = -1;
+    std::mutex bulk_mutex_;             // held by a bulk step, the reclaimer skips the chunks meanwhile
+    std::unique_ptr<BudgetCharge> chunk_charge_;
+    std::unique_ptr<BudgetCharge> table_charge_;
+    cl::Buffer chunk_input_;
+    cl::Buffer chunk_output_;
+    cl::Buffer histogram_;
+    cl::Buffer cum_histogram_;
+    cl::Buffer lookup_;
+    Job* bulk_job_ = nullptr;           // the started bulk job, owns the tables until it completes
+
+    std::mutex mutex_;
+    std::condition_variable submitted_;
+    std::vector<std::unique_ptr<Job>> jobs_;
+    size_t outstanding_[2] = { 0, 0 };
+    uint64_t next_id_ = 0;
+    bool closed_ = false;
+
+    DeadlineStats stats_[2];
+};
@@ -0,0 +1,640 @@
+#include "server.h"
+
+#ifndef _WIN32
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include "shm_ring.h"
+#endif
+
+namespace {
+
+volatile std::sig_atomic_t stop_requested = 0;
+
+void RequestStop(int) {
+    stop_requested = 1;
+}
+
+// read exactly size bytes, false on end of stream or error
+bool ReadAll(int fd, void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR && !stop_requested)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// longest the server waits for a client to drain its socket before giving up on it
+const int write_timeout_ms = 5000;
+
+// write exactly size bytes, a client that went away fails the call instead of raising SIGPIPE.
+// the server's sockets are non-blocking, a full socket buffer is waited out for write_timeout_ms
+bool WriteAll(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pollfd writable = { fd, POLLOUT, 0 };
+            int ready = poll(&writable, 1, write_timeout_ms);
+            if (ready < 0 && errno == EINTR)
+                continue;
+            if (ready <= 0)
+                return false;
+            continue;
+        }
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// width * height * planes of a header from a client, false when the product does not fit 64 bits.
+// a wrapped product could pass the size limit with dimensions that do not match the pixels
+bool ImagePixels(uint32_t width, uint32_t height, uint32_t planes, uint64_t& pixels) {
+    uint64_t area = (uint64_t)width * height;
+    if (planes > 0 && area > UINT64_MAX / planes)
+        return false;
+    pixels = area * planes;
+    return true;
+}
+
+bool SocketAddress(const std::string& socket_path, sockaddr_un& address, std::string& error) {
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        error = "socket path too long: " + socket_path;
+        return false;
+    }
+    std::strcpy(address.sun_path, socket_path.c_str());
+    return true;
+}
+
+bool SendResponse(int fd, ResponseStatus status, const RequestHeader& request, const std::string& message,
+    const unsigned char* pixels, size_t size) {
+    ResponseHeader response = { protocol_magic, status, request.width, request.height, request.planes, (uint32_t)message.size() };
+    return WriteAll(fd, &response, sizeof(response))
+        && WriteAll(fd, message.data(), message.size())
+        && (size == 0 || WriteAll(fd, pixels, size));
+}
+
+// SIGINT and SIGTERM end the serve loops, no SA_RESTART so they interrupt blocking calls
+void InstallStopHandlers() {
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = RequestStop;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+}
+
+}
+
+EqualizeServer::EqualizeServer(Equalizer& equalizer, const EqualizeOptions& options)
+    : equalizer_(equalizer), options_(options) {
+    // the largest image whose buffers fit in one device allocation, as the arena carves them
+    uint64_t max_allocation = equalizer_.Device().getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+    uint64_t tables = 4 * (uint64_t)options_.bin_size * sizeof(cl_ulong);
+    max_pixels_ = max_allocation > tables ? (max_allocation - tables) / (options_.in_place ? 1 : 2) : 0;
+}
+
+int EqualizeServer::Serve(const std::string& socket_path) {
+    sockaddr_un address;
+    std::string error;
+    if (!SocketAddress(socket_path, address, error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        std::cerr << "socket: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+
+    // a stale socket from a previous run would make bind fail
+    unlink(socket_path.c_str());
+    if (bind(listener, (sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 16) < 0) {
+        std::cerr << "Cannot listen on " << socket_path << ": " << std::strerror(errno) << std::endl;
+        close(listener);
+        return 1;
+    }
+
+    InstallStopHandlers();
+
+    // build the program before the first request rather than during it
+    equalizer_.ProgramFor(options_, 0);
+    std::cout << "Serving on " << socket_path << ", images up to " << max_pixels_ << " pixels, stop with Ctrl+C" << std::endl;
+
+    if (batching_.max_images > 1) {
+        std::cout << "Batching up to " << batching_.max_images << " request(s) or " << batching_.max_pixels
+            << " pixels, latency budget " << batching_.max_wait_ms << " ms" << std::endl;
+        // RunBatch has one kernel per stage, the rest of the options only reach images equalised alone
+        if (options_.histogram != HIST_AUTO || options_.pixels_per_item > 1 || options_.byte_lut || options_.scan != SCAN_AUTO)
+            std::cout << "Batches use the batched histogram, scan and byte LUT kernels with one pixel per work item, "
+                << "-hist, -ppi, -scan and -u only apply to requests equalised alone" << std::endl;
+    }
+
+    ServeConnections(listener);
+
+    close(listener);
+    unlink(socket_path.c_str());
+    std::cout << "Served " << requests_ << " request(s)" << std::endl;
+    if (batching_.max_images > 1)
+        ReportBatching();
+    return 0;
+}
+
+bool EqualizeServer::ReadSome(Connection& connection, bool& complete) {
+    complete = false;
+
+    while (!complete) {
+        bool in_header = connection.header_read < sizeof(RequestHeader);
+        char* target = in_header ? (char*)&connection.header + connection.header_read
+            : (char*)connection.pixels.data() + connection.pixels_read;
+        size_t remaining = in_header ? sizeof(RequestHeader) - connection.header_read
+            : connection.pixels.size() - connection.pixels_read;
+
+        ssize_t n = read(connection.fd, target, remaining);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        if (n <= 0)
+            return false;
+
+        if (!in_header) {
+            connection.pixels_read += n;
+            complete = connection.pixels_read == connection.pixels.size();
+            continue;
+        }
+
+        connection.header_read += n;
+        if (connection.header_read < sizeof(RequestHeader))
+            continue;
+
+        const RequestHeader& request = connection.header;
+        uint64_t size = 0;
+        if (request.magic != protocol_magic || !ImagePixels(request.width, request.height, request.planes, size)
+            || size == 0 || size > max_pixels_) {
+            SendResponse(connection.fd, STATUS_BAD_REQUEST, request, "bad header or image size", nullptr, 0);
+            return false;
+        }
+        connection.pixels.resize(size);
+    }
+    return true;
+}
+
+bool EqualizeServer::Answer(int fd, const RequestHeader& request, std::vector<unsigned char>& pixels,
+    std::chrono::steady_clock::time_point arrival) {
+    size_t size = pixels.size();
+
+    // in place on the host as well, the request buffer becomes the response
+    auto start = std::chrono::steady_clock::now();
+    EqualizeResult result;
+    try {
+        equalizer_.Run(pixels.data(), size, pixels.data(), options_, result);
+    }
+    catch (const cl::Error& err) {
+        std::string message = std::string(err.what()) + " (" + getErrorString(err.err()) + ")";
+        std::cerr << "Request failed: " << message << std::endl;
+        if (metrics_)
+            RecordError(*metrics_, "socket", getErrorString(err.err()));
+        return SendResponse(fd, STATUS_FAILED, request, message, nullptr, 0);
+    }
+    catch (const std::exception& err) {
+        std::cerr << "Request failed: " << err.what() << std::endl;
+        if (metrics_)
+            RecordError(*metrics_, "socket", "host");
+        return SendResponse(fd, STATUS_FAILED, request, err.what(), nullptr, 0);
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    if (metrics_)
+        RecordRun(*metrics_, "socket", result, size);
+    requests_++;
+    std::cout << "Request " << requests_ << ": " << request.width << "x" << request.height << "x" << request.planes
+        << " in " << ms << " ms" << std::endl;
+
+    bool sent = SendResponse(fd, STATUS_OK, request, "", pixels.data(), size);
+    if (latency_) {
+        auto end = std::chrono::steady_clock::now();
+        latency_->Record(std::chrono::duration<double>(end - arrival).count(),
+            std::chrono::duration<double>(start - arrival).count(), DeviceSeconds(result));
+    }
+    return sent;
+}
+
+void EqualizeServer::ServeConnections(int listener) {
+    // connections waiting for their next request, a connection with a request queued is not polled
+    // again until it has been answered, the protocol allows one outstanding request
+    std::vector<Connection> clients;
+    std::vector<PendingRequest> pending;
+    size_t pending_pixels = 0;
+
+    // a batch must fit RunBatch's int offsets
+    size_t batch_pixels = std::min<size_t>(batching_.max_pixels, INT_MAX);
+
+    while (!stop_requested) {
+        // sleep until the oldest request runs out of budget, or poll the stop flag now and then
+        int timeout_ms = 100;
+        if (!pending.empty()) {
+            double age = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - pending.front().arrival).count();
+            timeout_ms = std::max(0, (int)std::ceil(batching_.max_wait_ms - age));
+        }
+
+        std::vector<pollfd> fds;
+        fds.push_back({ listener, POLLIN, 0 });
+        for (const Connection& connection : clients)
+            fds.push_back({ connection.fd, POLLIN, 0 });
+
+        int ready = poll(fds.data(), fds.size(), timeout_ms);
+        if (ready < 0 && errno != EINTR) {
+            std::cerr << "poll: " << std::strerror(errno) << std::endl;
+            break;
+        }
+
+        if (ready > 0) {
+            // fds[i + 1] is polled[i], connections that stay open go back to clients
+            std::vector<Connection> polled;
+            polled.swap(clients);
+
+            for (size_t i = 0; i < polled.size(); i++) {
+                Connection& connection = polled[i];
+                if (fds[i + 1].revents == 0) {
+                    clients.push_back(std::move(connection));
+                    continue;
+                }
+
+                // take what has arrived, a request sent in pieces is queued once its last byte is in
+                bool complete = false;
+                if (!ReadSome(connection, complete)) {
+                    close(connection.fd);
+                    continue;
+                }
+                if (!complete) {
+                    clients.push_back(std::move(connection));
+                    continue;
+                }
+
+                int fd = connection.fd;
+                PendingRequest request;
+                request.fd = fd;
+                request.header = connection.header;
+                request.pixels = std::move(connection.pixels);
+                request.arrival = std::chrono::steady_clock::now();
+
+                // not batching or too big to share a launch, equalise it alone straight away
+                if (batching_.max_images <= 1 || request.pixels.size() > batch_pixels) {
+                    if (Answer(fd, request.header, request.pixels, request.arrival))
+                        clients.push_back(Connection(fd));
+                    else
+                        close(fd);
+                    continue;
+                }
+
+                if (pending_pixels + request.pixels.size() > batch_pixels) {
+                    RunPending(pending, clients, true);
+                    pending_pixels = 0;
+                }
+
+                pending_pixels += request.pixels.size();
+                pending.push_back(std::move(request));
+            }
+
+            if (fds[0].revents & POLLIN) {
+                int fd = accept(listener, nullptr, nullptr);
+                if (fd >= 0) {
+                    // reads never wait for a slow client, see ReadSome
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                    clients.push_back(Connection(fd));
+                }
+            }
+        }
+
+        if (metrics_)
+            metrics_->Set("heq_pending_requests", {}, (double)pending.size());
+        if (latency_)
+            latency_->Tick();
+
+        if (pending.empty())
+            continue;
+
+        double age = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - pending.front().arrival).count();
+        bool full = pending.size() >= batching_.max_images;
+        if (full || age >= batching_.max_wait_ms) {
+            RunPending(pending, clients, full);
+            pending_pixels = 0;
+        }
+    }
+
+    // requests already read are still answered
+    if (!pending.empty())
+        RunPending(pending, clients, false);
+
+    for (const Connection& connection : clients)
+        close(connection.fd);
+}
+
+void EqualizeServer::RunPending(std::vector<PendingRequest>& pending, std::vector<Connection>& clients, bool full) {
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<ImageView> images;
+    std::vector<unsigned char*> outputs;
+    double oldest_wait_ms = 0;
+    for (PendingRequest& request : pending) {
+        double wait_ms = std::chrono::duration<double, std::milli>(start - request.arrival).count();
+        oldest_wait_ms = std::max(oldest_wait_ms, wait_ms);
+        total_wait_ms_ += wait_ms;
+
+        // RunBatch packs the inputs before anything is written, so the request buffers take the results
+        images.push_back({ request.pixels.data(), request.pixels.size() });
+        outputs.push_back(request.pixels.data());
+    }
+    max_wait_seen_ms_ = std::max(max_wait_seen_ms_, oldest_wait_ms);
+
+    if (batch_sizes_.size() <= pending.size())
+        batch_sizes_.resize(pending.size() + 1, 0);
+    batch_sizes_[pending.size()]++;
+    if (full)
+        full_batches_++;
+    else
+        deadline_batches_++;
+
+    BatchResult result;
+    ResponseStatus status = STATUS_OK;
+    std::string message;
+    try {
+        equalizer_.RunBatch(images, outputs, options_, result);
+    }
+    catch (const cl::Error& err) {
+        status = STATUS_FAILED;
+        message = std::string(err.what()) + " (" + getErrorString(err.err()) + ")";
+        if (metrics_)
+            RecordError(*metrics_, "socket_batch", getErrorString(err.err()));
+    }
+    catch (const std::exception& err) {
+        status = STATUS_FAILED;
+        message = err.what();
+        if (metrics_)
+            RecordError(*metrics_, "socket_batch", "host");
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    if (status == STATUS_OK) {
+        if (metrics_) {
+            RecordBatch(*metrics_, "socket_batch", result);
+            metrics_->Observe("heq_batch_wait_seconds", {}, oldest_wait_ms / 1000);
+            metrics_->Increment("heq_batches_total", { { "flush", full ? "full" : "deadline" } });
+        }
+        requests_ += pending.size();
+        std::cout << "Batch of " << pending.size() << " request(s), " << result.pixels << " pixels in " << ms
+            << " ms, oldest waited " << oldest_wait_ms << " ms (" << (full ? "full" : "deadline") << ")" << std::endl;
+    }
+    else {
+        std::cerr << "Batch of " << pending.size() << " request(s) failed: " << message << std::endl;
+    }
+
+    // of the whole batch, each request is given its share of the pixels
+    double device_seconds = -1;
+    if (status == STATUS_OK && result.upload_event() && result.download_event() && result.pixels > 0)
+        device_seconds = EventSpan(result.upload_event, result.download_event) * 1e-9;
+
+    // scatter the results, every connection that is still there can send its next request
+    for (PendingRequest& request : pending) {
+        bool sent = (status == STATUS_OK)
+            ? SendResponse(request.fd, STATUS_OK, request.header, "", request.pixels.data(), request.pixels.size())
+            : SendResponse(request.fd, status, request.header, message, nullptr, 0);
+        if (latency_ && status == STATUS_OK)
+            latency_->Record(std::chrono::duration<double>(std::chrono::steady_clock::now() - request.arrival).count(),
+                std::chrono::duration<double>(start - request.arrival).count(),
+                device_seconds >= 0 ? device_seconds * request.pixels.size() / result.pixels : -1);
+        if (sent)
+            clients.push_back(Connection(request.fd));
+        else
+            close(request.fd);
+    }
+
+    pending.clear();
+}
+
+void EqualizeServer::ReportBatching() const {
+    uint64_t batches = full_batches_ + deadline_batches_;
+    if (batches == 0)
+        return;
+
+    uint64_t batched = 0;
+    for (size_t size = 0; size < batch_sizes_.size(); size++)
+        batched += size * batch_sizes_[size];
+
+    std::cout << "Batches: " << batches << ", mean size " << (double)batched / batches << ", " << full_batches_
+        << " full, " << deadline_batches_ << " on the latency budget" << std::endl;
+    std::cout << "Queue wait: mean " << total_wait_ms_ / batched << " ms, max " << max_wait_seen_ms_ << " ms" << std::endl;
+
+    std::cout << "Batch sizes:";
+    for (size_t size = 1; size < batch_sizes_.size(); size++)
+        if (batch_sizes_[size] > 0)
+            std::cout << " " << size << "x" << batch_sizes_[size];
+    std::cout << std::endl;
+}
+
+#ifdef __linux__
+int EqualizeServer::ServeRing(const std::string& name, uint32_t slots, uint64_t slot_bytes) {
+    std::string error;
+    std::unique_ptr<SharedRing> ring = SharedRing::Create(name, slots, slot_bytes, error);
+    if (!ring) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+
+    // wrap every input and output area once, on shared memory devices the kernels read the
+    // producer's pages directly
+    std::vector<cl::Buffer> inputs;
+    std::vector<cl::Buffer> outputs;
+    for (uint32_t slot = 0; slot < slots; slot++) {
+        inputs.emplace_back(equalizer_.Context(), CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, ring->SlotBytes(), ring->Input(slot));
+        outputs.emplace_back(equalizer_.Context(), CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, ring->SlotBytes(), ring->Output(slot));
+    }
+
+    InstallStopHandlers();
+    equalizer_.ProgramFor(options_, 0);
+    std::cout << "Serving shared memory ring " << name << ", " << slots << " slot(s) of " << ring->SlotBytes()
+        << " bytes, stop with Ctrl+C" << std::endl;
+
+    const cl::CommandQueue& queue = equalizer_.Queue();
+
+    // slots are taken in the order producers claimed them, polling the stop flag between waits
+    while (!stop_requested) {
+        if (latency_)
+            latency_->Tick();
+
+        int slot = ring->NextReady(100);
+        if (slot < 0)
+            continue;
+
+        RingSlot& header = ring->Slot(slot);
+        uint64_t size = 0;
+        if (!ImagePixels(header.width, header.height, header.planes, size) || size == 0
+            || size > ring->SlotBytes() || size > max_pixels_) {
+            std::cerr << "Slot " << slot << ": bad image size" << std::endl;
+            ring->Complete(slot, STATUS_BAD_REQUEST);
+            continue;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        double device_seconds = -1;
+        try {
+            // the producer wrote through its own mapping, a map and unmap tells the runtime the
+            // host copy changed. invalidating the region keeps a runtime that mirrors the buffer from
+            // copying its stale device copy over the new pixels; on shared memory devices neither copies
+            void* mapped = queue.enqueueMapBuffer(inputs[slot], CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 0, size);
+            queue.enqueueUnmapMemObject(inputs[slot], mapped);
+
+            EqualizeResult result;
+            equalizer_.RunBuffers(inputs[slot], outputs[slot], ring->Input(slot), size, options_, result);
+            if (metrics_)
+                RecordRun(*metrics_, "ring", result, size);
+            device_seconds = DeviceSeconds(result);
+
+            // and the reverse, so the result is visible in the output area
+            mapped = queue.enqueueMapBuffer(outputs[slot], CL_TRUE, CL_MAP_READ, 0, size);
+            queue.enqueueUnmapMemObject(outputs[slot], mapped);
+            queue.finish();
+        }
+        catch (const cl::Error& err) {
+            std::cerr << "Slot " << slot << " failed: " << err.what() << " (" << getErrorString(err.err()) << ")" << std::endl;
+            if (metrics_)
+                RecordError(*metrics_, "ring", getErrorString(err.err()));
+            ring->Complete(slot, STATUS_FAILED);
+            continue;
+        }
+        catch (const std::exception& err) {
+            std::cerr << "Slot " << slot << " failed: " << err.what() << std::endl;
+            if (metrics_)
+                RecordError(*metrics_, "ring", "host");
+            ring->Complete(slot, STATUS_FAILED);
+            continue;
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        // the producer's submit time is not in the slot, so there is no queue wait
+        if (latency_)
+            latency_->Record(ms / 1000, -1, device_seconds);
+
+        requests_++;
+        std::cout << "Slot " << slot << ": " << header.width << "x" << header.height << "x" << header.planes
+            << " in " << ms << " ms" << std::endl;
+        ring->Complete(slot, STATUS_OK);
+    }
+
+    std::cout << "Served " << requests_ << " request(s)" << std::endl;
+    return 0;
+}
+
+bool EqualizeShared(const std::string& name, const unsigned char* input, uint32_t width, uint32_t height,
+    uint32_t planes, std::vector<unsigned char>& output, std::string& error, int timeout_ms) {
+    std::unique_ptr<SharedRing> ring = SharedRing::Open(name, error);
+    if (!ring)
+        return false;
+
+    size_t size = (size_t)width * height * planes;
+    if (size > ring->SlotBytes()) {
+        error = "image of " + std::to_string(size) + " bytes does not fit a " + std::to_string(ring->SlotBytes()) + " byte slot";
+        return false;
+    }
+
+    // a capture process would decode straight into the slot instead of copying
+    uint32_t slot = ring->Claim();
+    RingSlot& header = ring->Slot(slot);
+    header.width = width;
+    header.height = height;
+    header.planes = planes;
+    std::memcpy(ring->Input(slot), input, size);
+    ring->Submit(slot);
+
+    if (!ring->WaitDone(slot, timeout_ms)) {
+        // WaitDone has already given the slot back: withdrawn if the equalizer had not taken it,
+        // otherwise once its result was in, which is then discarded
+        error = "no result from ring " + name + " within " + std::to_string(timeout_ms) + " ms";
+        return false;
+    }
+
+    bool ok = header.status == STATUS_OK;
+    if (ok)
+        output.assign(ring->Output(slot), ring->Output(slot) + size);
+    else
+        error = "request rejected";
+
+    ring->Release(slot);
+    return ok;
+}
+#endif
+
+bool EqualizeRemote(const std::string& socket_path, const unsigned char* input, uint32_t width, uint32_t height,
+    uint32_t planes, std::vector<unsigned char>& output, std::string& error) {
+    sockaddr_un address;
+    if (!SocketAddress(socket_path, address, error))
+        return false;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+        error = "cannot connect to " + socket_path + ": " + std::strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)width * height * planes;
+    RequestHeader request = { protocol_magic, width, height, planes };
+    ResponseHeader response;
+    bool ok = WriteAll(fd, &request, sizeof(request)) && WriteAll(fd, input, size)
+        && ReadAll(fd, &response, sizeof(response)) && response.magic == protocol_magic;
+
+    if (ok && response.message_length > 0) {
+        error.resize(response.message_length);
+        ok = ReadAll(fd, &error[0], response.message_length);
+    }
+
+    if (!ok) {
+        if (error.empty())
+            error = "connection to " + socket_path + " lost";
+    }
+    else if (response.status != STATUS_OK) {
+        ok = false;
+        if (error.empty())
+            error = "request rejected";
+    }
+    else {
+        output.resize(size);
+        ok = ReadAll(fd, output.data(), size);
+        if (!ok)
+            error = "connection to " + socket_path + " lost";
+    }
+
+    close(fd);
+    return ok;
+}
+
+#endif
@@ -0,0 +1,146 @@
+#pragma once
+
+// Unix domain socket daemon and client, POSIX only
+#ifndef _WIN32
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "equalizer.h"
+#include "latency_histogram.h"
+#include "metrics.h"
+
+// Wire protocol, native byte order since both ends share the host. A connection carries any
+// number of requests, each answered before the next is read:
+//   request:  RequestHeader, then width * height * planes pixels
+//   response: ResponseHeader, then message_length bytes of error text, then the equalised pixels
+const uint32_t protocol_magic = 0x31514548; // "HEQ1"
+
+struct RequestHeader {
+    uint32_t magic;
+    uint32_t width;
+    uint32_t height;
+    uint32_t planes;    // depth * spectrum
+};
+
+enum ResponseStatus : uint32_t {
+    STATUS_OK = 0,
+    STATUS_BAD_REQUEST = 1,     // wrong magic or an empty or oversized image, the connection is closed
+    STATUS_FAILED = 2           // the pipeline threw, message says why
+};
+
+struct ResponseHeader {
+    uint32_t magic;
+    uint32_t status;
+    uint32_t width;
+    uint32_t height;
+    uint32_t planes;
+    uint32_t message_length;
+};
+
+// Limits of the batching scheduler. requests from different connections are queued until
+// max_images are waiting, their pixels would pass max_pixels, or the oldest has waited max_wait_ms,
+// then equalised together with one RunBatch launch per stage
+struct ServerBatching {
+    size_t max_images = 1;                  // 1 answers every request on its own
+    size_t max_pixels = 64 * 1024 * 1024;   // larger images are equalised alone
+    double max_wait_ms = 2;                 // latency budget spent waiting for company
+};
+
+// Keeps one context, its compiled programs and the device arena warm and equalises the images
+// sent to a Unix socket one request at a time, so a request costs only the transfers and kernels.
+// all connections are polled together
+class EqualizeServer {
+public:
+    EqualizeServer(Equalizer& equalizer, const EqualizeOptions& options);
+
+    // largest image accepted, in pixels. defaults to the largest the device can hold in one allocation
+    void SetMaxPixels(uint64_t max_pixels) { max_pixels_ = max_pixels; }
+
+    // batch concurrent socket requests, see ServerBatching
+    void SetBatching(const ServerBatching& batching) { batching_ = batching; }
+
+    // record every request, batch and failure in metrics
+    void SetMetrics(MetricsRegistry* metrics) { metrics_ = metrics; }
+
+    // record wall time, queue wait and device time of every request in latency
+    void SetLatency(LatencyTracker* latency) { latency_ = latency; }
+
+    // listen on socket_path until SIGINT or SIGTERM, returns non-zero if the socket cannot be set up
+    int Serve(const std::string& socket_path);
+
+#ifdef __linux__
+    // equalise images producers place in the shared memory ring /name until SIGINT or SIGTERM.
+    // slots are wrapped in CL_MEM_USE_HOST_PTR buffers once, so pixels are never copied by the host
+    int ServeRing(const std::string& name, uint32_t slots, uint64_t slot_bytes);
+#endif
+
+private:
+    // A client connection and the request arriving on it, read in whatever pieces the socket gives
+    struct Connection {
+        explicit Connection(int fd) : fd(fd) {}
+
+        int fd;
+        RequestHeader header = {};
+        size_t header_read = 0;
+        std::vector<unsigned char> pixels;      // sized once the header is in
+        size_t pixels_read = 0;
+    };
+
+    // A request read from a connection, waiting for its batch
+    struct PendingRequest {
+        int fd;
+        RequestHeader header;
+        std::vector<unsigned char> pixels;
+        std::chrono::steady_clock::time_point arrival;
+    };
+
+    // read what has arrived on a non-blocking connection, complete once a whole request is in.
+    // false when the connection should be closed, a bad header is answered here
+    bool ReadSome(Connection& connection, bool& complete);
+
+    // equalise one request in place and send the response, false if the client went away.
+    // arrival is when the request had been read
+    bool Answer(int fd, const RequestHeader& request, std::vector<unsigned char>& pixels,
+        std::chrono::steady_clock::time_point arrival);
+
+    // poll every connection and answer one request per ready connection at a time, alone or in
+    // batches, until stopped. an idle connection never holds up the others
+    void ServeConnections(int listener);
+
+    // equalise the queued requests with RunBatch and answer them, connections still open go back
+    // to clients. full tells whether the batch hit a size limit or the latency budget
+    void RunPending(std::vector<PendingRequest>& pending, std::vector<Connection>& clients, bool full);
+
+    // batch size histogram, queue wait and flush reasons
+    void ReportBatching() const;
+
+    Equalizer& equalizer_;
+    EqualizeOptions options_;
+    uint64_t max_pixels_;
+    uint64_t requests_ = 0;
+
+    ServerBatching batching_;
+    MetricsRegistry* metrics_ = nullptr;
+    LatencyTracker* latency_ = nullptr;
+    std::vector<uint64_t> batch_sizes_;     // batches seen of each size, index is the number of requests
+    uint64_t full_batches_ = 0;             // flushed on max_images or max_pixels
+    uint64_t deadline_batches_ = 0;         // flushed when the oldest request ran out of budget
+    double total_wait_ms_ = 0;              // queue wait summed over every batched request
+    double max_wait_seen_ms_ = 0;
+};
+
+#ifdef __linux__
+// equalise one image through the shared memory ring /name, waiting up to timeout_ms for the result
+bool EqualizeShared(const std::string& name, const unsigned char* input, uint32_t width, uint32_t height,
+    uint32_t planes, std::vector<unsigned char>& output, std::string& error, int timeout_ms = 60000);
+#endif
+
+// send one image to the server on socket_path, output receives the equalised pixels.
+// returns false with a reason in error when the server cannot be reached or rejects the image
+bool EqualizeRemote(const std::string& socket_path, const unsigned char* input, uint32_t width, uint32_t height,
+    uint32_t planes, std::vector<unsigned char>& output, std::string& error);
+
+#endif
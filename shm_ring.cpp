@@ -0,0 +1,251 @@
+#include "shm_ring.h"
+
+#ifdef __linux__
+
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+const size_t page_size = 4096;
+
+size_t PageRoundUp(size_t n) {
+    return ((n + page_size - 1) / page_size) * page_size;
+}
+
+size_t HeaderBytes(uint32_t slots) {
+    return PageRoundUp(sizeof(RingHeader) + slots * sizeof(RingSlot));
+}
+
+// futex words live in memory shared between processes, so no FUTEX_PRIVATE_FLAG
+void FutexWait(std::atomic<uint32_t>& word, uint32_t value, const timespec* timeout) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, value, timeout, nullptr, 0);
+}
+
+void FutexWakeAll(std::atomic<uint32_t>& word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// wait until word holds wanted, timeout_ms < 0 waits for ever. false on timeout
+bool WaitFor(std::atomic<uint32_t>& word, uint32_t wanted, int timeout_ms) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+    for (;;) {
+        uint32_t value = word.load(std::memory_order_acquire);
+        if (value == wanted)
+            return true;
+
+        if (timeout_ms < 0) {
+            FutexWait(word, value, nullptr);
+            continue;
+        }
+
+        auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if (remaining <= 0)
+            return false;
+
+        timespec timeout = { (time_t)(remaining / 1000000000), (long)(remaining % 1000000000) };
+        FutexWait(word, value, &timeout);
+    }
+}
+
+void SetState(std::atomic<uint32_t>& word, SlotState state) {
+    word.store(state, std::memory_order_release);
+    FutexWakeAll(word);
+}
+
+}
+
+SharedRing::~SharedRing() {
+    if (base_)
+        munmap(base_, mapped_bytes_);
+    if (owner_)
+        shm_unlink(name_.c_str());
+}
+
+std::unique_ptr<SharedRing> SharedRing::Create(const std::string& name, uint32_t slots, uint64_t slot_bytes, std::string& error) {
+    size_t area = PageRoundUp(slot_bytes);
+    size_t header_bytes = HeaderBytes(slots);
+    size_t total = header_bytes + (size_t)slots * 2 * area;
+
+    // a segment left behind by a crashed run would keep its old layout
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        error = "shm_open " + name + ": " + std::strerror(errno);
+        return nullptr;
+    }
+
+    if (ftruncate(fd, total) < 0) {
+        error = "ftruncate " + name + ": " + std::strerror(errno);
+        close(fd);
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+
+    void* base = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        error = "mmap " + name + ": " + std::strerror(errno);
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+
+    std::unique_ptr<SharedRing> ring(new SharedRing());
+    ring->name_ = name;
+    ring->owner_ = true;
+    ring->base_ = base;
+    ring->mapped_bytes_ = total;
+    ring->data_offset_ = header_bytes;
+
+    // the fresh segment is zero filled, construct the atomics in place before publishing the magic
+    ring->header_ = new (base) RingHeader();
+    ring->header_->slots = slots;
+    ring->header_->slot_bytes = area;
+    ring->header_->next_claim.store(0);
+    ring->header_->submitted.store(0);
+    ring->slots_ = reinterpret_cast<RingSlot*>(static_cast<char*>(base) + sizeof(RingHeader));
+    for (uint32_t i = 0; i < slots; i++)
+        new (&ring->slots_[i]) RingSlot{ { SLOT_FREE }, 0, 0, 0, 0, 0 };
+
+    std::atomic_thread_fence(std::memory_order_release);
+    ring->header_->magic = ring_magic;
+
+    return ring;
+}
+
+std::unique_ptr<SharedRing> SharedRing::Open(const std::string& name, std::string& error) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        error = "shm_open " + name + ": " + std::strerror(errno);
+        return nullptr;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(RingHeader)) {
+        error = "ring " + name + " is not initialised";
+        close(fd);
+        return nullptr;
+    }
+
+    void* base = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        error = "mmap " + name + ": " + std::strerror(errno);
+        return nullptr;
+    }
+
+    std::unique_ptr<SharedRing> ring(new SharedRing());
+    ring->name_ = name;
+    ring->base_ = base;
+    ring->mapped_bytes_ = info.st_size;
+    ring->header_ = static_cast<RingHeader*>(base);
+    ring->slots_ = reinterpret_cast<RingSlot*>(static_cast<char*>(base) + sizeof(RingHeader));
+
+    if (ring->header_->magic != ring_magic) {
+        error = "ring " + name + " has the wrong magic";
+        return nullptr;
+    }
+    ring->data_offset_ = HeaderBytes(ring->header_->slots);
+
+    return ring;
+}
+
+unsigned char* SharedRing::Input(uint32_t slot) {
+    return static_cast<unsigned char*>(base_) + data_offset_ + (size_t)slot * 2 * header_->slot_bytes;
+}
+
+unsigned char* SharedRing::Output(uint32_t slot) {
+    return Input(slot) + header_->slot_bytes;
+}
+
+uint32_t SharedRing::Claim() {
+    uint32_t ticket = header_->next_claim.fetch_add(1);
+    uint32_t slot = ticket % header_->slots;
+    std::atomic<uint32_t>& state = slots_[slot].state;
+
+    // another producer may have lapped the ring and taken the slot first
+    for (;;) {
+        uint32_t expected = SLOT_FREE;
+        if (state.compare_exchange_strong(expected, SLOT_FILLING, std::memory_order_acquire)) {
+            slots_[slot].ticket = ticket;
+            return slot;
+        }
+        WaitFor(state, SLOT_FREE, -1);
+    }
+}
+
+void SharedRing::Submit(uint32_t slot) {
+    SetState(slots_[slot].state, SLOT_READY);
+    header_->submitted.fetch_add(1, std::memory_order_release);
+    FutexWakeAll(header_->submitted);
+}
+
+bool SharedRing::WaitDone(uint32_t slot, int timeout_ms) {
+    if (WaitFor(slots_[slot].state, SLOT_DONE, timeout_ms))
+        return true;
+
+    uint32_t expected = SLOT_READY;
+    if (slots_[slot].state.compare_exchange_strong(expected, SLOT_FREE)) {
+        FutexWakeAll(slots_[slot].state);
+        return false;
+    }
+
+    // already being equalised, the output area is in use until it is done
+    WaitFor(slots_[slot].state, SLOT_DONE, -1);
+    Release(slot);
+    return false;
+}
+
+void SharedRing::Release(uint32_t slot) {
+    SetState(slots_[slot].state, SLOT_FREE);
+}
+
+int SharedRing::NextReady(int timeout_ms) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+    for (;;) {
+        uint32_t seen = header_->submitted.load(std::memory_order_acquire);
+
+        // oldest ticket first, compared as a difference so the counter may wrap
+        int oldest = -1;
+        for (uint32_t slot = 0; slot < header_->slots; slot++) {
+            if (slots_[slot].state.load(std::memory_order_acquire) != SLOT_READY)
+                continue;
+            if (oldest < 0 || (int32_t)(slots_[slot].ticket - slots_[oldest].ticket) < 0)
+                oldest = slot;
+        }
+
+        if (oldest >= 0) {
+            // the producer may withdraw it at the same moment
+            uint32_t expected = SLOT_READY;
+            if (slots_[oldest].state.compare_exchange_strong(expected, SLOT_BUSY, std::memory_order_acquire))
+                return oldest;
+            continue;
+        }
+
+        auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if (remaining <= 0)
+            return -1;
+
+        timespec timeout = { (time_t)(remaining / 1000000000), (long)(remaining % 1000000000) };
+        FutexWait(header_->submitted, seen, &timeout);
+    }
+}
+
+void SharedRing::Complete(uint32_t slot, uint32_t status) {
+    slots_[slot].status = status;
+    SetState(slots_[slot].state, SLOT_DONE);
+}
+
+#endif
@@ -0,0 +1,92 @@
+#pragma once
+
+// POSIX shared memory ring with futex signalling, Linux only
+#ifdef __linux__
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+const uint32_t ring_magic = 0x52514548; // "HEQR"
+
+// Life of a slot: a producer claims a FREE slot, writes its image and marks it READY, the
+// equalizer takes the oldest READY slot, marks it BUSY and then DONE, and the producer reads
+// the result and hands the slot back as FREE
+enum SlotState : uint32_t {
+    SLOT_FREE = 0,
+    SLOT_FILLING = 1,
+    SLOT_READY = 2,
+    SLOT_BUSY = 3,
+    SLOT_DONE = 4
+};
+
+// Per slot header, the futex word is state
+struct RingSlot {
+    std::atomic<uint32_t> state;
+    uint32_t ticket;    // claim order, the equalizer serves the oldest ready slot first
+    uint32_t width;
+    uint32_t height;
+    uint32_t planes;
+    uint32_t status;    // 0 once equalised, non-zero when the image was rejected or failed
+};
+
+// Start of the segment, followed by the slot headers and then, page aligned, the input and
+// output areas of every slot
+struct RingHeader {
+    uint32_t magic;
+    uint32_t slots;
+    uint64_t slot_bytes;                // capacity of each input and each output area
+    std::atomic<uint32_t> next_claim;   // producers take slots round robin
+    std::atomic<uint32_t> submitted;    // bumped by every submit, the equalizer's futex word
+};
+
+// A mapping of the ring segment /name, shared between one equalizer and any number of producers.
+// input and output areas are page aligned so they can back CL_MEM_USE_HOST_PTR buffers
+class SharedRing {
+public:
+    ~SharedRing();
+
+    SharedRing(const SharedRing&) = delete;
+    SharedRing& operator=(const SharedRing&) = delete;
+
+    // create the segment, replacing any stale one, and unlink it again on destruction
+    static std::unique_ptr<SharedRing> Create(const std::string& name, uint32_t slots, uint64_t slot_bytes, std::string& error);
+
+    // map an existing segment
+    static std::unique_ptr<SharedRing> Open(const std::string& name, std::string& error);
+
+    uint32_t Slots() const { return header_->slots; }
+    uint64_t SlotBytes() const { return header_->slot_bytes; }
+    RingSlot& Slot(uint32_t slot) { return slots_[slot]; }
+    unsigned char* Input(uint32_t slot);
+    unsigned char* Output(uint32_t slot);
+
+    // producer: take the next slot in ring order, waiting while it is still in use
+    uint32_t Claim();
+    // producer: hand a filled slot to the equalizer
+    void Submit(uint32_t slot);
+    // producer: wait up to timeout_ms for the result. on timeout a slot the equalizer has not
+    // started is withdrawn and freed, one it is working on is still waited for, and false is returned
+    bool WaitDone(uint32_t slot, int timeout_ms);
+    // producer: give the slot back once the output has been read
+    void Release(uint32_t slot);
+
+    // equalizer: wait up to timeout_ms for a submitted slot and mark the oldest BUSY, -1 on timeout
+    int NextReady(int timeout_ms);
+    // equalizer: publish the result of a slot
+    void Complete(uint32_t slot, uint32_t status);
+
+private:
+    SharedRing() {}
+
+    std::string name_;
+    bool owner_ = false;
+    void* base_ = nullptr;
+    size_t mapped_bytes_ = 0;
+    size_t data_offset_ = 0;
+    RingHeader* header_ = nullptr;
+    RingSlot* slots_ = nullptr;
+};
+
+#endif
@@ -0,0 +1,299 @@
+#include "thread_pool.h"
+
+#include <chrono>
+#include <sstream>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace {
+
+// index of the pool worker running on this thread, -1 elsewhere
+thread_local int current_worker = -1;
+thread_local const void* current_pool = nullptr;
+
+void PinCurrentThread(size_t core) {
+#ifdef _WIN32
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (core % (sizeof(DWORD_PTR) * 8)));
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % CPU_SETSIZE, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)core;
+#endif
+}
+
+}
+
+ThreadPool::ThreadPool(int threads, bool pin) {
+    if (threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (int i = 0; i < threads; i++)
+        workers_.emplace_back(new Worker());
+
+    // start the threads only once every deque exists, workers steal from each other straight away
+    for (int i = 0; i < threads; i++)
+        workers_[i]->thread = std::thread(&ThreadPool::WorkerLoop, this, i, pin);
+}
+
+ThreadPool::~ThreadPool() {
+    // an exception nobody waited for has no one left to report it to
+    try {
+        Wait();
+    }
+    catch (...) {
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+
+    for (auto& worker : workers_)
+        worker->thread.join();
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+    pending_++;
+
+    // workers push onto their own deque, everyone else spreads the work round-robin
+    size_t target = (current_pool == this && current_worker >= 0) ? (size_t)current_worker : next_++ % workers_.size();
+    {
+        std::lock_guard<std::mutex> lock(workers_[target]->mutex);
+        workers_[target]->tasks.push_back(std::move(task));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+    }
+    wake_.notify_one();
+}
+
+bool ThreadPool::Pop(size_t index, Task& task) {
+    Worker& worker = *workers_[index];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (worker.tasks.empty())
+        return false;
+
+    task = std::move(worker.tasks.back());
+    worker.tasks.pop_back();
+    return true;
+}
+
+bool ThreadPool::Steal(size_t thief, Task& task) {
+    size_t count = workers_.size();
+
+    for (size_t offset = 1; offset <= count; offset++) {
+        size_t victim_index = (thief + offset) % count;
+        if (victim_index == thief && thief < count)
+            continue;
+
+        Worker& victim = *workers_[victim_index];
+        std::deque<Task> loot;
+        {
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (victim.tasks.empty())
+                continue;
+
+            // steal the older half, rounded up so a single task can move
+            size_t take = (victim.tasks.size() + 1) / 2;
+            for (size_t i = 0; i < take; i++) {
+                loot.push_back(std::move(victim.tasks.front()));
+                victim.tasks.pop_front();
+            }
+        }
+
+        task = std::move(loot.front());
+        loot.pop_front();
+
+        // threads outside the pool run what they take and leave the rest to the workers
+        if (thief < count) {
+            Worker& self = *workers_[thief];
+            self.steals++;
+            self.stolen_tasks += loot.size() + 1;
+
+            std::lock_guard<std::mutex> lock(self.mutex);
+            for (Task& t : loot)
+                self.tasks.push_back(std::move(t));
+        }
+        else if (!loot.empty()) {
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            for (auto it = loot.rbegin(); it != loot.rend(); ++it)
+                victim.tasks.push_front(std::move(*it));
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+void ThreadPool::Execute(int index, Task& task) {
+    auto start = std::chrono::steady_clock::now();
+
+    // a throw must not unwind the worker thread, which would terminate the program
+    try {
+        task();
+    }
+    catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex_);
+        if (!error_)
+            error_ = std::current_exception();
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    if (index >= 0) {
+        workers_[index]->busy_ns += elapsed;
+        workers_[index]->tasks_run++;
+    }
+
+    if (--pending_ == 0) {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        idle_.notify_all();
+    }
+}
+
+bool ThreadPool::RunOne(int index) {
+    Task task;
+    size_t self = (index >= 0) ? (size_t)index : workers_.size();
+
+    if ((index >= 0 && Pop(index, task)) || Steal(self, task)) {
+        Execute(index, task);
+        return true;
+    }
+
+    return false;
+}
+
+void ThreadPool::WorkerLoop(size_t index, bool pin) {
+    current_worker = (int)index;
+    current_pool = this;
+
+    if (pin)
+        PinCurrentThread(index);
+
+    while (true) {
+        if (RunOne((int)index))
+            continue;
+
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        if (stop_)
+            return;
+
+        // re-check under the lock so a Submit between RunOne and here is not missed for long
+        wake_.wait_for(lock, std::chrono::milliseconds(1));
+        if (stop_)
+            return;
+    }
+}
+
+void ThreadPool::Wait() {
+    int self = (current_pool == this) ? current_worker : -1;
+
+    while (pending_ > 0) {
+        if (RunOne(self))
+            continue;
+
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        idle_.wait_for(lock, std::chrono::milliseconds(1), [this] { return pending_ == 0; });
+    }
+
+    std::exception_ptr error;
+    {
+        std::lock_guard<std::mutex> lock(error_mutex_);
+        std::swap(error, error_);
+    }
+    if (error)
+        std::rethrow_exception(error);
+}
+
+void ThreadPool::ParallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& body) {
+    if (begin >= end)
+        return;
+    if (grain == 0)
+        grain = 1;
+
+    size_t tiles = (end - begin + grain - 1) / grain;
+    if (tiles == 1) {
+        body(begin, end);
+        return;
+    }
+
+    // a private counter and error, so nested loops and other submitters neither extend the wait
+    // nor see this loop's exception
+    struct Loop {
+        std::atomic<size_t> remaining;
+        std::mutex mutex;
+        std::exception_ptr error;
+    };
+    std::shared_ptr<Loop> loop = std::make_shared<Loop>();
+    loop->remaining = tiles;
+
+    for (size_t tile = 0; tile < tiles; tile++) {
+        size_t tile_begin = begin + tile * grain;
+        size_t tile_end = std::min(end, tile_begin + grain);
+        Submit([&body, loop, tile_begin, tile_end] {
+            try {
+                body(tile_begin, tile_end);
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(loop->mutex);
+                if (!loop->error)
+                    loop->error = std::current_exception();
+            }
+            loop->remaining--;
+        });
+    }
+
+    int self = (current_pool == this) ? current_worker : -1;
+    while (loop->remaining > 0) {
+        if (!RunOne(self))
+            std::this_thread::yield();
+    }
+
+    // every tile is done, so body and whatever it refers to are no longer in use
+    if (loop->error)
+        std::rethrow_exception(loop->error);
+}
+
+std::vector<WorkerStats> ThreadPool::Stats() const {
+    std::vector<WorkerStats> stats(workers_.size());
+
+    for (size_t i = 0; i < workers_.size(); i++) {
+        stats[i].busy_seconds = workers_[i]->busy_ns / 1e9;
+        stats[i].tasks = workers_[i]->tasks_run;
+        stats[i].steals = workers_[i]->steals;
+        stats[i].stolen_tasks = workers_[i]->stolen_tasks;
+    }
+
+    return stats;
+}
+
+void ThreadPool::ResetStats() {
+    for (auto& worker : workers_) {
+        worker->busy_ns = 0;
+        worker->tasks_run = 0;
+        worker->steals = 0;
+        worker->stolen_tasks = 0;
+    }
+}
+
+std::string ThreadPool::StatsReport() const {
+    std::stringstream sstream;
+    std::vector<WorkerStats> stats = Stats();
+
+    for (size_t i = 0; i < stats.size(); i++) {
+        sstream << "Worker " << i << ": busy " << stats[i].busy_seconds * 1000 << " ms, " << stats[i].tasks << " task(s), "
+            << stats[i].steals << " steal(s) taking " << stats[i].stolen_tasks << " task(s)" << std::endl;
+    }
+
+    return sstream.str();
+}
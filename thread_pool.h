@@ -0,0 +1,88 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Per-worker counters, busy_seconds is time spent running tasks
+struct WorkerStats {
+    double busy_seconds = 0;
+    uint64_t tasks = 0;
+    uint64_t steals = 0;        // successful steal attempts
+    uint64_t stolen_tasks = 0;  // tasks taken by those steals
+};
+
+// Work-stealing pool. Each worker owns a deque, runs its own newest task first and, when it
+// runs dry, steals the older half of a victim's deque. Tasks submitted from outside the pool
+// are spread round-robin over the workers
+class ThreadPool {
+public:
+    // threads = 0 uses one worker per hardware thread, pin binds worker i to core i
+    explicit ThreadPool(int threads = 0, bool pin = false);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void Submit(std::function<void()> task);
+
+    // block until every submitted task has finished, the caller helps run them. rethrows the
+    // first exception a submitted task threw since the last Wait, the rest are dropped
+    void Wait();
+
+    // run body(tile_begin, tile_end) over [begin, end) in tiles of grain, returns when all are done.
+    // safe to call from inside a task, the caller runs tasks while it waits. once every tile has
+    // run, the first exception body threw is rethrown
+    void ParallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& body);
+
+    size_t Threads() const { return workers_.size(); }
+
+    std::vector<WorkerStats> Stats() const;
+    void ResetStats();
+
+    // one line per worker
+    std::string StatsReport() const;
+
+private:
+    typedef std::function<void()> Task;
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+        std::thread thread;
+
+        std::atomic<uint64_t> busy_ns{ 0 };
+        std::atomic<uint64_t> tasks_run{ 0 };
+        std::atomic<uint64_t> steals{ 0 };
+        std::atomic<uint64_t> stolen_tasks{ 0 };
+    };
+
+    void WorkerLoop(size_t index, bool pin);
+
+    // pop from own deque or steal, then run one task. index is the worker or -1 for outside threads
+    bool RunOne(int index);
+    bool Pop(size_t index, Task& task);
+    bool Steal(size_t thief, Task& task);
+    void Execute(int index, Task& task);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<size_t> pending_{ 0 };      // submitted and not yet finished
+    std::atomic<size_t> next_{ 0 };         // round-robin target for outside submissions
+    std::atomic<bool> stop_{ false };
+
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;          // new work or shutdown
+    std::condition_variable idle_;          // pending_ reached zero
+
+    std::mutex error_mutex_;
+    std::exception_ptr error_;              // first task exception, for Wait to rethrow
+};